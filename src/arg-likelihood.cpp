@@ -477,7 +477,7 @@ int main(int argc, char **argv)
     // probably never used in this program
     if (c.randseed == 0)
         c.randseed = time(NULL);
-    srand(c.randseed);
+    seed_random(c.randseed);
     printLog(LOG_LOW, "random seed: %d\n", c.randseed);
 
     vector<class MigEvent> migevents;
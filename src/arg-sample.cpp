@@ -5,12 +5,16 @@
 #include <time.h>
 #include <memory>
 #include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
 
 // arghmm includes
+#include "argweaver/arg_stats.h"
+#include "argweaver/checkpoint.h"
 #include "argweaver/compress.h"
 #include "argweaver/ConfigParam.h"
 #include "argweaver/emit.h"
+#include "argweaver/forward_kernel.h"
 #include "argweaver/fs.h"
 #include "argweaver/logging.h"
 #include "argweaver/mem.h"
@@ -23,6 +27,7 @@
 #include "argweaver/mcmcmc.h"
 #include "argweaver/coal_records.h"
 #include "argweaver/recomb.h"
+#include "argweaver/writer.h"
 
 
 using namespace argweaver;
@@ -41,6 +46,7 @@ const char *SITES_SUFFIX = ".sites";
 const char *STATS_SUFFIX = ".stats";
 const char *LOG_SUFFIX = ".log";
 const char *COAL_RECORDS_SUFFIX = ".cr";
+const char *CHECKPOINT_SUFFIX = ".checkpoint";
 
 // help categories
 const int ADVANCED_OPT = 1;
@@ -51,12 +57,49 @@ const int EXIT_ERROR = 1;
 
 
 
+// output files of the chains of --mc3-threads
+//
+// Output follows the heat group rather than the chain, so chains trade
+// their files when they swap heats, as the MPI processes of --mcmcmc do.
+struct Mc3Chains
+{
+    Mc3Chains(int ngroups, double heat_interval, int niters,
+              unsigned long long seed) :
+        exchange(ngroups, heat_interval, niters, seed),
+        stats_files(ngroups, NULL),
+        loggers(ngroups, NULL)
+    {}
+
+    // closes the files of the heated groups
+    ~Mc3Chains()
+    {
+        for (unsigned int i=1; i<stats_files.size(); i++) {
+            if (stats_files[i])
+                fclose(stats_files[i]);
+            if (loggers[i]) {
+                loggers[i]->closeLogFile();
+                delete loggers[i];
+            }
+        }
+    }
+
+    Mc3Chains(const Mc3Chains &other) = delete;
+    Mc3Chains &operator=(const Mc3Chains &other) = delete;
+
+    Mc3Exchange exchange;
+    vector<FILE*> stats_files;
+    vector<Logger*> loggers;  // NULL for group 0, which uses g_logger
+};
+
+
 // parsing command-line options
 class Config
 {
 public:
 
-    Config()
+    Config() :
+        mc3_chains(NULL),
+        writer(NULL)
     {
         make_parser();
 
@@ -387,11 +430,17 @@ public:
                    ("", "--mcmcmc", "<int>", &mcmcmc_numgroup,
                     1, "number of mcmcmc threads",
                     EXPERIMENTAL_OPT));
+#endif
+        config.add(new ConfigParam<int>
+                   ("", "--mc3-threads", "<int>", &mc3_threads,
+                    1, "number of (MC)^3 chains to run as threads of this"
+                    " process.  Heated chains write to <prefix>.<group>.*"
+                    " (default=1)",
+                    EXPERIMENTAL_OPT));
         config.add(new ConfigParam<double>
                    ("", "--mcmcmc-heat", "<val>", &mcmcmc_heat,
                     0.05, "heat interval for each thread in (MC)^3 group",
                     EXPERIMENTAL_OPT));
-#endif
         config.add(new ConfigSwitch
                    ("", "--init-popsize-random", &init_popsize_random,
                     "(for use with --sample-popsize). Initialize each"
@@ -410,6 +459,22 @@ public:
                     "region to resample of input ARG (optional)"));
         config.add(new ConfigSwitch
                    ("", "--resume", &resume, "resume a previous run"));
+        config.add(new ConfigParam<int>
+                   ("", "--chunks", "<int>", &chunks, 1,
+                    "number of overlapping chunks of the region to sample"
+                    " at the same time as threads of this process.  Chunks"
+                    " are stitched into one ARG for every stats line and"
+                    " sample (default=1)"));
+        config.add(new ConfigParam<int>
+                   ("", "--chunk-overlap", "<bp>", &chunk_overlap, 100000,
+                    "overlap of neighboring chunks, which is resampled after"
+                    " stitching (default=100000)"));
+        config.add(new ConfigParam<int>
+                   ("", "--checkpoint-step", "<iterations>",
+                    &checkpoint_step, 0,
+                    "number of iterations between binary checkpoints, from"
+                    " which --resume continues the run exactly"
+                    " (default=0, no checkpoints)"));
         config.add(new ConfigSwitch
                    ("", "--overwrite", &overwrite,
                     "force an overwrite of a previous run"));
@@ -434,9 +499,23 @@ public:
         config.add(new ConfigParam<int>
                    ("", "--sample-step", "<sample step size>", &sample_step,
                     10, "number of iterations between steps (default=10)"));
+        config.add(new ConfigParam<int>
+                   ("", "--stats-interval", "<iterations>", &stats_interval,
+                    1, "number of iterations between lines of the stats file"
+                    " (default=1)"));
         config.add(new ConfigSwitch
                    ("", "--no-compress-output", &no_compress_output,
                     "do not gzip output files"));
+        config.add(new ConfigParam<int>
+                   ("", "--write-queue", "<files>", &write_queue, 4,
+                    "number of sampled ARGs that may wait to be written by a"
+                    " background thread; 0 writes them while sampling"
+                    " (default=4)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--compress-threads", "<threads>", &compress_threads,
+                    0, "threads compressing the blocks of each compressed"
+                    " output file; 0 compresses them in the writing thread"
+                    " (default=0)", ADVANCED_OPT));
         config.add(new ConfigParam<int>
                    ("-x", "--randseed", "<random seed>", &randseed, 0,
                     "seed for random number generator (default=current time)"));
@@ -476,6 +555,79 @@ public:
                     &resample_window_iters, 10,
                     "number of iterations per sliding window for resampling"
                     " (default=10)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--adapt-windows", "<iterations>", &adapt_windows, 0,
+                    "adapt the sliding windows to the local trees and the"
+                    " acceptance rate during this many burn-in iterations,"
+                    " then keep them fixed (default=0, no adaptation)",
+                    ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--resample-threads", "<threads>",
+                    &resample_threads, 1,
+                    "threads for resampling windows, which are resampled"
+                    " in two passes of disjoint windows offset by half a"
+                    " window; the result does not depend on the number of"
+                    " threads (default=1)", ADVANCED_OPT));
+        config.add(new ConfigParam<string>
+                   ("", "--forward-kernel", "<kernel>", &forward_kernel,
+                    "auto",
+                    "implementation of the forward algorithm inner loop:"
+                    " auto, scalar, sse2, avx2, or avx512 (default=auto,"
+                    " fastest kernel supported by the CPU)", ADVANCED_OPT));
+        config.add(new ConfigParam<string>
+                   ("", "--forward-table", "<mode>", &forward_table,
+                    "auto",
+                    "storage of the forward table during threading: full,"
+                    " float (single precision columns), checkpoint (keep"
+                    " every k-th column and recompute the rest during"
+                    " traceback), or auto (full, float or checkpoint,"
+                    " whichever first fits --forward-memory; default=auto)",
+                    ADVANCED_OPT));
+        config.add(new ConfigParam<double>
+                   ("", "--forward-memory", "<MB>", &forward_memory, 0.0,
+                    "memory budget in MB for a full forward table before"
+                    " switching to checkpoints (default=0, no limit)",
+                    ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--checkpoint-spacing", "<columns>",
+                    &checkpoint_spacing, 0,
+                    "columns between forward table checkpoints"
+                    " (default=0, square root of the region length)",
+                    ADVANCED_OPT));
+        config.add(new ConfigSwitch
+                   ("", "--skip-invariant", &skip_invariant,
+                    "jump over runs of identical sites in the forward"
+                    " algorithm using powers of the transition matrix"
+                    " (uses a checkpointed forward table)", ADVANCED_OPT));
+        config.add(new ConfigParam<double>
+                   ("", "--matrix-cache", "<MB>", &matrix_cache, 32.0,
+                    "memory in MB for reusing the transition matrices of"
+                    " blocks with the same lineage counts, shared by all"
+                    " threads (default=32, 0 disables)", ADVANCED_OPT));
+        config.add(new ConfigParam<double>
+                   ("", "--matrix-store", "<MB>", &matrix_store, 128.0,
+                    "memory in MB for keeping the transition matrices of"
+                    " the forward algorithm for traceback and recombination"
+                    " sampling, shared by all threads (default=128, 0"
+                    " recomputes them)",
+                    ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--matrix-threads", "<threads>", &matrix_threads, 0,
+                    "threads computing emission and transition matrices"
+                    " of upcoming blocks during the forward algorithm"
+                    " (default=0, compute them in the sampling thread)",
+                    ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--matrix-lookahead", "<blocks>", &matrix_lookahead,
+                    16,
+                    "maximum number of blocks whose matrices are computed"
+                    " ahead with --matrix-threads (default=16)",
+                    ADVANCED_OPT));
+        config.add(new ConfigSwitch
+                   ("", "--check-stats", &check_stats,
+                    "check the incrementally updated ARG statistics against"
+                    " a full recomputation at every stats line (slow)",
+                    ADVANCED_OPT));
 
 
         // help information
@@ -610,8 +762,10 @@ public:
     double epsilon;
     double pseudocount;
 
-#ifdef ARGWEAVER_MPI
     double mcmcmc_heat;
+    int mc3_threads;
+    Mc3Chains *mc3_chains;  // set while running --mc3-threads chains
+#ifdef ARGWEAVER_MPI
     int mcmcmc_group;
     int mcmcmc_numgroup;
     bool mpi;
@@ -627,18 +781,37 @@ public:
     int niters;
     string resample_region_str;
     int resample_region[2];
+    int chunks;
+    int chunk_overlap;
     bool resume;
+    int checkpoint_step;
     bool overwrite;
     string resume_stage;
     int resume_iter;
     int resample_window;
     int resample_window_iters;
+    int adapt_windows;
+    int resample_threads;
     bool gibbs;
+    string forward_kernel;
+    string forward_table;
+    double forward_memory;
+    int checkpoint_spacing;
+    bool skip_invariant;
+    double matrix_cache;
+    double matrix_store;
+    int matrix_threads;
+    int matrix_lookahead;
 
     // misc
     int compress_seq;
     int sample_step;
+    int stats_interval;
+    bool check_stats;
     bool no_compress_output;
+    int write_queue;
+    int compress_threads;
+    BackgroundWriter *writer;  // set while sampling
     int randseed;
     double prob_path_switch;
     bool infsites;
@@ -666,6 +839,7 @@ public:
 
     // logging
     FILE *stats_file;
+    ArgStatsCache stats_cache;
 };
 
 
@@ -762,57 +936,35 @@ void print_stats_header(Config *config) {
 void print_stats(FILE *stats_file, const char *stage, int iter,
                  ArgModel *model,
                  const Sequences *sequences, LocalTrees *trees,
-                 const SitesMapping* sites_mapping, const Config *config,
+                 const SitesMapping* sites_mapping, Config *config,
                  const TrackNullValue *maskmap_uncompressed,
-                 const vector<int> &invisible_recomb_pos0=vector<int>(),
+                 const vector<int> &invisible_recomb_pos=vector<int>(),
                  const vector<Spr> &invisible_recombs=vector<Spr>())
 {
-
-    // calculate number of recombinations
-    int nrecombs = trees->get_num_trees() - 1;
-
-    // calculate number of non-compatiable sites
-    int nseqs = trees->get_num_leaves();
-    char *seqs[nseqs];
-    for (int i=0; i<nseqs; i++)
-        seqs[i] = sequences->seqs[trees->seqids[i]];
-    int noncompats = count_noncompat(trees, seqs, nseqs, sequences->length());
+    // calculate likelihood, prior, joint probabilities and other statistics
+    // of the uncompressed ARG, reusing the terms of unchanged blocks
+    ArgStats stats;
+    config->stats_cache.calc(model, sequences, trees, sites_mapping,
+                             maskmap_uncompressed, config->compress_seq,
+                             !config->all_masked, invisible_recomb_pos,
+                             invisible_recombs, &stats);
+    double prior = stats.prior;
+    double prior2 = stats.prior2;
+    double likelihood = stats.likelihood;
+    double joint = prior + likelihood;
+    double arglen = stats.arglen;
+    int nrecombs = stats.nrecombs;
+    int noncompats = stats.noncompats;
 
     // get memory usage in MB
     double maxrss = get_max_memory_usage() / 1000.0;
 
-
-    // calculate likelihood, prior, and joint probabilities
-    // uncompressed local trees
-    vector<int> invisible_recomb_pos;
-    if (sites_mapping) {
-        uncompress_local_trees(trees, sites_mapping);
-	uncompress_model(model, sites_mapping, config->compress_seq);
-        sites_mapping->uncompress(invisible_recomb_pos0, invisible_recomb_pos);
-    }
-
-    double prior = calc_arg_prior(model, trees, NULL, NULL, -1, -1,
-                                  invisible_recomb_pos, invisible_recombs);
-    double prior2 = calc_arg_prior_recomb_integrate(model, trees, NULL, NULL, NULL);
-    double likelihood = config->all_masked ? 0.0 :
-        calc_arg_likelihood(model, sequences, trees,
-                            sites_mapping,
-                            maskmap_uncompressed);
-    double joint = prior + likelihood;
-    double arglen = get_arglen(trees, model->times);
-
-    // recompress local trees
-    if (sites_mapping) {
-        compress_local_trees(trees, sites_mapping);
-	compress_model(model, sites_mapping, config->compress_seq);
-    }
-
     // output stats
     fprintf(stats_file, "%s\t%d\t%f\t%f\t%f\t%f\t%d\t%d\t%f",
             stage, iter,
             prior, prior2, likelihood, joint, nrecombs, noncompats, arglen);
     if (config->invisible_recombs)
-        fprintf(stats_file, "\t%i", (int)invisible_recomb_pos.size());
+        fprintf(stats_file, "\t%i", (int)invisible_recombs.size());
     if (model->popsize_config.sample) {
         list<PopsizeConfigParam> l=model->popsize_config.params;
         for (list<PopsizeConfigParam>::iterator it=l.begin();
@@ -888,21 +1040,37 @@ string get_out_sites_file(const Config &config, int iter)
     return sitesfile;
 }
 
+// Returns the checkpoint filename
+string get_checkpoint_file(const Config &config)
+{
+    return config.out_prefix + config.mcmcmc_prefix + CHECKPOINT_SUFFIX;
+}
+
+// Queue a file to be written by the background writer, or write it now
+// if there is none
+static bool log_file(const Config *config, const string &filename,
+                     const WriteFunc &func)
+{
+    if (!config->writer)
+        return write_output_file(filename, func);
+    config->writer->write(filename, func);
+    return true;
+}
+
 bool log_sequences(string chrom, const Sequences *sequences,
                    const Config *config,
                    const SitesMapping *sites_mapping, int iter) {
-    Sites sites(chrom);
+    shared_ptr<Sites> sites(new Sites(chrom));
     string out_sites_file = get_out_sites_file(*config, iter);
-    make_sites_from_sequences(sequences, &sites);
-    if (sites_mapping)
-        uncompress_sites(&sites, sites_mapping);
-    CompressStream stream(out_sites_file.c_str(), "w");
-    if (!stream.stream) {
-        printError("cannot write '%s'", out_sites_file.c_str());
-        return false;
-    }
-    write_sites(stream.stream, &sites, config->write_masked_sites);
-    return true;
+    make_sites_from_sequences(sequences, sites.get());
+    const bool write_masked = config->write_masked_sites;
+
+    return log_file(config, out_sites_file, [=](FILE *stream) {
+        if (sites_mapping)
+            uncompress_sites(sites.get(), sites_mapping);
+        write_sites(stream, sites.get(), write_masked);
+        return true;
+    });
 }
 
 bool log_local_trees(const ArgModel *model, const Sequences *sequences,
@@ -912,46 +1080,31 @@ bool log_local_trees(const ArgModel *model, const Sequences *sequences,
                      const vector<Spr> &self_recombs=vector<Spr>())
 {
     string out_arg_file = get_out_arg_file(*config, iter);
-    const vector<int> *self_recomb_ptr;
     if (!config->no_compress_output)
         out_arg_file += ".gz";
 
-    // write local trees uncompressed
-    vector<int> self_recomb_pos1;
-    if (sites_mapping) {
-        uncompress_local_trees(trees, sites_mapping);
-        sites_mapping->uncompress(self_recomb_pos0, self_recomb_pos1);
-        self_recomb_ptr = &self_recomb_pos1;
-    } else self_recomb_ptr = &self_recomb_pos0;
-
-    // setup output stream
-    CompressStream stream(out_arg_file.c_str(), "w");
-    if (!stream.stream) {
-        printError("cannot write '%s'", out_arg_file.c_str());
-        return false;
-    }
-
-
-    write_local_trees(stream.stream, trees, sequences, model->times,
-                      model->pop_tree != NULL,
-                      *self_recomb_ptr, self_recombs);
-
-    // testing for now; output coal records version
-    /*    string out_cr_file = get_out_cr_file(*config, iter);
-    if (!config->no_compress_output)
-        out_cr_file += ".gz";
-    CompressStream stream2(out_cr_file.c_str(), "w");
-    if (!stream2.stream) {
-        printError("cannot write '%s'", out_cr_file.c_str());
-        return false;
-    }
-
-    write_coal_records(stream2.stream, model, trees, sequences); */
-
-    if (sites_mapping)
-        compress_local_trees(trees, sites_mapping);
-
-    return true;
+    // snapshot everything the file needs, since sampling continues while
+    // it is written
+    shared_ptr<LocalTrees> trees2(new LocalTrees());
+    trees2->copy(*trees);
+    shared_ptr<Sequences> names(new Sequences());
+    names->names = sequences->names;
+    vector<double> times(model->times, model->times + model->ntimes);
+    const bool pop_model = model->pop_tree != NULL;
+
+    return log_file(config, out_arg_file, [=](FILE *stream) {
+        // write local trees uncompressed
+        vector<int> self_recomb_pos1;
+        const vector<int> *self_recomb_ptr = &self_recomb_pos0;
+        if (sites_mapping) {
+            uncompress_local_trees(trees2.get(), sites_mapping);
+            sites_mapping->uncompress(self_recomb_pos0, self_recomb_pos1);
+            self_recomb_ptr = &self_recomb_pos1;
+        }
+        write_local_trees(stream, trees2.get(), *names, &times[0], pop_model,
+                          *self_recomb_ptr, self_recombs);
+        return true;
+    });
 }
 
 
@@ -1042,8 +1195,58 @@ void climb_arg(ArgModel *model, Sequences *sequences, LocalTrees *trees,
     printLog(LOG_LOW, "\n");
 }
 
+string get_mcmcmc_prefix(int group)
+{
+    if (group == 0)
+        return "";
+    char tmp[1000];
+    sprintf(tmp, ".%i", group);
+    return string(tmp);
+}
+
+
+// swap heats between the chains of --mc3-threads
+void mc3_threads_swap(Config *config, ArgModel *model,
+                      const Sequences *sequences, const LocalTrees *trees,
+                      int iter)
+{
+    Mc3Chains *chains = config->mc3_chains;
+    Mc3Config *mc3 = &(model->mc3);
+    int swap[2];
+    chains->exchange.get_pair(iter, &swap[0], &swap[1]);
+    if (mc3->group != swap[0] && mc3->group != swap[1])
+        return;
+
+    // compressed trees are scored with the compressed model
+    double like = calc_arg_prior(model, trees) +
+        calc_arg_likelihood(model, sequences, trees);
+    double accept_ratio;
+    bool accept = chains->exchange.swap(iter, mc3->group, like,
+                                        &accept_ratio);
+    printLog(LOG_LOW, "swap\t%i\t%i\t%f\t%f\t%f\t%s\n",
+             swap[0], swap[1], chains->exchange.get_heat(swap[0]),
+             chains->exchange.get_heat(swap[1]), accept_ratio,
+             accept ? "accept" : "reject");
+
+    // both chains have offered their state, so neither writes to the
+    // files of its old group any more
+    if (accept) {
+        mc3->group = (mc3->group == swap[0] ? swap[1] : swap[0]);
+        mc3->heat = 1.0 - mc3->heat_interval * mc3->group;
+        config->stats_file = chains->stats_files[mc3->group];
+        config->mcmcmc_prefix = get_mcmcmc_prefix(mc3->group);
+        g_thread_logger = chains->loggers[mc3->group];
+    }
+}
+
+
 void mcmcmc_swap(Config *config, ArgModel *model, const Sequences *sequences,
-                 const LocalTrees *trees, const SitesMapping *sites_mapping) {
+                 const LocalTrees *trees, const SitesMapping *sites_mapping,
+                 int iter) {
+    if (config->mc3_chains) {
+        mc3_threads_swap(config, model, sequences, trees, iter);
+        return;
+    }
 #ifdef ARGWEAVER_MPI
     printLog(LOG_LOW, "mcmcmc_swap model->mc3.max_group=%i\n", model->mc3.max_group);
     if (model->mc3.max_group == 0) return;
@@ -1065,7 +1268,7 @@ void mcmcmc_swap(Config *config, ArgModel *model, const Sequences *sequences,
     if (mc3->group == swap[0] || mc3->group == swap[1]) {
         double vals[2];
         vals[0] = calc_arg_prior(model, trees) +
-            calc_arg_likelihood(model, sequences, trees, sites_mapping);
+            calc_arg_likelihood(model, sequences, trees);
         vals[1] = mc3->heat;
         if (mc3->group_comm->Get_rank()==0)
             mc3->group_comm->Reduce(MPI_IN_PLACE, vals, 1, MPI::DOUBLE, MPI_SUM,
@@ -1153,6 +1356,9 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
     int window = config->resample_window;
     int niters = config->resample_window_iters;
     window /= config->compress_seq;
+    unique_ptr<WindowSchedule> schedule;
+    if (config->adapt_windows > 0)
+        schedule.reset(new WindowSchedule(window, niters));
 
     vector<int> invisible_recomb_pos;
     vector<Spr> invisible_recombs;
@@ -1204,8 +1410,15 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
 	    else
 		resample_arg_mcmc_all(model, sequences, trees, do_leaf[i],
 				      window, niters, heat,
-                                      config->no_resample_mig);
+                                      config->no_resample_mig,
+                                      config->resample_threads,
+                                      schedule.get());
 	}
+        if (schedule && i == config->adapt_windows) {
+            schedule->freeze();
+            printLog(LOG_LOW, "window schedule frozen after %d iterations\n",
+                     i);
+        }
 
 
 
@@ -1223,7 +1436,7 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
 
         printTimerLog(timer, LOG_LOW, "sample time:");
 
-        mcmcmc_swap(config, model, sequences, trees, sites_mapping);
+        mcmcmc_swap(config, model, sequences, trees, sites_mapping, i);
 
         if (model->smc_prime && config->invisible_recombs) {
             sample_invisible_recombinations(model, trees,
@@ -1238,9 +1451,10 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
 
 
         // logging
-        print_stats(config->stats_file, "resample", i, model, sequences, trees,
-                    sites_mapping, config, maskmap_orig,
-                    invisible_recomb_pos, invisible_recombs);
+        if (i % config->stats_interval == 0 || i == config->niters)
+            print_stats(config->stats_file, "resample", i, model, sequences,
+                        trees, sites_mapping, config, maskmap_orig,
+                        invisible_recomb_pos, invisible_recombs);
 
         // sample saving
         if (i % config->sample_step == 0 && ! config->no_sample_arg)
@@ -1249,11 +1463,43 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
 
         if (config->sample_phase_step > 0 && i%config->sample_phase_step == 0)
             log_sequences(trees->chrom, sequences, config, sites_mapping, i);
+
+        // checkpoint the state at the end of the iteration
+        if (config->checkpoint_step > 0 && i % config->checkpoint_step == 0) {
+            fflush(config->stats_file);
+            if (config->writer)
+                config->writer->flush();
+            string checkpoint_file = get_checkpoint_file(*config);
+            write_checkpoint(checkpoint_file.c_str(), i,
+                             ftell(config->stats_file), &get_random(),
+                             model, sequences, trees);
+        }
     }
     printLog(LOG_LOW, "\n");
 }
 
 
+// re-thread any ancient samples using internal threading to make use of minage
+void rethread_ancient_samples(const ArgModel *model, Sequences *sequences,
+                              LocalTrees *trees)
+{
+    for (int i=0; i < (int)sequences->ages.size(); i++) {
+        if (sequences->ages[i] > 0) {
+            int mintime = sequences->ages[i];
+            for (int j=0; j < trees->get_num_leaves(); j++) {
+                if (trees->seqids[j] == i) {
+                    printLog(LOG_LOW, "Re-threading ancient sample %s to set sample age %i (%.1f)\n",
+                             sequences->names[i].c_str(), mintime,
+                             model->times[mintime]);
+                    resample_arg_leaf(model, sequences, trees, j);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+
 // overall sampling workflow
 void sample_arg(ArgModel *model, Sequences *sequences, LocalTrees *trees,
                 SitesMapping* sites_mapping, Config *config,
@@ -1268,22 +1514,8 @@ void sample_arg(ArgModel *model, Sequences *sequences, LocalTrees *trees,
                    maskmap_orig);
 
     // re-thread any ancient samples using internal threading to make use of minage
-    if (seq_sample && sequences->ages.size() > 0) {
-	for (int i=0; i < (int)sequences->ages.size(); i++) {
-	    if (sequences->ages[i] > 0) {
-		int mintime = sequences->ages[i];
-		for (int j=0; j < trees->get_num_leaves(); j++) {
-		    if (trees->seqids[j] == i) {
-			printLog(LOG_LOW, "Re-threading ancient sample %s to set sample age %i (%.1f)\n",
-				 sequences->names[i].c_str(), mintime,
-				 model->times[mintime]);
-                        resample_arg_leaf(model, sequences, trees, j);
-			break;
-		    }
-		}
-	    }
-	}
-    }
+    if (seq_sample)
+        rethread_ancient_samples(model, sequences, trees);
 
     if (config->resample_region[0] != -1) {
         // region sampling
@@ -1320,6 +1552,324 @@ void sample_arg(ArgModel *model, Sequences *sequences, LocalTrees *trees,
 }
 
 
+// run the chains of --mc3-threads, one thread per heat group
+//
+// Each chain samples its own copy of the model and ARG with its own random
+// stream and shares the read-only sequences.
+bool sample_arg_mc3_threads(ArgModel *model, Sequences *sequences,
+                            LocalTrees *trees, SitesMapping* sites_mapping,
+                            Config *config,
+                            const TrackNullValue *maskmap_orig)
+{
+    const int nchains = config->mc3_threads;
+    Mc3Chains chains(nchains, config->mcmcmc_heat, config->niters,
+                     rand_seed());
+
+    // group 0 writes to the files of a single-chain run
+    chains.stats_files[0] = config->stats_file;
+    for (int i=1; i<nchains; i++) {
+        string prefix = config->out_prefix + get_mcmcmc_prefix(i);
+        string stats_filename = prefix + STATS_SUFFIX;
+        if (!(chains.stats_files[i] = fopen(stats_filename.c_str(), "w"))) {
+            printError("could not open stats file '%s'",
+                       stats_filename.c_str());
+            return false;
+        }
+        string log_filename = prefix + LOG_SUFFIX;
+        chains.loggers[i] = new Logger(NULL, config->verbose);
+        if (!chains.loggers[i]->openLogFile(log_filename.c_str(), "w")) {
+            printError("could not open log file '%s'", log_filename.c_str());
+            return false;
+        }
+    }
+
+    vector<unique_ptr<Config> > configs;
+    vector<unique_ptr<ArgModel> > models;
+    vector<unique_ptr<LocalTrees> > chain_trees;
+    const unsigned long long seed = rand_seed();
+    vector<RandomStream> streams;
+    for (int i=0; i<nchains; i++) {
+        configs.push_back(unique_ptr<Config>(new Config(*config)));
+        configs[i]->mc3_chains = &chains;
+        configs[i]->stats_file = chains.stats_files[i];
+        configs[i]->mcmcmc_prefix = get_mcmcmc_prefix(i);
+
+        models.push_back(unique_ptr<ArgModel>(new ArgModel(*model)));
+        models[i]->mc3 = Mc3Config(i, config->mcmcmc_heat);
+        models[i]->mc3.max_group = nchains - 1;
+
+        chain_trees.push_back(unique_ptr<LocalTrees>(new LocalTrees()));
+        chain_trees[i]->copy(*trees);
+        streams.push_back(RandomStream(seed, i));
+    }
+
+    printLog(LOG_LOW, "running %d (MC)^3 chains as threads\n", nchains);
+    auto run_chain = [&](int i) {
+        ScopedRandomStream stream(&streams[i]);
+        g_thread_logger = chains.loggers[i];
+        sample_arg(models[i].get(), sequences, chain_trees[i].get(),
+                   sites_mapping, configs[i].get(), maskmap_orig);
+        g_thread_logger = NULL;
+    };
+    vector<thread> threads;
+    for (int i=1; i<nchains; i++)
+        threads.push_back(thread(run_chain, i));
+    run_chain(0);
+    for (unsigned int i=0; i<threads.size(); i++)
+        threads[i].join();
+    chains.exchange.log_stats(LOG_LOW);
+
+    // the chains and the files of the heated groups are released on return
+    return true;
+}
+
+
+//=============================================================================
+// chromosome chunks
+
+// the chunks of --chunks in compressed coordinates.  Chunk i covers
+// [starts[i], ends[i]) and is joined to chunk i-1 at joins[i], in the
+// middle of their overlap.
+class ChunkLayout
+{
+public:
+    ChunkLayout(int start, int end, int nchunks, int overlap)
+    {
+        for (int i=0; i<=nchunks; i++)
+            joins.push_back(start + (long long) (end - start) * i / nchunks);
+        for (int i=0; i<nchunks; i++) {
+            starts.push_back(i == 0 ? start : joins[i] - overlap / 2);
+            ends.push_back(i == nchunks - 1 ? end :
+                           joins[i+1] + overlap - overlap / 2);
+        }
+    }
+
+    vector<int> joins;
+    vector<int> starts;
+    vector<int> ends;
+};
+
+
+// stitch the chunks into one ARG, cutting each chunk at the joins, and
+// resample the overlaps of the chunks conditioned on the rest of the ARG
+// the chunks are left in an unspecified state
+void stitch_chunks(const ArgModel *model, const Sequences *sequences,
+                   LocalTrees *trees, vector<LocalTrees*> &chunks,
+                   const ChunkLayout &layout, int niters)
+{
+    const int nchunks = chunks.size();
+    for (int i=0; i<nchunks; i++) {
+        LocalTrees *chunk = chunks[i];
+        if (layout.starts[i] < layout.joins[i])
+            chunk = partition_local_trees(chunks[i], layout.joins[i]);
+        if (layout.ends[i] > layout.joins[i+1])
+            delete partition_local_trees(chunk, layout.joins[i+1]);
+
+        if (i == 0)
+            trees->swap(*chunk);
+        else
+            stitch_local_trees(trees, chunk);
+        if (chunk != chunks[i])
+            delete chunk;
+    }
+    assert_trees(trees, model->pop_tree);
+
+    // resample the overlaps, each as one window
+    vector<int> bounds(1, trees->start_coord);
+    vector<int> window_iters;
+    for (int i=1; i<nchunks; i++) {
+        bounds.push_back(layout.starts[i]);
+        bounds.push_back(layout.ends[i-1]);
+        window_iters.push_back(0);
+        window_iters.push_back(niters);
+    }
+    bounds.push_back(trees->end_coord);
+    window_iters.push_back(0);
+
+    decLogLevel();
+    resample_arg_windows_parallel(model, sequences, trees, bounds,
+                                  window_iters, 1.0, nchunks);
+    incLogLevel();
+}
+
+
+// restart a chunk from its part of the stitched ARG
+void restart_chunk(LocalTrees *chunk, const LocalTrees *trees,
+                   int start, int end)
+{
+    chunk->copy(*trees);
+    if (end < chunk->end_coord) {
+        delete partition_local_trees(chunk, end);
+        // drop the zero length block that partitioning may leave
+        if (chunk->back().blocklen == 0) {
+            chunk->back().clear();
+            chunk->trees.pop_back();
+            chunk->invalidate_index();
+        }
+    }
+    if (start > chunk->start_coord) {
+        LocalTrees *part = partition_local_trees(chunk, start);
+        chunk->swap(*part);
+        delete part;
+    }
+
+    // the first tree has no tree before it
+    LocalTreeSpr &first = chunk->front();
+    first.spr.set_null();
+    if (first.mapping) {
+        free_node_mapping(first.mapping);
+        first.mapping = NULL;
+    }
+}
+
+
+// sample the ARG of --chunks, each chunk on its own thread with its own
+// copy of the model and its own random stream
+//
+// Every chunk is sampled on its own, from sequential sampling onwards.
+// When a stats line or a sample is due, the chunks are stitched into one
+// ARG, the overlaps are resampled conditioned on the stitched ARG, and
+// every chunk restarts from its part of the stitched ARG.
+bool sample_arg_chunks(ArgModel *model, Sequences *sequences,
+                       LocalTrees *trees, SitesMapping* sites_mapping,
+                       Config *config, const TrackNullValue *maskmap_orig)
+{
+    const int nchunks = config->chunks;
+    const int nseqs = sequences->get_num_seqs();
+    const ChunkLayout layout(trees->start_coord, trees->end_coord, nchunks,
+                             config->chunk_overlap / config->compress_seq);
+    const int window = config->resample_window / config->compress_seq;
+    const int niters = config->resample_window_iters;
+
+    // every chunk adds the sequences in the same order, so that all chunks
+    // have the same leaves
+    vector<int> seqids;
+    for (int i=0; i<nseqs; i++)
+        seqids.push_back(i);
+    shuffle(&seqids[0], nseqs);
+
+    const unsigned long long seed = rand_seed();
+    vector<RandomStream> streams;
+    vector<ArgModel*> models;
+    vector<LocalTrees*> chunks;
+    for (int i=0; i<nchunks; i++) {
+        streams.push_back(RandomStream(seed, i));
+        models.push_back(new ArgModel(*model));
+        chunks.push_back(new LocalTrees(layout.starts[i], layout.ends[i]));
+        chunks[i]->chrom = trees->chrom;
+    }
+
+    // run job(i) for every chunk i on its own thread
+    Logger *logger = g_thread_logger;
+    auto run_chunks = [&](auto job) {
+        auto worker = [&](int i) {
+            ScopedRandomStream stream(&streams[i]);
+            g_thread_logger = logger;
+            job(i);
+        };
+        vector<thread> threads;
+        for (int i=1; i<nchunks; i++)
+            threads.push_back(thread(worker, i));
+        worker(0);
+        for (unsigned int i=0; i<threads.size(); i++)
+            threads[i].join();
+    };
+
+    print_stats_header(config);
+    printLog(LOG_LOW, "sampling %d chunks as threads\n", nchunks);
+
+    // build initial arg by sequential sampling
+    if (trees->get_num_leaves() < nseqs) {
+        printLog(LOG_LOW, "Sequentially Sample Initial ARG (%d sequences)\n",
+                 nseqs);
+        printLog(LOG_LOW, "------------------------------------------------\n");
+        run_chunks([&](int i) {
+            chunks[i]->make_trunk(layout.starts[i], layout.ends[i],
+                                  seqids[0], 0, 2 * nseqs - 1);
+            sample_arg_seq(models[i], sequences, chunks[i], seqids,
+                           config->num_buildup);
+            rethread_ancient_samples(models[i], sequences, chunks[i]);
+        });
+        stitch_chunks(model, sequences, trees, chunks, layout, niters);
+        print_stats(config->stats_file, "seq", nseqs, model, sequences,
+                    trees, sites_mapping, config, maskmap_orig);
+    }
+    climb_arg(model, sequences, trees, sites_mapping, config, maskmap_orig);
+
+    // resample all branches
+    vector<int> invisible_recomb_pos;
+    vector<Spr> invisible_recombs;
+    print_stats(config->stats_file, "resample", 0, model, sequences, trees,
+                sites_mapping, config, maskmap_orig);
+    log_local_trees(model, sequences, trees, sites_mapping, config, 0,
+                    invisible_recomb_pos, invisible_recombs);
+    if (config->sample_phase_step > 0)
+        log_sequences(trees->chrom, sequences, config, sites_mapping, 0);
+
+    printLog(LOG_LOW, "Resample All Branches (%d iterations)\n",
+             config->niters);
+    printLog(LOG_LOW, "--------------------------------------\n");
+
+    bool restart = true;
+    for (int i=1; i<=config->niters; i++) {
+        printLog(LOG_LOW, "sample %d\n", i);
+        Timer timer;
+        run_chunks([&](int j) {
+            if (restart)
+                restart_chunk(chunks[j], trees, layout.starts[j],
+                              layout.ends[j]);
+            bool do_leaf = (frand() < 0.5);
+            if (config->no_sample_arg)
+                return;
+            if (config->gibbs)
+                resample_arg(models[j], sequences, chunks[j]);
+            else
+                resample_arg_mcmc_all(models[j], sequences, chunks[j],
+                                      do_leaf, window, niters, 1.0,
+                                      config->no_resample_mig);
+        });
+        restart = false;
+        printTimerLog(timer, LOG_LOW, "sample time:");
+
+        // the sequences do not depend on the chunks
+        if (config->sample_phase_step > 0 && i%config->sample_phase_step == 0)
+            log_sequences(trees->chrom, sequences, config, sites_mapping, i);
+
+        // stitch the chunks whenever the ARG is reported
+        const bool log_stats = (i % config->stats_interval == 0 ||
+                                i == config->niters);
+        const bool log_sample = (i % config->sample_step == 0 &&
+                                 !config->no_sample_arg);
+        if (!log_stats && !log_sample)
+            continue;
+        timer.start();
+        stitch_chunks(model, sequences, trees, chunks, layout, niters);
+        restart = true;
+        printTimerLog(timer, LOG_LOW, "stitch time:");
+
+        if (model->smc_prime && config->invisible_recombs) {
+            sample_invisible_recombinations(model, trees,
+                                            invisible_recomb_pos,
+                                            invisible_recombs);
+        }
+        if (log_stats)
+            print_stats(config->stats_file, "resample", i, model, sequences,
+                        trees, sites_mapping, config, maskmap_orig,
+                        invisible_recomb_pos, invisible_recombs);
+        if (log_sample)
+            log_local_trees(model, sequences, trees, sites_mapping, config, i,
+                            invisible_recomb_pos, invisible_recombs);
+    }
+    printLog(LOG_LOW, "\n");
+
+    for (int i=0; i<nchunks; i++) {
+        delete models[i];
+        delete chunks[i];
+    }
+    return true;
+}
+
+
 //=============================================================================
 
 bool parse_status_line(const char* line, Config &config,
@@ -1372,13 +1922,24 @@ bool parse_status_line(const char* line, Config &config,
 }
 
 
-bool setup_resume(Config &config)
+bool setup_resume(Config &config, CheckpointReader *checkpoint)
 {
     if (!config.resume)
         return true;
 
     printLog(LOG_LOW, "Resuming previous run\n");
 
+    // prefer a checkpoint, which restores the exact state of the run
+    string checkpoint_file = get_checkpoint_file(config);
+    if (checkpoint->open(checkpoint_file.c_str())) {
+        config.resume_stage = "resample";
+        config.resume_iter = checkpoint->get_header().iter;
+        printLog(LOG_LOW, "resuming at stage=%s, iter=%d, checkpoint=%s\n",
+                 config.resume_stage.c_str(), config.resume_iter,
+                 checkpoint_file.c_str());
+        return true;
+    }
+
     // open stats file
     string stats_filename = config.out_prefix + config.mcmcmc_prefix
         + STATS_SUFFIX;
@@ -1519,7 +2080,8 @@ int main(int argc, char **argv)
     set_up_logging(c, c.verbose, (c.resume ? "a" : "w"));
 
     // try to resume a previous run
-    if (!setup_resume(c)) {
+    CheckpointReader checkpoint;
+    if (!setup_resume(c, &checkpoint)) {
         printError("resume failed.");
         if (c.overwrite) {
             c.resume = false;
@@ -1580,9 +2142,23 @@ int main(int argc, char **argv)
         MPI::COMM_WORLD.Recv(&c.randseed, 1, MPI::INT, 0, 13);
     }
 #endif
-    srand(c.randseed);
+    RandomStream random(c.randseed);
+    ScopedRandomStream scoped_random(&random);
     printLog(LOG_LOW, "random seed: %d\n", c.randseed);
 
+    // choose forward algorithm kernel
+    ForwardKernelType kernel_type;
+    if (!parse_forward_kernel(c.forward_kernel.c_str(), &kernel_type)) {
+        printError("unknown forward kernel '%s'", c.forward_kernel.c_str());
+        return EXIT_ERROR;
+    }
+    if (!set_forward_kernel(kernel_type)) {
+        printError("forward kernel '%s' is not supported on this CPU",
+                   c.forward_kernel.c_str());
+        return EXIT_ERROR;
+    }
+    printLog(LOG_LOW, "forward kernel: %s\n", get_forward_kernel()->name);
+
     // read sequences
     Sites sites;
     Sequences sequences;
@@ -1884,6 +2460,28 @@ int main(int argc, char **argv)
 
     c.model.rho = c.rho;
     c.model.mu = c.mu;
+
+    // forward table storage
+    if (c.forward_table == "auto") {
+        c.model.forward_table.mode = FORWARD_TABLE_AUTO;
+    } else if (c.forward_table == "full") {
+        c.model.forward_table.mode = FORWARD_TABLE_FULL;
+    } else if (c.forward_table == "checkpoint") {
+        c.model.forward_table.mode = FORWARD_TABLE_CHECKPOINT;
+    } else if (c.forward_table == "float") {
+        c.model.forward_table.mode = FORWARD_TABLE_FLOAT;
+    } else {
+        printError("unknown forward table mode '%s'",
+                   c.forward_table.c_str());
+        return EXIT_ERROR;
+    }
+    c.model.forward_table.memory_budget = c.forward_memory * 1e6;
+    c.model.forward_table.checkpoint_spacing = c.checkpoint_spacing;
+    c.model.forward_table.skip_invariant = c.skip_invariant;
+    c.model.forward_table.matrix_cache = c.matrix_cache * 1e6;
+    c.model.forward_table.matrix_store = c.matrix_store * 1e6;
+    c.model.forward_table.matrix_threads = c.matrix_threads;
+    c.model.forward_table.matrix_lookahead = c.matrix_lookahead;
     if (c.popsize_file != "") {
         // use population sizes from a file
         c.model.read_population_sizes(c.popsize_file);
@@ -1916,6 +2514,71 @@ int main(int argc, char **argv)
         c.sample_phase_step=0;
     else if (c.sample_phase_step == 0)
         c.sample_phase_step = c.sample_step;
+    if (c.stats_interval < 1) {
+        printError("--stats-interval must be at least 1");
+        return EXIT_ERROR;
+    }
+    if (c.write_queue < 0) {
+        printError("--write-queue must be at least 0");
+        return EXIT_ERROR;
+    }
+    if (c.compress_threads < 0) {
+        printError("--compress-threads must be at least 0");
+        return EXIT_ERROR;
+    }
+    set_compress_threads(c.compress_threads);
+    c.stats_cache.check = c.check_stats;
+
+    if (c.mc3_threads > 1) {
+        // chains share the sequences, which phase sampling changes
+        if (c.model.unphased) {
+            printError("--mc3-threads cannot be used with unphased data");
+            return EXIT_ERROR;
+        }
+        if (c.resume || c.checkpoint_step > 0) {
+            printError("--mc3-threads cannot be used with --resume or"
+                       " --checkpoint-step");
+            return EXIT_ERROR;
+        }
+#ifdef ARGWEAVER_MPI
+        if (c.mcmcmc_numgroup > 1) {
+            printError("--mc3-threads cannot be used with --mcmcmc");
+            return EXIT_ERROR;
+        }
+#endif
+    }
+
+    if (c.adapt_windows < 0) {
+        printError("--adapt-windows must be at least 0");
+        return EXIT_ERROR;
+    }
+    if (c.adapt_windows > 0 && (c.resume || c.chunks > 1)) {
+        // the schedule is not saved in checkpoints
+        printError("--adapt-windows cannot be used with --resume or"
+                   " --chunks");
+        return EXIT_ERROR;
+    }
+
+    if (c.chunks < 1) {
+        printError("--chunks must be at least 1");
+        return EXIT_ERROR;
+    }
+    if (c.chunks > 1) {
+        // chunks share the sequences and are stitched without population
+        // paths
+        if (c.model.unphased || c.model.pop_tree != NULL) {
+            printError("--chunks cannot be used with unphased data or a"
+                       " population tree");
+            return EXIT_ERROR;
+        }
+        if (c.mc3_threads > 1 || c.resume || c.checkpoint_step > 0 ||
+            c.resample_region_str != "" || c.sample_popsize_num > 0) {
+            printError("--chunks cannot be used with --mc3-threads, --resume,"
+                       " --checkpoint-step, --resample-region or"
+                       " --sample-popsize");
+            return EXIT_ERROR;
+        }
+    }
 
     if (c.sample_popsize_num > 0) {
 	if (c.popsize_em) {
@@ -1985,7 +2648,28 @@ int main(int argc, char **argv)
     // setup init ARG
     LocalTrees *trees = NULL;
     unique_ptr<LocalTrees> trees_ptr;
-    if (c.arg_file != "") { // || c.cr_file != "") {
+    if (checkpoint.is_open()) {
+        // restore the state of the checkpointed run
+        trees = new LocalTrees();
+        trees_ptr = unique_ptr<LocalTrees>(trees);
+        if (!checkpoint.read_model(&model) ||
+            !checkpoint.read_sequences(&sequences) ||
+            !checkpoint.read_trees(trees)) {
+            printError("could not read checkpoint");
+            return EXIT_ERROR;
+        }
+        if (trees->start_coord != seq_region_compress.start ||
+            trees->end_coord != seq_region_compress.end ||
+            trees->get_num_leaves() != sequences.get_num_seqs()) {
+            printError("checkpoint does not match sites");
+            return EXIT_ERROR;
+        }
+        printLog(LOG_LOW, "read checkpoint ARG (chrom=%s, start=%d, end=%d,"
+                 " nseqs=%d)\n",
+                 trees->chrom.c_str(), trees->start_coord, trees->end_coord,
+                 trees->get_num_leaves());
+
+    } else if (c.arg_file != "") { // || c.cr_file != "") {
         // init ARG from file
 
         trees = new LocalTrees();
@@ -2062,6 +2746,14 @@ int main(int argc, char **argv)
     // init stats file
     string stats_filename = c.out_prefix + c.mcmcmc_prefix + STATS_SUFFIX;
     const char *stats_mode = (c.resume ? "a" : "w");
+    // drop the lines written after the checkpoint
+    if (checkpoint.is_open() &&
+        truncate(stats_filename.c_str(),
+                 checkpoint.get_header().stats_offset) != 0) {
+        printError("could not truncate stats file '%s'",
+                   stats_filename.c_str());
+        return EXIT_ERROR;
+    }
     if (!(c.stats_file = fopen(stats_filename.c_str(), stats_mode))) {
         printError("could not open stats file '%s'", stats_filename.c_str());
         return EXIT_ERROR;
@@ -2071,14 +2763,70 @@ int main(int argc, char **argv)
     double maxrss = get_max_memory_usage() / 1000.0;
     printLog(LOG_LOW, "max memory usage: %.1f MB\n", maxrss);
 
+    // chunks need room for the regrafted trees at each join
+    if (c.chunks > 1) {
+        const int overlap = c.chunk_overlap / c.compress_seq;
+        const int chunk_len = (trees->end_coord - trees->start_coord) /
+            c.chunks;
+        if (overlap < 2 * sequences.get_num_seqs() || chunk_len <= overlap) {
+            printError("--chunk-overlap must be at least %d bp and less than"
+                       " the length of a chunk (%d bp)",
+                       2 * sequences.get_num_seqs() * c.compress_seq,
+                       chunk_len * c.compress_seq);
+            return EXIT_ERROR;
+        }
+    }
+
     // sample ARG
     printLog(LOG_LOW, "\n");
-    sample_arg(&model, &sequences, trees, sites_mapping, &c, &maskmap_orig);
+    BackgroundWriter writer(c.write_queue);
+    c.writer = &writer;
+    if (c.mc3_threads > 1) {
+        if (!sample_arg_mc3_threads(&model, &sequences, trees, sites_mapping,
+                                    &c, &maskmap_orig))
+            return EXIT_ERROR;
+    } else if (c.chunks > 1) {
+        if (!sample_arg_chunks(&model, &sequences, trees, sites_mapping,
+                               &c, &maskmap_orig))
+            return EXIT_ERROR;
+    } else {
+        if (checkpoint.is_open()) {
+            random = checkpoint.get_header().random;
+            checkpoint.close();
+        }
+        sample_arg(&model, &sequences, trees, sites_mapping, &c,
+                   &maskmap_orig);
+    }
+    if (!writer.flush())
+        return EXIT_ERROR;
+    c.writer = NULL;
 
     // final log message
     maxrss = get_max_memory_usage() / 1000.0;
     printTimerLog(timer, LOG_LOW, "sampling time: ");
     printLog(LOG_LOW, "max memory usage: %.1f MB\n", maxrss);
+    long pattern_sites, pattern_hits;
+    get_site_pattern_counts(&pattern_sites, &pattern_hits);
+    printLog(LOG_LOW, "site pattern reuse: %ld of %ld variant sites"
+             " (%.1f%%)\n", pattern_hits, pattern_sites,
+             100.0 * pattern_hits / max(pattern_sites, 1L));
+    long matrix_hits, matrix_misses;
+    get_matrix_cache_counts(&matrix_hits, &matrix_misses);
+    printLog(LOG_LOW, "transition matrix reuse: %ld of %ld matrices"
+             " (%.1f%%)\n", matrix_hits, matrix_hits + matrix_misses,
+             100.0 * matrix_hits / max(matrix_hits + matrix_misses, 1L));
+    long store_reused;
+    double store_time_saved;
+    get_matrix_store_counts(&store_reused, &store_time_saved);
+    printLog(LOG_LOW, "transition matrices replayed: %ld blocks"
+             " (%.1f s saved)\n", store_reused, store_time_saved);
+    long stats_reused, stats_blocks;
+    get_arg_stats_counts(&stats_reused, &stats_blocks);
+    printLog(LOG_LOW, "ARG stats reuse: %ld of %ld blocks (%.1f%%)\n",
+             stats_reused, stats_blocks,
+             100.0 * stats_reused / max(stats_blocks, 1L));
+    printLog(LOG_LOW, "output files: %d (%.1f s waiting for the writer)\n",
+             writer.get_num_files(), writer.get_wait_time());
     printLog(LOG_LOW, "FINISH\n");
 
     // clean up
@@ -200,6 +200,14 @@ public:
     ConfigParser()
     {}
 
+    // The rules point into the object that made them, so a copy of that
+    // object starts without rules instead of sharing them.
+    ConfigParser(const ConfigParser &other) :
+        prog(other.prog),
+        rest(other.rest)
+    {}
+    ConfigParser &operator=(const ConfigParser &other) = delete;
+
     ~ConfigParser()
     {
         clear();
@@ -0,0 +1,325 @@
+// c++ includes
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+#include <stdlib.h>
+
+// arghmm includes
+#include "arg_stats.h"
+#include "emit.h"
+#include "logging.h"
+#include "total_prob.h"
+
+
+namespace argweaver {
+
+
+static atomic<long> g_arg_stats_reused(0);
+static atomic<long> g_arg_stats_blocks(0);
+
+
+void get_arg_stats_counts(long *nreused, long *nblocks)
+{
+    *nreused = g_arg_stats_reused;
+    *nblocks = g_arg_stats_blocks;
+}
+
+
+bool ArgStatsCache::Block::same_tree(const LocalTree *tree) const
+{
+    if (tree->root != root || tree->nnodes != (int)nodes.size())
+        return false;
+    for (int i=0; i<tree->nnodes; i++) {
+        const LocalNode &a = nodes[i];
+        const LocalNode &b = tree->nodes[i];
+        if (a.parent != b.parent || a.age != b.age ||
+            a.child[0] != b.child[0] || a.child[1] != b.child[1] ||
+            a.pop_path != b.pop_path)
+            return false;
+    }
+    return true;
+}
+
+
+static bool same_spr(const Spr &a, const Spr &b)
+{
+    return a.recomb_node == b.recomb_node && a.recomb_time == b.recomb_time &&
+        a.coal_node == b.coal_node && a.coal_time == b.coal_time &&
+        a.pop_path == b.pop_path;
+}
+
+
+// model parameters that the prior terms of a block depend on
+static void get_prior_params(const ArgModel *model, vector<double> &params)
+{
+    params.clear();
+    params.push_back(model->rho);
+    for (int pop=0; pop<model->num_pops(); pop++)
+        for (int i=0; i<2*model->ntimes-1; i++)
+            params.push_back(model->popsizes[pop][i]);
+    if (model->pop_tree != NULL) {
+        const PopulationTree *pop_tree = model->pop_tree;
+        params.push_back(pop_tree->max_migrations);
+        for (unsigned int i=0; i<pop_tree->all_paths.size(); i++)
+            params.push_back(pop_tree->all_paths[i].prob);
+    }
+}
+
+
+void ArgStatsCache::calc(const ArgModel *model, const Sequences *sequences,
+                         const LocalTrees *trees,
+                         const SitesMapping *sites_mapping,
+                         const TrackNullValue *maskmap_uncompressed,
+                         double compress_seq, bool calc_likelihood,
+                         const vector<int> &invisible_recomb_pos0,
+                         const vector<Spr> &invisible_recombs,
+                         ArgStats *stats)
+{
+    const int ntrees = trees->get_num_trees();
+    const int nleaves = trees->get_num_leaves();
+
+    // uncompressed model, sharing everything but the rates with model
+    ArgModel model2(*model,
+                    sites_mapping ? model->rho / compress_seq : model->rho,
+                    sites_mapping ? model->mu / compress_seq : model->mu);
+    if (!have_maps) {
+        mutmap = model->mutmap;
+        recombmap = model->recombmap;
+        if (sites_mapping) {
+            uncompress_track(mutmap, sites_mapping, compress_seq, true);
+            uncompress_track(recombmap, sites_mapping, compress_seq, true);
+        }
+        have_maps = true;
+    }
+    model2.mutmap.swap(mutmap);
+    model2.recombmap.swap(recombmap);
+
+    // invalidate blocks whose terms may have changed
+    vector<double> params;
+    get_prior_params(&model2, params);
+    bool prior_valid = (params == prior_params);
+    prior_params.swap(params);
+    bool sites_valid = !model->unphased;
+    if (seqids != trees->seqids) {
+        blocks.clear();
+        seqids = trees->seqids;
+    }
+
+    // uncompressed coordinates
+    vector<int> blocklens, blocklens2;
+    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end(); ++it)
+        blocklens.push_back(it->blocklen);
+    int start_coord = trees->start_coord;
+    int end_coord = trees->end_coord;
+    vector<int> invisible_recomb_pos;
+    if (sites_mapping) {
+        sites_mapping->uncompress_blocks(blocklens, blocklens2);
+        sites_mapping->uncompress(invisible_recomb_pos0, invisible_recomb_pos);
+        start_coord = sites_mapping->old_start;
+        end_coord = sites_mapping->old_end;
+    } else {
+        blocklens2 = blocklens;
+        invisible_recomb_pos = invisible_recomb_pos0;
+    }
+    const int ninvisible = invisible_recombs.size();
+    assert(ninvisible == (int)invisible_recomb_pos.size());
+
+    // sequences of the leaves
+    char *seqs[nleaves];
+    for (int i=0; i<nleaves; i++)
+        seqs[i] = sequences->seqs[trees->seqids[i]];
+
+    ArgStats total;
+    total.nrecombs = ntrees - 1;
+    LineageCounts lineages(model2.ntimes, model2.num_pops());
+    total.prior = calc_log_tree_prior(&model2, trees->front().tree, lineages);
+    total.prior2 = total.prior;
+    const bool trunk = (trees->nnodes < 3);
+    if (calc_likelihood && trunk)
+        total.likelihood = log(.25) * (end_coord - start_coord);
+    const double rho = model2.get_local_rho(start_coord);
+
+    vector<Block> blocks2(ntrees);
+    unsigned int old_idx = 0;
+    int self_idx = 0;
+    int mu_idx = 0, rho_idx = 0;
+    int lk_mu_idx = 0, lk_rho_idx = 0, mask_pos = 0;
+    int start = start_coord;
+    int cstart = trees->start_coord;
+    int i = 0;
+    long nreused = 0;
+    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end();
+         ++i) {
+        const int end = start + blocklens2[i];
+        const int blocklen = it->blocklen;
+        const LocalTree *tree = it->tree;
+        ++it;
+        const Spr *next_spr = (it != trees->end() ? &it->spr : NULL);
+
+        // invisible recombinations within the block
+        const int first_self = self_idx;
+        while (self_idx < ninvisible && invisible_recomb_pos[self_idx] < end)
+            self_idx++;
+
+        // find the same block in the last call
+        while (old_idx < blocks.size() && blocks[old_idx].start < start)
+            old_idx++;
+        Block *old = NULL;
+        if (old_idx < blocks.size()) {
+            Block &b = blocks[old_idx];
+            if (b.start == start && b.end == end &&
+                b.has_next_spr == (next_spr != NULL) &&
+                (!next_spr || same_spr(b.next_spr, *next_spr)) &&
+                b.same_tree(tree))
+                old = &b;
+        }
+
+        Block &block = blocks2[i];
+        block.start = start;
+        block.end = end;
+        block.has_next_spr = (next_spr != NULL);
+        if (next_spr)
+            block.next_spr = *next_spr;
+        block.has_invisible = (self_idx > first_self);
+        bool reused = true;
+
+        if (old) {
+            block.root = old->root;
+            block.nodes.swap(old->nodes);
+            block.arglen = old->arglen;
+            block.noncompats = old->noncompats;
+        } else {
+            block.root = tree->root;
+            block.nodes.assign(tree->nodes, tree->nodes + tree->nnodes);
+            block.arglen = get_arglen(tree, model2.times);
+            block.noncompats = -1;
+            reused = false;
+        }
+
+        if (old && prior_valid && !old->has_invisible &&
+            !block.has_invisible) {
+            block.prior = old->prior;
+            block.prior2 = old->prior2;
+        } else {
+            block.prior = calc_block_prior(
+                &model2, tree, start, end, next_spr, lineages, NULL, NULL,
+                invisible_recomb_pos.data() + first_self,
+                invisible_recombs.data() + first_self,
+                self_idx - first_self, &mu_idx, &rho_idx);
+            block.prior2 = calc_block_prior_recomb_integrate(
+                &model2, (LocalTree*) tree, end - start, next_spr, rho,
+                lineages);
+            reused = false;
+        }
+
+        if (old && sites_valid) {
+            block.likelihood = old->likelihood;
+        } else {
+            block.noncompats = -1;
+            block.likelihood = NAN;
+        }
+        if (block.noncompats < 0) {
+            const char *subseqs[nleaves];
+            for (int j=0; j<nleaves; j++)
+                subseqs[j] = &seqs[j][cstart];
+            block.noncompats = count_noncompat(tree, subseqs, nleaves,
+                                               0, blocklen, NULL);
+            reused = false;
+        }
+        if (calc_likelihood && !trunk && isnan(block.likelihood)) {
+            if (sites_mapping)
+                block.likelihood = calc_block_likelihood(
+                    &model2, sequences, tree, &trees->seqids[0], start, end,
+                    sites_mapping, maskmap_uncompressed, &mask_pos,
+                    &lk_mu_idx, &lk_rho_idx);
+            else
+                block.likelihood = calc_block_likelihood(
+                    &model2, sequences, tree, seqs, start, end,
+                    &lk_mu_idx, &lk_rho_idx);
+            reused = false;
+        }
+
+        total.prior += block.prior;
+        total.prior2 += block.prior2;
+        if (calc_likelihood && !trunk)
+            total.likelihood += block.likelihood;
+        total.arglen += block.arglen * (end - start);
+        total.noncompats += block.noncompats;
+        nreused += reused;
+
+        start = end;
+        cstart += blocklen;
+    }
+    blocks.swap(blocks2);
+    g_arg_stats_reused += nreused;
+    g_arg_stats_blocks += ntrees;
+
+    model2.mutmap.swap(mutmap);
+    model2.recombmap.swap(recombmap);
+
+    if (check)
+        check_stats(model, sequences, trees, sites_mapping,
+                    maskmap_uncompressed, compress_seq, calc_likelihood,
+                    invisible_recomb_pos, invisible_recombs, total);
+    *stats = total;
+}
+
+
+static bool stats_differ(double a, double b)
+{
+    return fabs(a - b) > 1e-6 * max(1.0, fabs(b));
+}
+
+
+// compare stats with a recomputation over the whole uncompressed ARG
+void ArgStatsCache::check_stats(const ArgModel *model,
+                                const Sequences *sequences,
+                                const LocalTrees *trees,
+                                const SitesMapping *sites_mapping,
+                                const TrackNullValue *maskmap_uncompressed,
+                                double compress_seq, bool calc_likelihood,
+                                const vector<int> &invisible_recomb_pos,
+                                const vector<Spr> &invisible_recombs,
+                                const ArgStats &stats)
+{
+    ArgStats full;
+    full.nrecombs = trees->get_num_trees() - 1;
+    full.noncompats = count_noncompat(trees, sequences);
+
+    ArgModel model2(*model);
+    LocalTrees trees2;
+    trees2.copy(*trees);
+    if (sites_mapping) {
+        uncompress_local_trees(&trees2, sites_mapping);
+        uncompress_model(&model2, sites_mapping, compress_seq);
+    }
+    full.prior = calc_arg_prior(&model2, &trees2, NULL, NULL, -1, -1,
+                                invisible_recomb_pos, invisible_recombs);
+    full.prior2 = calc_arg_prior_recomb_integrate(&model2, &trees2,
+                                                  NULL, NULL, NULL);
+    if (calc_likelihood)
+        full.likelihood = calc_arg_likelihood(&model2, sequences, &trees2,
+                                              sites_mapping,
+                                              maskmap_uncompressed);
+    full.arglen = get_arglen(&trees2, model2.times);
+
+    if (stats_differ(stats.prior, full.prior) ||
+        stats_differ(stats.prior2, full.prior2) ||
+        stats_differ(stats.likelihood, full.likelihood) ||
+        stats_differ(stats.arglen, full.arglen) ||
+        stats.nrecombs != full.nrecombs ||
+        stats.noncompats != full.noncompats) {
+        printError("ARG stats differ from full recomputation:\n"
+                   "  prior %f %f, prior2 %f %f, likelihood %f %f,\n"
+                   "  arglen %f %f, recombs %d %d, noncompats %d %d",
+                   stats.prior, full.prior, stats.prior2, full.prior2,
+                   stats.likelihood, full.likelihood,
+                   stats.arglen, full.arglen,
+                   stats.nrecombs, full.nrecombs,
+                   stats.noncompats, full.noncompats);
+        abort();
+    }
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,118 @@
+//=============================================================================
+// statistics of a sampled ARG
+//
+// arg-sample reports the prior, likelihood and other statistics of the
+// whole ARG after every iteration.  Most local trees are unchanged from one
+// report to the next, so the terms of each block are kept and only
+// recomputed for blocks whose tree, SPR or extent changed.  Blocks are
+// compared by content, so sampling moves need not record what they touched.
+
+#ifndef ARGWEAVER_ARG_STATS_H
+#define ARGWEAVER_ARG_STATS_H
+
+// c++ includes
+#include <vector>
+
+// arghmm includes
+#include "local_tree.h"
+#include "model.h"
+#include "sequences.h"
+#include "track.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+class ArgStats
+{
+public:
+    ArgStats() :
+        prior(0.0), prior2(0.0), likelihood(0.0), arglen(0.0),
+        nrecombs(0), noncompats(0)
+    {}
+
+    double prior;       // calc_arg_prior()
+    double prior2;      // calc_arg_prior_recomb_integrate()
+    double likelihood;  // calc_arg_likelihood()
+    double arglen;      // get_arglen()
+    int nrecombs;
+    int noncompats;     // count_noncompat()
+};
+
+
+class ArgStatsCache
+{
+public:
+    ArgStatsCache() :
+        check(false),
+        have_maps(false)
+    {}
+
+    // Calculate the statistics of compressed trees and the compressed model
+    // used for sampling, as if both were uncompressed.  Invisible
+    // recombinations are in uncompressed coordinates.
+    void calc(const ArgModel *model, const Sequences *sequences,
+              const LocalTrees *trees, const SitesMapping *sites_mapping,
+              const TrackNullValue *maskmap_uncompressed,
+              double compress_seq, bool calc_likelihood,
+              const vector<int> &invisible_recomb_pos,
+              const vector<Spr> &invisible_recombs, ArgStats *stats);
+
+    void clear()
+    {
+        blocks.clear();
+    }
+
+    // compare every result with a full recomputation
+    bool check;
+
+protected:
+    struct Block
+    {
+        bool same_tree(const LocalTree *tree) const;
+
+        int start;  // uncompressed coordinates
+        int end;
+        int root;
+        vector<LocalNode> nodes;
+        bool has_next_spr;
+        Spr next_spr;
+        bool has_invisible;  // prior includes invisible recombinations
+
+        double prior;
+        double prior2;
+        double likelihood;
+        double arglen;
+        int noncompats;
+    };
+
+    void check_stats(const ArgModel *model, const Sequences *sequences,
+                     const LocalTrees *trees,
+                     const SitesMapping *sites_mapping,
+                     const TrackNullValue *maskmap_uncompressed,
+                     double compress_seq, bool calc_likelihood,
+                     const vector<int> &invisible_recomb_pos,
+                     const vector<Spr> &invisible_recombs,
+                     const ArgStats &stats);
+
+    vector<Block> blocks;
+    vector<double> prior_params;  // model parameters the priors depend on
+    vector<int> seqids;
+
+    // uncompressed rate maps
+    bool have_maps;
+    Track<double> mutmap;
+    Track<double> recombmap;
+};
+
+
+// returns the number of blocks whose statistics were reused and the total
+// number of blocks over all ArgStatsCache::calc() calls
+void get_arg_stats_counts(long *nreused, long *nblocks);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_ARG_STATS_H
@@ -0,0 +1,369 @@
+// c/c++ includes
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+// arghmm includes
+#include "checkpoint.h"
+#include "logging.h"
+#include "pop_model.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+static const char CHECKPOINT_MAGIC[8] = {'A', 'R', 'G', 'W', 'C', 'K', 'P',
+                                         'T'};
+static const int CHECKPOINT_VERSION = 2;
+
+
+//=============================================================================
+// writing
+
+class CheckpointBuffer
+{
+public:
+    void put(const void *ptr, size_t len)
+    {
+        const char *bytes = (const char*) ptr;
+        data.insert(data.end(), bytes, bytes + len);
+    }
+
+    void put_int(int value)
+    {
+        put(&value, sizeof(value));
+    }
+
+    void put_double(double value)
+    {
+        put(&value, sizeof(value));
+    }
+
+    vector<char> data;
+};
+
+
+static void write_model(CheckpointBuffer &buf, const ArgModel *model)
+{
+    const int npops = model->num_pops();
+    buf.put_int(model->ntimes);
+    buf.put_int(npops);
+    for (int pop=0; pop<npops; pop++)
+        buf.put(model->popsizes[pop], sizeof(double) * (2*model->ntimes-1));
+
+    const PopulationTree *pop_tree = model->pop_tree;
+    buf.put_int(pop_tree != NULL);
+    if (pop_tree) {
+        buf.put_int(pop_tree->max_migrations);
+        buf.put_int(pop_tree->mig_matrix.size());
+        for (unsigned int i=0; i<pop_tree->mig_matrix.size(); i++)
+            for (int a=0; a<pop_tree->npop; a++)
+                for (int b=0; b<pop_tree->npop; b++)
+                    buf.put_double(pop_tree->mig_matrix[i].get(a, b));
+    }
+}
+
+
+static void write_sequences(CheckpointBuffer &buf, const ArgModel *model,
+                            const Sequences *sequences)
+{
+    // only phase sampling changes the sequences
+    if (!model->unphased) {
+        buf.put_int(0);
+        return;
+    }
+
+    const int nseqs = sequences->get_num_seqs();
+    const int seqlen = sequences->length();
+    buf.put_int(nseqs);
+    buf.put_int(seqlen);
+    for (int i=0; i<nseqs; i++)
+        buf.put(sequences->seqs[i], seqlen);
+
+    const bool have_base_probs = sequences->base_probs.size() > 0;
+    buf.put_int(have_base_probs);
+    if (have_base_probs)
+        for (int i=0; i<nseqs; i++)
+            buf.put(&sequences->base_probs[i][0], sizeof(BaseProbs) * seqlen);
+}
+
+
+static void write_trees(CheckpointBuffer &buf, const LocalTrees *trees)
+{
+    buf.put_int(trees->chrom.size());
+    buf.put(trees->chrom.c_str(), trees->chrom.size());
+    buf.put_int(trees->start_coord);
+    buf.put_int(trees->end_coord);
+    buf.put_int(trees->nnodes);
+    buf.put_int(trees->seqids.size());
+    buf.put(trees->seqids.data(), sizeof(int) * trees->seqids.size());
+    buf.put_int(trees->get_num_trees());
+
+    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end();
+         ++it) {
+        const LocalTree *tree = it->tree;
+        buf.put_int(it->blocklen);
+        buf.put(&it->spr, sizeof(Spr));
+        buf.put_int(tree->nnodes);
+        buf.put_int(tree->capacity);
+        buf.put_int(tree->root);
+        buf.put(tree->nodes, sizeof(LocalNode) * tree->nnodes);
+        buf.put_int(it->mapping != NULL);
+        if (it->mapping)
+            buf.put(it->mapping, sizeof(int) * tree->nnodes);
+    }
+}
+
+
+bool write_checkpoint(const char *filename, int iter, long stats_offset,
+                      const RandomStream *random, const ArgModel *model,
+                      const Sequences *sequences, const LocalTrees *trees)
+{
+    CheckpointHeader header = CheckpointHeader();
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.iter = iter;
+    header.random = *random;
+    header.heat = model->mc3.heat;
+    header.stats_offset = stats_offset;
+
+    CheckpointBuffer buf;
+    buf.put(&header, sizeof(header));
+    header.model_offset = buf.data.size();
+    write_model(buf, model);
+    header.seqs_offset = buf.data.size();
+    write_sequences(buf, model, sequences);
+    header.trees_offset = buf.data.size();
+    write_trees(buf, trees);
+    header.size = buf.data.size();
+    memcpy(&buf.data[0], &header, sizeof(header));
+
+    // write a temporary file and move it over the last checkpoint
+    string tmp_filename = string(filename) + ".tmp";
+    FILE *out = fopen(tmp_filename.c_str(), "wb");
+    if (!out) {
+        printError("cannot write checkpoint '%s'", tmp_filename.c_str());
+        return false;
+    }
+    bool ok = (fwrite(&buf.data[0], 1, buf.data.size(), out) ==
+               buf.data.size());
+    ok = (fflush(out) == 0) && ok;
+    ok = (fsync(fileno(out)) == 0) && ok;
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(tmp_filename.c_str(), filename) != 0) {
+        printError("cannot write checkpoint '%s'", filename);
+        unlink(tmp_filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+//=============================================================================
+// reading
+
+// reads consecutive values from a section of a checkpoint
+class CheckpointCursor
+{
+public:
+    CheckpointCursor(const char *data, size_t size, long long offset) :
+        data(data), size(size), pos(offset), ok(offset <= (long long) size)
+    {}
+
+    bool get(void *ptr, size_t len)
+    {
+        if (!ok || pos + len > size) {
+            ok = false;
+            return false;
+        }
+        memcpy(ptr, data + pos, len);
+        pos += len;
+        return true;
+    }
+
+    int get_int()
+    {
+        int value = 0;
+        get(&value, sizeof(value));
+        return value;
+    }
+
+    double get_double()
+    {
+        double value = 0.0;
+        get(&value, sizeof(value));
+        return value;
+    }
+
+    const char *data;
+    size_t size;
+    size_t pos;
+    bool ok;
+};
+
+
+bool CheckpointReader::open(const char *filename)
+{
+    close();
+
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(CheckpointHeader)) {
+        printError("checkpoint '%s' is truncated", filename);
+        ::close(fd);
+        return false;
+    }
+    void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (ptr == MAP_FAILED) {
+        printError("cannot map checkpoint '%s'", filename);
+        return false;
+    }
+    data = (const char*) ptr;
+    size = st.st_size;
+
+    const CheckpointHeader &header = get_header();
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CHECKPOINT_VERSION ||
+        header.size != (long long) size) {
+        printError("'%s' is not a valid checkpoint", filename);
+        close();
+        return false;
+    }
+    return true;
+}
+
+
+void CheckpointReader::close()
+{
+    if (data) {
+        munmap((void*) data, size);
+        data = NULL;
+        size = 0;
+    }
+}
+
+
+bool CheckpointReader::read_model(ArgModel *model) const
+{
+    CheckpointCursor cur(data, size, get_header().model_offset);
+    const int ntimes = cur.get_int();
+    const int npops = cur.get_int();
+    if (ntimes != model->ntimes || npops != model->num_pops()) {
+        printError("checkpoint model (ntimes=%d, npops=%d) does not match"
+                   " (ntimes=%d, npops=%d)", ntimes, npops,
+                   model->ntimes, model->num_pops());
+        return false;
+    }
+    for (int pop=0; pop<npops; pop++)
+        cur.get(model->popsizes[pop], sizeof(double) * (2*ntimes-1));
+
+    PopulationTree *pop_tree = model->pop_tree;
+    if (cur.get_int() != (pop_tree != NULL)) {
+        printError("checkpoint population tree does not match");
+        return false;
+    }
+    if (pop_tree) {
+        pop_tree->max_migrations = cur.get_int();
+        if (cur.get_int() != (int) pop_tree->mig_matrix.size()) {
+            printError("checkpoint migration matrices do not match");
+            return false;
+        }
+        for (unsigned int i=0; i<pop_tree->mig_matrix.size(); i++)
+            for (int a=0; a<pop_tree->npop; a++)
+                for (int b=0; b<pop_tree->npop; b++)
+                    pop_tree->mig_matrix[i].set(a, b, cur.get_double());
+        pop_tree->update_population_probs();
+    }
+
+    model->mc3.heat = get_header().heat;
+    return cur.ok;
+}
+
+
+bool CheckpointReader::read_sequences(Sequences *sequences) const
+{
+    CheckpointCursor cur(data, size, get_header().seqs_offset);
+    const int nseqs = cur.get_int();
+    if (nseqs == 0)
+        return cur.ok;
+
+    const int seqlen = cur.get_int();
+    if (nseqs != sequences->get_num_seqs() || seqlen != sequences->length()) {
+        printError("checkpoint sequences (nseqs=%d, length=%d) do not match"
+                   " (nseqs=%d, length=%d)", nseqs, seqlen,
+                   sequences->get_num_seqs(), sequences->length());
+        return false;
+    }
+    for (int i=0; i<nseqs; i++)
+        cur.get(sequences->seqs[i], seqlen);
+
+    const bool have_base_probs = cur.get_int();
+    if (have_base_probs != (sequences->base_probs.size() > 0)) {
+        printError("checkpoint base probabilities do not match");
+        return false;
+    }
+    if (have_base_probs)
+        for (int i=0; i<nseqs; i++)
+            cur.get(&sequences->base_probs[i][0], sizeof(BaseProbs) * seqlen);
+    return cur.ok;
+}
+
+
+bool CheckpointReader::read_trees(LocalTrees *trees) const
+{
+    CheckpointCursor cur(data, size, get_header().trees_offset);
+    trees->clear();
+
+    const int chrom_len = cur.get_int();
+    if (chrom_len < 0 || cur.pos + chrom_len > size)
+        return false;
+    trees->chrom.assign(data + cur.pos, chrom_len);
+    cur.pos += chrom_len;
+    trees->start_coord = cur.get_int();
+    trees->end_coord = cur.get_int();
+    trees->nnodes = cur.get_int();
+    const int nleaves = cur.get_int();
+    if (nleaves < 0 || nleaves > trees->nnodes)
+        return false;
+    trees->seqids.resize(nleaves);
+    cur.get(trees->seqids.data(), sizeof(int) * nleaves);
+    const int ntrees = cur.get_int();
+
+    for (int i=0; i<ntrees && cur.ok; i++) {
+        const int blocklen = cur.get_int();
+        Spr spr;
+        cur.get(&spr, sizeof(Spr));
+        const int nnodes = cur.get_int();
+        const int capacity = cur.get_int();
+        if (nnodes < 0 || !cur.ok)
+            return false;
+        LocalTree *tree = new LocalTree(nnodes, capacity);
+        tree->root = cur.get_int();
+        cur.get(tree->nodes, sizeof(LocalNode) * nnodes);
+        int *mapping = NULL;
+        if (cur.get_int()) {
+            mapping = alloc_node_mapping(max(capacity, nnodes));
+            fill(mapping, mapping + max(capacity, nnodes), -1);
+            cur.get(mapping, sizeof(int) * nnodes);
+        }
+        trees->trees.push_back(LocalTreeSpr(tree, spr, blocklen, mapping));
+    }
+
+    if (!cur.ok)
+        printError("checkpoint trees are truncated");
+    return cur.ok;
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,87 @@
+//=============================================================================
+// Binary checkpoints of arg-sample
+//
+// A checkpoint holds everything the resampling loop of arg-sample carries
+// from one iteration to the next: the compressed local trees with their
+// SPRs and mappings, the sampled model parameters (population sizes and
+// migration rates), the phase of unphased sequences, the state of the
+// random number generator, the iteration and the MC3 heat.  Resuming from a
+// checkpoint continues the chain exactly where it was written, so a resumed
+// run is identical to an uninterrupted one.
+//
+// Checkpoints are written to a temporary file that is renamed over the
+// previous checkpoint, and are read through mmap.  The format is a raw
+// snapshot and is only meant to be read on the machine that wrote it.
+
+#ifndef ARGWEAVER_CHECKPOINT_H
+#define ARGWEAVER_CHECKPOINT_H
+
+#include <stddef.h>
+
+#include "common.h"
+#include "local_tree.h"
+#include "model.h"
+#include "sequences.h"
+
+
+namespace argweaver {
+
+
+class CheckpointHeader
+{
+public:
+    char magic[8];
+    int version;
+    int iter;                       // last completed iteration
+    RandomStream random;            // stream of the sampling thread
+    double heat;                    // MC3 heat of the chain
+    long long stats_offset;         // length of the stats file
+    long long model_offset;         // offsets of the sections
+    long long seqs_offset;
+    long long trees_offset;
+    long long size;
+};
+
+
+// write a checkpoint to filename, replacing any previous one atomically
+bool write_checkpoint(const char *filename, int iter, long stats_offset,
+                      const RandomStream *random, const ArgModel *model,
+                      const Sequences *sequences, const LocalTrees *trees);
+
+
+class CheckpointReader
+{
+public:
+    CheckpointReader() :
+        data(NULL),
+        size(0)
+    {}
+    ~CheckpointReader()
+    {
+        close();
+    }
+
+    bool open(const char *filename);
+    void close();
+    bool is_open() const { return data != NULL; }
+
+    const CheckpointHeader &get_header() const {
+        return *(const CheckpointHeader*) data;
+    }
+
+    // restore the sampled parameters of a model with the same times and
+    // populations
+    bool read_model(ArgModel *model) const;
+    // restore the phase of sequences, if it was saved
+    bool read_sequences(Sequences *sequences) const;
+    bool read_trees(LocalTrees *trees) const;
+
+protected:
+    const char *data;
+    size_t size;
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_CHECKPOINT_H
@@ -419,7 +419,7 @@ bool read_coal_records(FILE *file, const ArgModel *model,
             int new_pos = atoi(fields[1].c_str());
             int *mapping = NULL;
             if (!spr.is_null()) {
-                mapping = new int [nnodes];
+                mapping = alloc_node_mapping(nnodes);
                 for (int i=0; i < nnodes; i++)
                     mapping[i] = i;
                 mapping[last_tree->nodes[spr.recomb_node].parent] = -1;
@@ -447,7 +447,7 @@ bool read_coal_records(FILE *file, const ArgModel *model,
     }
     if (last_tree) {
         int *mapping = NULL;
-        mapping = new int[nnodes];
+        mapping = alloc_node_mapping(nnodes);
         for (int i=0; i < nnodes; i++)
             mapping[i] = i;
         mapping[last_tree->nodes[spr.recomb_node].parent] = -1;
@@ -4,6 +4,10 @@
 
 namespace argweaver {
 
+thread_local RandomStream *g_thread_random = NULL;
+thread_local RandomStream g_default_random;
+
+
 /* make a draw from a gamma distribution with parameters 'a' and
  * 'b'. Be sure to call srandom externally.  If a == 1, exp_draw is
  * called.  If a > 1, Best's (1978) rejection algorithm is used, and
@@ -5,6 +5,7 @@
 // headers c++
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <algorithm>
 #include <sys/stat.h>
@@ -98,44 +99,158 @@ void permute(T* array, int *perm, int size)
 }
 
 
+//=============================================================================
+// Random numbers
+//
+// All random draws go through rand_int(), which uses the RandomStream
+// installed by the calling thread, or else a default stream of the thread
+// seeded by seed_random().  Work that is split across threads gives each
+// piece its own stream, keyed by a seed drawn beforehand and the index of
+// the piece, so results do not depend on the number of threads or their
+// scheduling.
+
+// A Philox4x32-10 counter-based generator (Salmon et al. 2011) with the
+// same range as rand().  Each block of four outputs is a keyed bijection
+// of a 128-bit counter: the key is the seed, the high half of the counter
+// names the stream and the low half counts blocks.  Streams of the same
+// seed with different ids are independent, and the whole state is plain
+// data that checkpoints can save and restore.
+class RandomStream
+{
+public:
+    explicit RandomStream(unsigned long long seed=0,
+                          unsigned long long stream=0) :
+        index(4),
+        have_normal(false),
+        normal(0.0)
+    {
+        key[0] = (unsigned int) seed;
+        key[1] = (unsigned int) (seed >> 32);
+        counter[0] = 0;
+        counter[1] = 0;
+        counter[2] = (unsigned int) stream;
+        counter[3] = (unsigned int) (stream >> 32);
+    }
+
+    int next()
+    {
+        if (index == 4)
+            generate();
+        return int((block[index++] >> 1) %
+                   ((unsigned long long) RAND_MAX + 1));
+    }
+
+    unsigned int key[2];
+    unsigned int counter[4];  // counter of the next block
+    unsigned int block[4];    // current block of outputs
+    int index;                // next output in block
+
+    // second draw of the last pair made by rand_norm()
+    bool have_normal;
+    double normal;
+
+protected:
+    void generate()
+    {
+        unsigned int x[4] = {counter[0], counter[1], counter[2], counter[3]};
+        unsigned int k0 = key[0], k1 = key[1];
+        for (int round=0; round<10; round++) {
+            const unsigned long long p0 = 0xD2511F53ULL * x[0];
+            const unsigned long long p1 = 0xCD9E8D57ULL * x[2];
+            const unsigned int y[4] = {
+                (unsigned int) (p1 >> 32) ^ x[1] ^ k0, (unsigned int) p1,
+                (unsigned int) (p0 >> 32) ^ x[3] ^ k1, (unsigned int) p0};
+            x[0] = y[0]; x[1] = y[1]; x[2] = y[2]; x[3] = y[3];
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+        block[0] = x[0]; block[1] = x[1]; block[2] = x[2]; block[3] = x[3];
+        index = 0;
+        if (++counter[0] == 0)
+            counter[1]++;
+    }
+};
+
+// stream installed by the calling thread, or NULL
+extern thread_local RandomStream *g_thread_random;
+// stream of threads that have not installed one
+extern thread_local RandomStream g_default_random;
+
+inline RandomStream &get_random()
+{ return g_thread_random ? *g_thread_random : g_default_random; }
+
+inline int rand_int()
+{ return get_random().next(); }
+
+// restarts the stream of the calling thread from seed
+inline void seed_random(unsigned long long seed)
+{ get_random() = RandomStream(seed); }
+
+// returns a seed for new RandomStreams drawn from the current stream
+inline unsigned long long rand_seed()
+{
+    const unsigned long long high = rand_int();
+    return (high << 32) ^ (unsigned long long) rand_int();
+}
+
+// installs a stream for the calling thread during its lifetime
+class ScopedRandomStream
+{
+public:
+    explicit ScopedRandomStream(RandomStream *stream) :
+        last(g_thread_random)
+    {
+        g_thread_random = stream;
+    }
+
+    ~ScopedRandomStream()
+    {
+        g_thread_random = last;
+    }
+
+protected:
+    RandomStream *last;
+};
+
+
 //=============================================================================
 // Math
 
 inline double frand()
-{ return rand() / double(RAND_MAX); }
+{ return rand_int() / double(RAND_MAX); }
 
 inline double frand(double max)
-{ return rand() / double(RAND_MAX) * max; }
+{ return rand_int() / double(RAND_MAX) * max; }
 
 inline double frand(double min, double max)
-{ return min + (rand() / double(RAND_MAX) * (max-min)); }
+{ return min + (rand_int() / double(RAND_MAX) * (max-min)); }
 
 inline int irand(int max)
 {
-    const int i = int(rand() / float(RAND_MAX) * max);
+    const int i = int(rand_int() / float(RAND_MAX) * max);
     return (i == max) ? max - 1 : i;
 }
 
 inline int irand(int min, int max)
 {
-    const int i = min + int(rand() / float(RAND_MAX) * (max - min));
+    const int i = min + int(rand_int() / float(RAND_MAX) * (max - min));
     return (i == max) ? max - 1 : i;
 }
 
 inline double rand_norm(const double mean=0, const double sd=1) {
-  static bool gen_new=true;
-  static double y=0;
+  // the second draw of each pair is kept in the stream
+  RandomStream &stream = get_random();
   double x;
   double pi = 3.1415926535897;
-  if (gen_new) {
+  if (!stream.have_normal) {
      double r1 = sqrt(-2.0*log(frand()));
      double r2 = 2*pi*frand();
      x = r1 * cos(r2);
-     y = r1 * sin(r2);
-     gen_new = false;
+     stream.normal = r1 * sin(r2);
+     stream.have_normal = true;
   } else {
-     x = y;
-     gen_new = true;
+     x = stream.normal;
+     stream.have_normal = false;
   }
   x *= sd;
   x += mean;
@@ -1,6 +1,14 @@
-
 #include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <zlib.h>
 
 #include "compress.h"
 #include "parsing.h"
@@ -9,22 +17,48 @@ namespace argweaver {
 
 using namespace std;
 
+
+static atomic<int> g_compress_threads(0);
+
+
+void set_compress_threads(int nthreads)
+{
+    g_compress_threads = nthreads;
+}
+
+
+int get_compress_threads()
+{
+    return g_compress_threads;
+}
+
+
+// returns true if command is one of the default zip/unzip commands, which
+// are run within this process
+static bool is_default_command(const char *command)
+{
+    return !command || strcmp(command, ZIP_COMMAND) == 0 ||
+        strcmp(command, UNZIP_COMMAND) == 0;
+}
+
+
 FILE *read_compress(const char *filename, const char *command)
 {
     bool exists = !access(filename, F_OK);
     if (!exists)
         return NULL;
-    const char *command2 = (command ? command : UNZIP_COMMAND);
-    string cmd = string(command2) + " < " + quote_arg(filename);
+    if (is_default_command(command))
+        return read_gzip(filename);
+    string cmd = string(command) + " < " + quote_arg(filename);
     return popen(cmd.c_str(), "r");
 }
 
 
 FILE *write_compress(const char *filename, const char *command)
 {
-    // TODO: add check to prevent write error
-    const char *command2 = (command ? command : ZIP_COMMAND);
-    string cmd = string(command2) + " > " + quote_arg(filename);
+    if (is_default_command(command))
+        return write_bgzf(filename, get_compress_threads());
+    string cmd = string(command) + " > " + quote_arg(filename);
     return popen(cmd.c_str(), "w");
 }
 
@@ -32,6 +66,11 @@ FILE *write_compress(const char *filename, const char *command)
 FILE *open_compress(const char *filename, const char *mode,
                     const char *command)
 {
+    if (mode[0] == 'r' && is_default_command(command))
+        return read_compress(filename);
+    if (mode[0] == 'w' && is_default_command(command))
+        return write_compress(filename);
+
     string cmd;
     if (mode[0] == 'w')
         cmd = string(command) + " > " + quote_arg(filename);
@@ -42,12 +81,376 @@ FILE *open_compress(const char *filename, const char *mode,
 }
 
 
+//=============================================================================
+// streams opened within this process
+//
+// close_compress() must tell the streams opened here from the pipes opened
+// by popen(), so the streams opened here are kept in a set until closed.
+
+static mutex g_streams_lock;
+static unordered_set<FILE*> g_streams;
+
+
+static void add_stream(FILE *stream)
+{
+    lock_guard<mutex> guard(g_streams_lock);
+    g_streams.insert(stream);
+}
+
+
+static void remove_stream(FILE *stream)
+{
+    lock_guard<mutex> guard(g_streams_lock);
+    g_streams.erase(stream);
+}
+
+
 int close_compress(FILE *stream)
 {
-    return pclose(stream);
+    bool local;
+    {
+        lock_guard<mutex> guard(g_streams_lock);
+        local = (g_streams.count(stream) > 0);
+    }
+    return local ? fclose(stream) : pclose(stream);
 }
 
 
-} // namespace argweaver
+//=============================================================================
+// reading gzip files
+
+struct GzipReader
+{
+    gzFile file;
+    FILE *stream;
+};
+
+
+static ssize_t gzip_cookie_read(void *cookie, char *buf, size_t size)
+{
+    return gzread(((GzipReader*) cookie)->file, buf, size);
+}
+
+
+static int gzip_cookie_close(void *cookie)
+{
+    GzipReader *reader = (GzipReader*) cookie;
+    remove_stream(reader->stream);
+    int ret = gzclose(reader->file);
+    delete reader;
+    return ret == Z_OK ? 0 : EOF;
+}
+
+
+FILE *read_gzip(const char *filename)
+{
+    // gzread() reads the members of a BGZF file one after another, and
+    // reads files that are not compressed as they are
+    gzFile file = gzopen(filename, "rb");
+    if (!file)
+        return NULL;
+    gzbuffer(file, 1 << 17);
+
+    GzipReader *reader = new GzipReader;
+    reader->file = file;
+    cookie_io_functions_t funcs = {gzip_cookie_read, NULL, NULL,
+                                   gzip_cookie_close};
+    reader->stream = fopencookie(reader, "r", funcs);
+    if (!reader->stream) {
+        gzclose(file);
+        delete reader;
+        return NULL;
+    }
+    add_stream(reader->stream);
+    return reader->stream;
+}
+
+
+//=============================================================================
+// writing BGZF files
+
+// uncompressed bytes per block, which leaves room for the block to grow
+// when its data does not compress
+static const int BGZF_DATA_SIZE = 0xff00;
+static const int BGZF_MAX_BLOCK_SIZE = 0x10000;
+static const int BGZF_HEADER_SIZE = 18;
+static const int BGZF_FOOTER_SIZE = 8;
+
+// gzip header with the 'BC' extra field that holds the block size
+static const unsigned char BGZF_HEADER[BGZF_HEADER_SIZE] = {
+    0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0, 0};
+
+// empty block that marks the end of a BGZF file
+static const unsigned char BGZF_EOF[28] = {
+    0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0x1b, 0,
+    3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+// same compression level as the gzip command
+static const int BGZF_LEVEL = 6;
 
 
+static inline void put_le(unsigned char *buf, unsigned int value, int nbytes)
+{
+    for (int i=0; i<nbytes; i++)
+        buf[i] = (value >> (8 * i)) & 0xff;
+}
+
+
+// deflate data into out, returning the compressed size, or -1 if it does
+// not fit in max_size bytes
+static int deflate_block(const char *data, int len, int level,
+                         unsigned char *out, int max_size)
+{
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    zs.next_in = (Bytef*) data;
+    zs.avail_in = len;
+    zs.next_out = out;
+    zs.avail_out = max_size;
+    int ret = deflate(&zs, Z_FINISH);
+    int size = max_size - zs.avail_out;
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END ? size : -1;
+}
+
+
+// compress data into one BGZF block
+static bool compress_bgzf_block(const char *data, int len,
+                                vector<unsigned char> &block)
+{
+    block.resize(BGZF_MAX_BLOCK_SIZE);
+    unsigned char *buf = &block[0];
+    const int max_size = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE -
+        BGZF_FOOTER_SIZE;
+
+    // data that does not compress is stored
+    int size = deflate_block(data, len, BGZF_LEVEL,
+                             buf + BGZF_HEADER_SIZE, max_size);
+    if (size < 0)
+        size = deflate_block(data, len, 0, buf + BGZF_HEADER_SIZE, max_size);
+    if (size < 0)
+        return false;
+
+    const int block_size = BGZF_HEADER_SIZE + size + BGZF_FOOTER_SIZE;
+    copy(BGZF_HEADER, BGZF_HEADER + BGZF_HEADER_SIZE, buf);
+    put_le(buf + 16, block_size - 1, 2);
+    unsigned char *footer = buf + BGZF_HEADER_SIZE + size;
+    put_le(footer, crc32(crc32(0, NULL, 0), (const Bytef*) data, len), 4);
+    put_le(footer + 4, len, 4);
+    block.resize(block_size);
+    return true;
+}
+
+
+// Writes data as BGZF blocks.  With threads, full blocks are queued and
+// compressed by the threads, and written in order as they are done.
+class BgzfWriter
+{
+public:
+    BgzfWriter(FILE *out, int nthreads) :
+        stream(NULL),
+        out(out),
+        ok(true),
+        stopping(false)
+    {
+        data.reserve(BGZF_DATA_SIZE);
+        for (int i=0; i<nthreads; i++)
+            workers.push_back(thread(&BgzfWriter::work, this));
+    }
+
+    ~BgzfWriter()
+    {
+        stop();
+        for (unsigned int i=0; i<queue.size(); i++)
+            delete queue[i];
+    }
+
+    bool write(const char *buf, size_t size)
+    {
+        while (size > 0 && ok) {
+            size_t len = min(size, BGZF_DATA_SIZE - data.size());
+            data.insert(data.end(), buf, buf + len);
+            buf += len;
+            size -= len;
+            if (data.size() == (size_t) BGZF_DATA_SIZE)
+                flush_block();
+        }
+        return ok;
+    }
+
+    bool close()
+    {
+        if (!data.empty())
+            flush_block();
+        if (!workers.empty()) {
+            unique_lock<mutex> guard(lock);
+            write_done(guard, 0);
+        }
+        stop();
+
+        if (ok && fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), out) !=
+            sizeof(BGZF_EOF))
+            ok = false;
+        if (fclose(out) != 0)
+            ok = false;
+        return ok;
+    }
+
+    FILE *stream;
+
+protected:
+    struct Block
+    {
+        Block() : started(false), done(false), ok(false) {}
+
+        vector<char> data;
+        vector<unsigned char> out;
+        bool started;
+        bool done;
+        bool ok;
+    };
+
+    void write_block(const vector<unsigned char> &block)
+    {
+        if (ok && fwrite(&block[0], 1, block.size(), out) != block.size())
+            ok = false;
+    }
+
+    // compress the current block, or queue it for the threads
+    void flush_block()
+    {
+        if (workers.empty()) {
+            ok = compress_bgzf_block(&data[0], data.size(), block) && ok;
+            write_block(block);
+            data.clear();
+            return;
+        }
+
+        Block *next = new Block();
+        next->data.swap(data);
+        data.reserve(BGZF_DATA_SIZE);
+
+        unique_lock<mutex> guard(lock);
+        queue.push_back(next);
+        changed.notify_all();
+        write_done(guard, 2 * workers.size());
+    }
+
+    // write the compressed blocks at the front of the queue, waiting for
+    // blocks until at most max_queued remain
+    void write_done(unique_lock<mutex> &guard, size_t max_queued)
+    {
+        while (!queue.empty()) {
+            Block *front = queue.front();
+            if (!front->done) {
+                if (queue.size() <= max_queued)
+                    break;
+                changed.wait(guard);
+                continue;
+            }
+
+            queue.pop_front();
+            guard.unlock();
+            ok = front->ok && ok;
+            write_block(front->out);
+            delete front;
+            guard.lock();
+        }
+    }
+
+    void work()
+    {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            Block *next = NULL;
+            for (unsigned int i=0; i<queue.size() && !next; i++)
+                if (!queue[i]->started)
+                    next = queue[i];
+            if (!next) {
+                if (stopping)
+                    return;
+                changed.wait(guard);
+                continue;
+            }
+
+            next->started = true;
+            guard.unlock();
+            next->ok = compress_bgzf_block(&next->data[0], next->data.size(),
+                                           next->out);
+            guard.lock();
+            next->done = true;
+            changed.notify_all();
+        }
+    }
+
+    void stop()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        changed.notify_all();
+        for (unsigned int i=0; i<workers.size(); i++)
+            workers[i].join();
+        workers.clear();
+    }
+
+    FILE *out;
+    bool ok;
+    vector<char> data;             // data of the current block
+    vector<unsigned char> block;   // compressed block without threads
+
+    vector<thread> workers;
+    mutex lock;
+    condition_variable changed;
+    deque<Block*> queue;           // blocks not yet written, in order
+    bool stopping;
+};
+
+
+static ssize_t bgzf_cookie_write(void *cookie, const char *buf, size_t size)
+{
+    if (size == 0)
+        return 0;
+    return ((BgzfWriter*) cookie)->write(buf, size) ? size : -1;
+}
+
+
+static int bgzf_cookie_close(void *cookie)
+{
+    BgzfWriter *writer = (BgzfWriter*) cookie;
+    remove_stream(writer->stream);
+    bool ok = writer->close();
+    delete writer;
+    return ok ? 0 : EOF;
+}
+
+
+FILE *write_bgzf(const char *filename, int nthreads)
+{
+    FILE *out = fopen(filename, "wb");
+    if (!out)
+        return NULL;
+
+    BgzfWriter *writer = new BgzfWriter(out, max(nthreads, 0));
+    cookie_io_functions_t funcs = {NULL, bgzf_cookie_write, NULL,
+                                   bgzf_cookie_close};
+    writer->stream = fopencookie(writer, "w", funcs);
+    if (!writer->stream) {
+        writer->close();
+        delete writer;
+        return NULL;
+    }
+    setvbuf(writer->stream, NULL, _IOFBF, 1 << 16);
+    add_stream(writer->stream);
+    return writer->stream;
+}
+
+
+} // namespace argweaver
@@ -12,6 +12,13 @@ namespace argweaver {
 #define UNZIP_COMMAND "gunzip -f -"
 
 
+// Compressed files are read and written within this process with zlib,
+// unless a command other than the default one is given, in which case the
+// file is piped through that command.  Files are written in the BGZF
+// format, a series of gzip members of at most 64 KB each, which gzip reads
+// as an ordinary .gz file and tabix can index.  Streams are closed with
+// close_compress().
+
 FILE *read_compress(const char *filename, const char *command=UNZIP_COMMAND);
 
 FILE *write_compress(const char *filename, const char *command=ZIP_COMMAND);
@@ -21,6 +28,18 @@ FILE *open_compress(const char *filename, const char *mode,
 
 int close_compress(FILE *stream);
 
+// open a stream that reads a gzip compressed, or an uncompressed, file
+FILE *read_gzip(const char *filename);
+
+// open a stream that BGZF compresses into filename.  With nthreads > 0,
+// blocks are compressed by that many threads while the caller writes.
+FILE *write_bgzf(const char *filename, int nthreads=0);
+
+// number of threads compressing the blocks of each file opened by
+// write_compress()
+void set_compress_threads(int nthreads);
+int get_compress_threads();
+
 
 class CompressStream
 {
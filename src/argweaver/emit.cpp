@@ -1,6 +1,12 @@
 
+// c++ includes
+#include <atomic>
+#include <string>
+#include <unordered_map>
+
 #include "common.h"
 #include "emit.h"
+#include "emit_kernel.h"
 #include "seq.h"
 #include "thread.h"
 
@@ -85,6 +91,67 @@ void find_masked_sites(const char *const *seqs, int nseqs, int seqlen,
 }
 
 
+//=============================================================================
+// site patterns
+
+// number of variant sites seen by calc_emissions, and the number of those
+// whose emissions were copied from an earlier site with the same pattern
+static atomic<long> g_pattern_sites(0);
+static atomic<long> g_pattern_hits(0);
+
+
+// Populates array 'pattern' with the first variant site having the same
+// column (bases and base probabilities) as each variant site.  Sites with
+// 'unique[i]' set are never merged with other sites.
+// Returns the number of distinct patterns.
+// The first site of each (non-unique) pattern is recorded in 'patterns'.
+static int find_site_patterns(const char *const *seqs, int nseqs, int seqlen,
+                              const bool *variant,
+                              const vector<vector<BaseProbs> > &base_probs,
+                              const bool *unique, int *pattern,
+                              unordered_map<string, int> &patterns)
+{
+    const bool have_base_probs = ( base_probs.size() > 0 );
+    string key;
+    int npatterns = 0;
+
+    for (int i=0; i<seqlen; i++) {
+        pattern[i] = i;
+        if (!variant[i])
+            continue;
+        if (unique && unique[i]) {
+            npatterns++;
+            continue;
+        }
+
+        key.resize(nseqs);
+        for (int j=0; j<nseqs; j++)
+            key[j] = seqs[j][i];
+        if (have_base_probs) {
+            for (int j=0; j<nseqs; j++)
+                key.append((const char*) base_probs[j][i].prob,
+                           sizeof(base_probs[j][i].prob));
+        }
+
+        pair<unordered_map<string, int>::iterator, bool> it =
+            patterns.insert(make_pair(key, i));
+        if (it.second)
+            npatterns++;
+        else
+            pattern[i] = it.first->second;
+    }
+
+    return npatterns;
+}
+
+
+void get_site_pattern_counts(long *nsites, long *nhits)
+{
+    *nsites = g_pattern_sites;
+    *nhits = g_pattern_hits;
+}
+
+
 int count_alleles(const char *const *seqs,
                   const int nseqs, const int pos)
 {
@@ -358,6 +425,248 @@ void calc_inner_outer(const LocalTree *tree, const ArgModel *model,
 }
 
 
+// Match the nodes of 'tree' to the nodes of the tree cached in 'cache'.
+// inner_match[n] is set to the cached node with the same inner table as
+// node n (same subtree and branch lengths) and outer_match[n] to the cached
+// node with the same outer table, or -1 if there is none.
+static void match_cached_nodes(const LocalTree *tree, const int *order,
+                               const double *muts, int maintree_root,
+                               const LikelihoodCache *cache,
+                               int *inner_match, int *outer_match)
+{
+    const int nnodes = tree->nnodes;
+    const LocalNode *nodes = tree->nodes;
+    fill(inner_match, inner_match + nnodes, -1);
+    fill(outer_match, outer_match + nnodes, -1);
+    if (cache->nnodes != nnodes || cache->maintree_root == -1)
+        return;
+
+    const int *parents = &cache->parents[0];
+    const int *children = &cache->children[0];
+    const double *muts2 = &cache->muts[0];
+
+    // inner tables depend only on the subtree below a node
+    for (int i=0; i<nnodes; i++) {
+        const int j = order[i];
+        if (nodes[j].is_leaf()) {
+            inner_match[j] = j;
+        } else {
+            const int c1 = nodes[j].child[0];
+            const int c2 = nodes[j].child[1];
+            const int o1 = inner_match[c1];
+            const int o2 = inner_match[c2];
+            if (o1 != -1 && o2 != -1 && parents[o1] != -1 &&
+                parents[o1] == parents[o2] &&
+                muts[c1] == muts2[o1] && muts[c2] == muts2[o2])
+                inner_match[j] = parents[o1];
+        }
+    }
+
+    // outer tables depend on the sibling's subtree and the parent's outer
+    // table, so they are matched in preorder
+    outer_match[maintree_root] = cache->maintree_root;
+    for (int i=nnodes-1; i>=0; i--) {
+        const int j = order[i];
+        const int parent = nodes[j].parent;
+        if (j == maintree_root || parent == -1 || outer_match[parent] == -1)
+            continue;
+        const int sib = tree->get_sibling(j);
+        const int osib = inner_match[sib];
+        if (osib == -1 || parents[osib] != outer_match[parent] ||
+            muts[sib] != muts2[osib])
+            continue;
+        if (parent != maintree_root && muts[parent] != muts2[parents[osib]])
+            continue;
+        const int oparent = parents[osib];
+        outer_match[j] = (children[2*oparent] == osib ?
+                          children[2*oparent+1] : children[2*oparent]);
+    }
+}
+
+
+// set the inner table of a leaf at one site
+static inline void leaf_site_lk(double *row, int stride, char c,
+                                const BaseProbs *base_probs)
+{
+    if (c == 'N') {
+        for (int b=0; b<4; b++)
+            row[b*stride] = 1.0;
+    } else if (base_probs) {
+        for (int b=0; b<4; b++)
+            row[b*stride] = base_probs->prob[b];
+    } else {
+        for (int b=0; b<4; b++)
+            row[b*stride] = 0.0;
+        row[dna2int[(int) c]*stride] = 1.0;
+    }
+}
+
+
+// Calculate inner and outer tables in site-major layout.  Column c of the
+// tables holds site sites[c].  The first 'nfull' columns are computed from
+// scratch with the emission kernels.  The remaining columns hold patterns
+// found in the cache (cache_index[c]) and only recompute the nodes affected
+// by the SPR since the cached tree.  If a cache is given it is then
+// replaced by the tables of this block's patterns.
+static void calc_inner_outer_soa(
+    const LocalTree *tree, const ArgModel *model, const char *const *seqs,
+    const vector<vector<BaseProbs> > &base_probs,
+    const vector<int> &sites, int nfull, const vector<int> &cache_index,
+    const unordered_map<string, int> &patterns, const int *column,
+    bool internal, LikelihoodTableSoA &inner, LikelihoodTableSoA &outer,
+    LikelihoodCache *cache)
+{
+    const EmitKernel *kernel = get_emit_kernel();
+    const int nnodes = tree->nnodes;
+    const LocalNode *nodes = tree->nodes;
+    const int maintree_root = internal ? nodes[tree->root].child[1] :
+        tree->root;
+    const int stride = inner.stride;
+    const int rowsize = nnodes * 4;
+    const bool have_base_probs = ( base_probs.size() > 0 );
+
+    // get postorder
+    int order[nnodes];
+    tree->get_postorder(order);
+
+    // get mutation probabilities
+    double muts[nnodes];
+    double nomuts[nnodes];
+    fill(muts, muts + nnodes, 0.0);
+    fill(nomuts, nomuts + nnodes, 0.0);
+    prob_tree_mutation(tree, model, muts, nomuts);
+
+    // preorder of the main tree
+    int outer_order[nnodes];
+    int nouter = 0;
+    int queue[nnodes];
+    int top = 0;
+    queue[top++] = maintree_root;
+    while (top > 0) {
+        int node = queue[--top];
+        outer_order[nouter++] = node;
+        if (!nodes[node].is_leaf()) {
+            queue[top++] = nodes[node].child[0];
+            queue[top++] = nodes[node].child[1];
+        }
+    }
+
+    // inner tables of new patterns, all sites at once
+    for (int i=0; i<nnodes; i++) {
+        const int j = order[i];
+        if (nodes[j].is_leaf()) {
+            double *row = inner.node(j);
+            for (int c=0; c<nfull; c++)
+                leaf_site_lk(row + c, stride, seqs[j][sites[c]],
+                             have_base_probs ?
+                             &base_probs[j][sites[c]] : NULL);
+        } else {
+            const int c1 = nodes[j].child[0];
+            const int c2 = nodes[j].child[1];
+            kernel->inner(inner.node(j), inner.node(c1), inner.node(c2),
+                          muts[c1], nomuts[c1], muts[c2], nomuts[c2],
+                          nfull, stride);
+        }
+    }
+
+    // outer tables of new patterns
+    for (int i=0; i<nouter; i++) {
+        const int j = outer_order[i];
+        if (j == maintree_root) {
+            double *row = outer.node(j);
+            fill(row, row + 4 * stride, 1.0);
+        } else {
+            const int sib = tree->get_sibling(j);
+            const int parent = nodes[j].parent;
+            kernel->outer(outer.node(j), inner.node(sib),
+                          parent == maintree_root ? NULL : outer.node(parent),
+                          muts[sib], nomuts[sib],
+                          muts[parent], nomuts[parent], nfull, stride);
+        }
+    }
+
+    if (!cache)
+        return;
+
+    // update patterns seen in the previous block
+    const int ncols = sites.size();
+    if (nfull < ncols) {
+        int inner_match[nnodes];
+        int outer_match[nnodes];
+        match_cached_nodes(tree, order, muts, maintree_root, cache,
+                           inner_match, outer_match);
+        int inner_order[nnodes];
+        int ninner = 0;
+        for (int i=0; i<nnodes; i++)
+            if (inner_match[order[i]] == -1)
+                inner_order[ninner++] = order[i];
+
+        lk_row in[nnodes];
+        lk_row out[nnodes];
+        for (int c=nfull; c<ncols; c++) {
+            const double *inner2 = &cache->tables[2 * rowsize *
+                                                  cache_index[c]];
+            const double *outer2 = inner2 + rowsize;
+
+            for (int j=0; j<nnodes; j++)
+                if (inner_match[j] != -1)
+                    copy(inner2 + 4 * inner_match[j],
+                         inner2 + 4 * inner_match[j] + 4, in[j]);
+            for (int j=0; j<ninner; j++)
+                likelihood_site_node_inner(tree, inner_order[j], seqs,
+                                           base_probs, sites[c], muts,
+                                           nomuts, in);
+
+            for (int j=0; j<nouter; j++) {
+                const int node = outer_order[j];
+                if (outer_match[node] != -1)
+                    copy(outer2 + 4 * outer_match[node],
+                         outer2 + 4 * outer_match[node] + 4, out[node]);
+                else
+                    likelihood_site_node_outer(tree, maintree_root, node,
+                                               muts, nomuts, out, in);
+            }
+
+            for (int j=0; j<nnodes; j++)
+                for (int b=0; b<4; b++)
+                    inner.get(j, b, c) = in[j][b];
+            for (int j=0; j<nouter; j++)
+                for (int b=0; b<4; b++)
+                    outer.get(outer_order[j], b, c) = out[outer_order[j]][b];
+        }
+    }
+
+    // replace cache with this block
+    vector<double> tables(2 * rowsize * patterns.size(), 0.0);
+    cache->patterns.clear();
+    int k = 0;
+    for (unordered_map<string, int>::const_iterator it = patterns.begin();
+         it != patterns.end(); ++it, k++) {
+        const int c = column[it->second];
+        double *inner2 = &tables[2 * rowsize * k];
+        double *outer2 = inner2 + rowsize;
+        for (int j=0; j<nnodes; j++)
+            for (int b=0; b<4; b++)
+                inner2[4*j + b] = inner.get(j, b, c);
+        for (int j=0; j<nouter; j++)
+            for (int b=0; b<4; b++)
+                outer2[4*outer_order[j] + b] = outer.get(outer_order[j], b, c);
+        cache->patterns[it->first] = k;
+    }
+    cache->tables.swap(tables);
+    cache->nnodes = nnodes;
+    cache->maintree_root = maintree_root;
+    cache->parents.resize(nnodes);
+    cache->children.resize(2 * nnodes);
+    cache->muts.assign(muts, muts + nnodes);
+    for (int j=0; j<nnodes; j++) {
+        cache->parents[j] = nodes[j].parent;
+        cache->children[2*j] = nodes[j].child[0];
+        cache->children[2*j+1] = nodes[j].child[1];
+    }
+}
+
+
 
 void likelihood_sites(const LocalTree *tree, const ArgModel *model,
                       const char *const *seqs,
@@ -692,7 +1001,7 @@ void calc_emissions(const States &states, const LocalTree *tree,
                     const vector<vector<BaseProbs> > &base_probs,
                     int nseqs, int seqlen,
                     const ArgModel *model, bool internal, double **emit,
-		    PhaseProbs *phase_pr)
+		    PhaseProbs *phase_pr, LikelihoodCache *lk_cache)
 {
     const int nstates = states.size();
     const int newleaf = tree->get_num_leaves();
@@ -716,55 +1025,94 @@ void calc_emissions(const States &states, const LocalTree *tree,
     find_variant_sites(seqs, nseqs, seqlen, variant, base_probs);
     find_masked_sites(seqs, nseqs, seqlen, masked, variant);
 
+    // find sites that are heterozygous for the phased pair
+    bool *het = NULL;
+    const bool use_phase = (model->unphased && phase_pr != NULL &&
+        phase_pr->treemap1 >= 0 && phase_pr->treemap1 < nseqs &&
+        phase_pr->treemap2 >= 0 && phase_pr->treemap2 < nseqs);
+    if (use_phase) {
+	het = new bool[seqlen];
+	for (int i=0; i < seqlen; i++) {
+	    het[i] = (seqs[phase_pr->treemap1][i] != seqs[phase_pr->treemap2][i]);
+            if (base_probs.size() > 0 && !het[i])
+                het[i] = ! (base_probs[phase_pr->treemap1][i].is_equal(
+                            base_probs[phase_pr->treemap2][i]));
+        }
+    }
+
+    // variant sites with the same column share their emissions.  Phase
+    // probabilities are recorded per site, so het sites are kept apart.
+    int *pattern = new int [seqlen];
+    bool *compute = new bool [seqlen];
+    unordered_map<string, int> patterns;
+    int npatterns = find_site_patterns(seqs, nseqs, seqlen, variant,
+                                       base_probs, het, pattern, patterns);
+    int nvariant = 0;
+    for (int i=0; i<seqlen; i++) {
+        compute[i] = variant[i] && pattern[i] == i;
+        if (variant[i])
+            nvariant++;
+    }
+    g_pattern_sites += nvariant;
+    g_pattern_hits += nvariant - npatterns;
+
+
+    // order the sites whose tables are computed, placing patterns with
+    // tables in the cache last
+    vector<int> sites;
+    vector<int> cache_index;
+    int *column = new int [seqlen];
+    fill(column, column + seqlen, -1);
+    if (lk_cache && lk_cache->nnodes == tree->nnodes) {
+        for (unordered_map<string, int>::const_iterator it = patterns.begin();
+             it != patterns.end(); ++it) {
+            unordered_map<string, int>::const_iterator it2 =
+                lk_cache->patterns.find(it->first);
+            if (it2 != lk_cache->patterns.end())
+                column[it->second] = it2->second;
+        }
+    }
+    for (int i=0; i<seqlen; i++)
+        if (compute[i] && column[i] == -1)
+            sites.push_back(i);
+    const int nfull = sites.size();
+    for (int i=0; i<seqlen; i++) {
+        if (compute[i] && column[i] != -1) {
+            sites.push_back(i);
+            cache_index.push_back(column[i]);
+        }
+    }
+    cache_index.insert(cache_index.begin(), nfull, -1);
+    const int ncols = sites.size();
+    for (int c=0; c<ncols; c++)
+        column[sites[c]] = c;
 
     // compute inner and outer likelihood tables
-    LikelihoodTable inner(seqlen, tree->nnodes);
-    LikelihoodTable inner_subtree(seqlen, 1);
-    LikelihoodTable outer(seqlen, tree->nnodes);
-    calc_inner_outer(tree, model, seqs, base_probs, seqlen, variant, internal,
-                     inner.data, outer.data);
+    LikelihoodTableSoA inner(tree->nnodes, ncols);
+    LikelihoodTableSoA inner_subtree(1, ncols);
+    LikelihoodTableSoA outer(tree->nnodes, ncols);
+    calc_inner_outer_soa(tree, model, seqs, base_probs, sites, nfull,
+                         cache_index, patterns, column, internal,
+                         inner, outer, lk_cache);
 
     if (!internal) {
         // compute inner table for new leaf
-        for (int i=0; i<seqlen; i++) {
-            const char c = seqs[newleaf][i];
-            if (c == 'N') {
-                inner_subtree.data[i][0][0] = 1.0;
-                inner_subtree.data[i][0][1] = 1.0;
-                inner_subtree.data[i][0][2] = 1.0;
-                inner_subtree.data[i][0][3] = 1.0;
-            } else if (base_probs.size() > 0) {
-                for (int j=0; j < 4; j++)
-                    inner_subtree.data[i][0][j] = base_probs[newleaf][i].prob[j];
-            } else {
-                inner_subtree.data[i][0][0] = 0.0;
-                inner_subtree.data[i][0][1] = 0.0;
-                inner_subtree.data[i][0][2] = 0.0;
-                inner_subtree.data[i][0][3] = 0.0;
-                inner_subtree.data[i][0][dna2int[(int) c]] = 1.0;
-            }
-        }
+        for (int c=0; c<ncols; c++)
+            leaf_site_lk(inner_subtree.node(0) + c, inner_subtree.stride,
+                         seqs[newleaf][sites[c]],
+                         base_probs.size() > 0 ?
+                         &base_probs[newleaf][sites[c]] : NULL);
     }
 
     LikelihoodTable inner2(seqlen, tree->nnodes);
     LikelihoodTable inner_subtree2(seqlen, 1);
     LikelihoodTable outer2(seqlen, tree->nnodes);
-    bool *het = NULL;
-    if (model->unphased && phase_pr != NULL &&
-	phase_pr->treemap1 >= 0 && phase_pr->treemap1 < nseqs &&
-	phase_pr->treemap2 >= 0 && phase_pr->treemap2 < nseqs) {
+    if (use_phase) {
 	const char *subseqs[nseqs];
 	for (int i=0; i < nseqs; i++)
 	    subseqs[i] = seqs[i];
 	subseqs[phase_pr->treemap1] = seqs[phase_pr->treemap2];
 	subseqs[phase_pr->treemap2] = seqs[phase_pr->treemap1];
-	het = new bool[seqlen];
-	for (int i=0; i < seqlen; i++) {
-	    het[i] = (seqs[phase_pr->treemap1][i] != seqs[phase_pr->treemap2][i]);
-            if (base_probs.size() > 0 && !het[i])
-                het[i] = ! (base_probs[phase_pr->treemap1][i].is_equal(
-                            base_probs[phase_pr->treemap2][i]));
-        }
         vector<vector<BaseProbs> > base_probs2;
         if (base_probs.size() > 0) {
             for (int i=0; i < nseqs; i++) {
@@ -838,6 +1186,9 @@ void calc_emissions(const States &states, const LocalTree *tree,
 
 
     // populate emission table
+    const EmitKernel *kernel = get_emit_kernel();
+    LikelihoodTableSoA emit_table(1, ncols);
+    double *emit_cols = emit_table.node(0);
     for (int j=0; j<nstates; j++) {
         State state = states[j];
 
@@ -882,6 +1233,12 @@ void calc_emissions(const States &states, const LocalTree *tree,
         // calculate invariant_lk
         double invariant_lk = .25 * exp(- model->mu * treelen);
 
+        // emissions of all computed sites
+        kernel->emit(internal ? inner.node(node1) : inner_subtree.node(0),
+                     inner.node(node2),
+                     node2 != maintree_root ? outer.node(node2) : NULL,
+                     mut, nomut, ncols, inner.stride, emit_cols);
+
         // fill in row of emission table
         for (int i=0; i<seqlen; i++) {
             if (masked[i]) {
@@ -890,11 +1247,11 @@ void calc_emissions(const States &states, const LocalTree *tree,
             } else if (!variant[i]) {
                 // invariant site
                 emit[i][j] = invariant_lk;
+            } else if (!compute[i]) {
+                // same pattern as an earlier site
+                emit[i][j] = emit[pattern[i]][j];
             } else {
-		emit[i][j] = calc_emit(inner.data[i], outer.data[i],
-				       internal ? inner.data[i] : inner_subtree.data[i],
-				       i, node1, node2, maintree_root,
-				       nomut, mut);
+		emit[i][j] = emit_cols[column[i]];
                 assert(!isnan(emit[i][j]));
 		if (het != NULL && het[i]) {
 		    double emit2 = calc_emit(inner2.data[i], outer2.data[i],
@@ -931,6 +1288,9 @@ void calc_emissions(const States &states, const LocalTree *tree,
     // clean up
     delete [] variant;
     delete [] masked;
+    delete [] pattern;
+    delete [] compute;
+    delete [] column;
     if (het != NULL) delete [] het;
 }
 
@@ -940,10 +1300,10 @@ void calc_emissions_external(const States &states, const LocalTree *tree,
                              const vector<vector<BaseProbs> > &base_probs,
                              int nseqs, int seqlen,
                              const ArgModel *model, double **emit,
-			     PhaseProbs *phase_pr)
+			     PhaseProbs *phase_pr, LikelihoodCache *lk_cache)
 {
     calc_emissions(states, tree, seqs, base_probs, nseqs, seqlen, model, false,
-                   emit, phase_pr);
+                   emit, phase_pr, lk_cache);
 }
 
 // calculate emissions for internal branch resampling
@@ -952,10 +1312,10 @@ void calc_emissions_internal(const States &states, const LocalTree *tree,
                              const vector<vector<BaseProbs> > &base_probs,
                              int nseqs, int seqlen,
                              const ArgModel *model, double **emit,
-                             PhaseProbs *phase_pr)
+                             PhaseProbs *phase_pr, LikelihoodCache *lk_cache)
 {
     calc_emissions(states, tree, seqs, base_probs, nseqs, seqlen, model, true,
-		   emit, phase_pr);
+		   emit, phase_pr, lk_cache);
 }
 
 
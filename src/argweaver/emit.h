@@ -1,6 +1,9 @@
 #ifndef ARGWEAVER_EMIT_H
 #define ARGWEAVER_EMIT_H
 
+#include <string>
+#include <unordered_map>
+
 #include "local_tree.h"
 #include "model.h"
 #include "states.h"
@@ -19,18 +22,55 @@ void parsimony_ancestral_set(const LocalTree *tree, const char * const *seqs,
                              char *ancestral);
 int parsimony_cost_seq(const LocalTree *tree, const char * const *seqs,
                        int nseqs, int pos, int *postorder);
+
+// Inner/outer likelihood tables of the site patterns of the last block
+// whose emissions were calculated.  Consecutive local trees differ by one
+// SPR, so when the same pattern occurs in the next block only the nodes
+// whose subtree (inner) or complement (outer) changed are recomputed.
+class LikelihoodCache
+{
+public:
+    LikelihoodCache() :
+        nnodes(0),
+        maintree_root(-1)
+    {}
+
+    void clear()
+    {
+        nnodes = 0;
+        maintree_root = -1;
+        patterns.clear();
+        tables.clear();
+    }
+
+    int nnodes;
+    int maintree_root;
+    vector<int> parents;
+    vector<int> children;
+    vector<double> muts;
+    unordered_map<string, int> patterns; // pattern -> index into tables
+    vector<double> tables;  // inner and outer table of each pattern
+};
+
+
 void calc_emissions_external(const States &states, const LocalTree *tree,
                              const char * const *seqs,
                              const vector<vector<BaseProbs> > &base_probs,
                              int nseqs, int seqlen,
                              const ArgModel *model, double **emit,
-                             PhaseProbs *phase_pr);
+                             PhaseProbs *phase_pr,
+                             LikelihoodCache *lk_cache=NULL);
 void calc_emissions_internal(const States &states, const LocalTree *tree,
                              const char *const *seqs,
                              const vector<vector<BaseProbs> > &base_probs,
                              int nseqs, int seqlen,
                              const ArgModel *model, double **emit,
-                             PhaseProbs *phase_pr=NULL);
+                             PhaseProbs *phase_pr=NULL,
+                             LikelihoodCache *lk_cache=NULL);
+
+// returns the number of variant sites seen by the emission calculations
+// and how many of them reused the emissions of an identical site
+void get_site_pattern_counts(long *nsites, long *nhits);
 
 double likelihood_tree(const LocalTree *tree, const ArgModel *model,
                        const char *const *seqs,
@@ -38,6 +78,9 @@ double likelihood_tree(const LocalTree *tree, const ArgModel *model,
                        const int nseqs,
                        const int start, const int end);
 
+int count_noncompat(const LocalTree *tree, const char * const *seqs,
+                    int nseqs, int block_start, int block_len, int *postorder);
+
 int count_noncompat(const LocalTrees *trees, const char * const *seqs,
                     int nseqs, int seqlen, int start_coord=-1, int end_coord=-1);
 
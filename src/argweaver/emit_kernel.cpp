@@ -0,0 +1,198 @@
+
+#include "common.h"
+#include "emit_kernel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define ARGWEAVER_X86_KERNELS
+#endif
+
+
+namespace argweaver {
+
+
+//=============================================================================
+// generic kernels
+//
+// V is either double or a GCC vector of doubles.  Tables are 64-byte
+// aligned and strides are multiples of 8 sites, so every row offset is
+// aligned for all vector widths.
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+template <class V>
+static ALWAYS_INLINE void inner_generic(
+    double *node, const double *child1, const double *child2,
+    double mut1, double nomut1, double mut2, double nomut2,
+    int n, int stride)
+{
+    const int w = sizeof(V) / sizeof(double);
+    for (int s=0; s<n; s+=w) {
+        V x1[4], x2[4];
+        for (int b=0; b<4; b++) {
+            x1[b] = *(const V*) (child1 + b*stride + s);
+            x2[b] = *(const V*) (child2 + b*stride + s);
+        }
+        for (int a=0; a<4; a++) {
+            V p1 = V() + 0.0;
+            V p2 = V() + 0.0;
+            for (int b=0; b<4; b++) {
+                if (a == b) {
+                    p1 += x1[b] * nomut1;
+                    p2 += x2[b] * nomut2;
+                } else {
+                    p1 += x1[b] * mut1;
+                    p2 += x2[b] * mut2;
+                }
+            }
+            *(V*) (node + a*stride + s) = p1 * p2;
+        }
+    }
+}
+
+
+template <class V>
+static ALWAYS_INLINE void outer_generic(
+    double *node, const double *sib, const double *parent,
+    double mut_sib, double nomut_sib, double mut_parent, double nomut_parent,
+    int n, int stride)
+{
+    const int w = sizeof(V) / sizeof(double);
+    for (int s=0; s<n; s+=w) {
+        V x1[4], x2[4];
+        for (int b=0; b<4; b++) {
+            x1[b] = *(const V*) (sib + b*stride + s);
+            if (parent)
+                x2[b] = *(const V*) (parent + b*stride + s);
+        }
+        for (int a=0; a<4; a++) {
+            V p1 = V() + 0.0;
+            V p2 = V() + 0.0;
+            for (int b=0; b<4; b++) {
+                if (a == b) {
+                    p1 += x1[b] * nomut_sib;
+                    if (parent)
+                        p2 += x2[b] * nomut_parent;
+                } else {
+                    p1 += x1[b] * mut_sib;
+                    if (parent)
+                        p2 += x2[b] * mut_parent;
+                }
+            }
+            *(V*) (node + a*stride + s) = parent ? p1 * p2 : p1;
+        }
+    }
+}
+
+
+template <class V>
+static ALWAYS_INLINE void emit_generic(
+    const double *inner1, const double *inner2, const double *outer2,
+    const double *mut, const double *nomut, int n, int stride,
+    double *result)
+{
+    const int w = sizeof(V) / sizeof(double);
+    for (int s=0; s<n; s+=w) {
+        V x1[4], x2[4], x3[4];
+        for (int b=0; b<4; b++) {
+            x1[b] = *(const V*) (inner1 + b*stride + s);
+            x2[b] = *(const V*) (inner2 + b*stride + s);
+            if (outer2)
+                x3[b] = *(const V*) (outer2 + b*stride + s);
+        }
+        V emit = V() + 0.0;
+        for (int a=0; a<4; a++) {
+            V p1 = V() + 0.0;
+            V p2 = V() + 0.0;
+            V p3 = V() + 0.0;
+            for (int b=0; b<4; b++) {
+                if (a == b) {
+                    p1 += x1[b] * nomut[0];
+                    p2 += x2[b] * nomut[1];
+                    if (outer2)
+                        p3 += x3[b] * nomut[2];
+                } else {
+                    p1 += x1[b] * mut[0];
+                    p2 += x2[b] * mut[1];
+                    if (outer2)
+                        p3 += x3[b] * mut[2];
+                }
+            }
+            if (outer2)
+                emit += p1 * p2 * p3 * .25;
+            else
+                emit += p1 * p2 * .25;
+        }
+        *(V*) (result + s) = emit;
+    }
+}
+
+
+// instantiate the three kernels of one implementation
+#define EMIT_KERNELS(SUFFIX, TARGET, V)                                 \
+    TARGET static void inner_##SUFFIX(                                  \
+        double *node, const double *child1, const double *child2,       \
+        double mut1, double nomut1, double mut2, double nomut2,         \
+        int n, int stride)                                              \
+    {                                                                   \
+        inner_generic<V>(node, child1, child2, mut1, nomut1,            \
+                         mut2, nomut2, n, stride);                      \
+    }                                                                   \
+    TARGET static void outer_##SUFFIX(                                  \
+        double *node, const double *sib, const double *parent,          \
+        double mut_sib, double nomut_sib,                               \
+        double mut_parent, double nomut_parent, int n, int stride)      \
+    {                                                                   \
+        outer_generic<V>(node, sib, parent, mut_sib, nomut_sib,         \
+                         mut_parent, nomut_parent, n, stride);          \
+    }                                                                   \
+    TARGET static void emit_##SUFFIX(                                   \
+        const double *inner1, const double *inner2,                     \
+        const double *outer2, const double *mut, const double *nomut,   \
+        int n, int stride, double *result)                              \
+    {                                                                   \
+        emit_generic<V>(inner1, inner2, outer2, mut, nomut,             \
+                        n, stride, result);                             \
+    }
+
+
+EMIT_KERNELS(scalar, , double)
+
+#ifdef ARGWEAVER_X86_KERNELS
+typedef double v2d __attribute__((vector_size(16)));
+typedef double v4d __attribute__((vector_size(32)));
+typedef double v8d __attribute__((vector_size(64)));
+
+EMIT_KERNELS(sse2, __attribute__((target("sse2"))), v2d)
+EMIT_KERNELS(avx2, __attribute__((target("avx2"))), v4d)
+EMIT_KERNELS(avx512, __attribute__((target("avx512f"))), v8d)
+#endif
+
+
+//=============================================================================
+// kernel selection
+
+static const EmitKernel g_emit_kernels[] = {
+    {FORWARD_KERNEL_SCALAR, "scalar",
+     inner_scalar, outer_scalar, emit_scalar},
+#ifdef ARGWEAVER_X86_KERNELS
+    {FORWARD_KERNEL_SSE2, "sse2", inner_sse2, outer_sse2, emit_sse2},
+    {FORWARD_KERNEL_AVX2, "avx2", inner_avx2, outer_avx2, emit_avx2},
+    {FORWARD_KERNEL_AVX512, "avx512",
+     inner_avx512, outer_avx512, emit_avx512},
+#endif
+};
+static const int g_nemit_kernels =
+    sizeof(g_emit_kernels) / sizeof(g_emit_kernels[0]);
+
+
+const EmitKernel *get_emit_kernel()
+{
+    const ForwardKernelType type = get_forward_kernel()->type;
+    for (int i=0; i<g_nemit_kernels; i++)
+        if (g_emit_kernels[i].type == type)
+            return &g_emit_kernels[i];
+    return &g_emit_kernels[0];
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,117 @@
+//=============================================================================
+// Vectorized emission calculations
+//
+// calc_emissions() evaluates the same Felsenstein recursion at every variant
+// site of a block.  LikelihoodTableSoA stores the partial likelihoods as
+// [node][base][site] so that the recursion and the per-state emission can
+// be computed for 2, 4 or 8 sites per instruction.  The kernels follow the
+// ISA chosen for the forward algorithm (see forward_kernel.h), so
+// --forward-kernel scalar also gives scalar emissions.
+//
+// The kernels perform the same operations in the same order as the per-site
+// code in emit.cpp.  Only the AVX-512 build may contract multiply-adds,
+// which changes emissions by at most a few ulps.
+
+#ifndef ARGWEAVER_EMIT_KERNEL_H
+#define ARGWEAVER_EMIT_KERNEL_H
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+#include "forward_kernel.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+// partial likelihood table laid out as [node][base][site]
+class LikelihoodTableSoA
+{
+public:
+    // number of sites per row is padded to a multiple of this
+    static const int SITE_ALIGN = 8;
+
+    LikelihoodTableSoA(int nnodes, int nsites) :
+        nnodes(nnodes),
+        nsites(nsites),
+        stride((nsites + SITE_ALIGN - 1) / SITE_ALIGN * SITE_ALIGN),
+        data(NULL)
+    {
+        size_t size = sizeof(double) * 4 * max(nnodes, 1) *
+            (stride > 0 ? stride : SITE_ALIGN);
+        if (posix_memalign((void**) &data, 64, size) != 0)
+            abort();
+        memset(data, 0, size);
+    }
+
+    ~LikelihoodTableSoA()
+    {
+        free(data);
+    }
+
+    // returns the rows of one node (4 rows of 'stride' sites)
+    inline double *node(int j)
+    {
+        return &data[4 * j * stride];
+    }
+
+    inline const double *node(int j) const
+    {
+        return &data[4 * j * stride];
+    }
+
+    inline double &get(int j, int base, int site)
+    {
+        return data[(4 * j + base) * stride + site];
+    }
+
+    int nnodes;
+    int nsites;
+    int stride;
+    double *data;
+
+private:
+    LikelihoodTableSoA(const LikelihoodTableSoA &other);
+    LikelihoodTableSoA &operator=(const LikelihoodTableSoA &other);
+};
+
+
+// a set of implementations of the emission calculations over sites.
+// Node arguments point to the 4 rows of a node in a LikelihoodTableSoA with
+// the given stride.  All kernels process sites [0, n) rounded up to
+// LikelihoodTableSoA::SITE_ALIGN.
+struct EmitKernel
+{
+    ForwardKernelType type;
+    const char *name;
+
+    // inner table of a node from the inner tables of its children
+    void (*inner)(double *node, const double *child1, const double *child2,
+                  double mut1, double nomut1, double mut2, double nomut2,
+                  int n, int stride);
+
+    // outer table of a node from the inner table of its sibling and the
+    // outer table of its parent ('parent' is NULL if the parent is the root)
+    void (*outer)(double *node, const double *sib, const double *parent,
+                  double mut_sib, double nomut_sib,
+                  double mut_parent, double nomut_parent,
+                  int n, int stride);
+
+    // emission of a state that coalesces node1 onto the branch above node2
+    // ('outer2' is NULL if node2 is the root of the main tree)
+    void (*emit)(const double *inner1, const double *inner2,
+                 const double *outer2, const double *mut,
+                 const double *nomut, int n, int stride, double *result);
+};
+
+
+// returns the emission kernel matching the current forward kernel
+const EmitKernel *get_emit_kernel();
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_EMIT_KERNEL_H
@@ -0,0 +1,356 @@
+
+#include <string.h>
+#include <atomic>
+
+#include "forward_kernel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define ARGWEAVER_X86_KERNELS
+#   include <immintrin.h>
+#endif
+
+
+namespace argweaver {
+
+
+//=============================================================================
+// scalar kernels
+
+static double dot_scalar(const double *x, const double *y, int n)
+{
+    double sum = 0.0;
+    for (int i=0; i<n; i++)
+        sum += x[i] * y[i];
+    return sum;
+}
+
+
+static double emit_norm_scalar(double *col, const double *emit, int n)
+{
+    double norm = 0.0;
+    for (int k=0; k<n; k++) {
+        col[k] *= emit[k];
+        norm += col[k];
+    }
+    return norm;
+}
+
+
+static void normalize_scalar(double *col, double norm, int n)
+{
+    for (int k=0; k<n; k++)
+        col[k] /= norm;
+}
+
+
+#ifdef ARGWEAVER_X86_KERNELS
+
+//=============================================================================
+// SSE2 kernels
+
+__attribute__((target("sse2")))
+static double dot_sse2(const double *x, const double *y, int n)
+{
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i+4<=n; i+=4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(x+i),
+                                           _mm_loadu_pd(y+i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(x+i+2),
+                                           _mm_loadu_pd(y+i+2)));
+    }
+    double tmp[2];
+    _mm_storeu_pd(tmp, _mm_add_pd(acc0, acc1));
+    double sum = tmp[0] + tmp[1];
+    for (; i<n; i++)
+        sum += x[i] * y[i];
+    return sum;
+}
+
+
+__attribute__((target("sse2")))
+static double emit_norm_sse2(double *col, const double *emit, int n)
+{
+    __m128d acc = _mm_setzero_pd();
+    int k = 0;
+    for (; k+2<=n; k+=2) {
+        __m128d v = _mm_mul_pd(_mm_loadu_pd(col+k), _mm_loadu_pd(emit+k));
+        _mm_storeu_pd(col+k, v);
+        acc = _mm_add_pd(acc, v);
+    }
+    double tmp[2];
+    _mm_storeu_pd(tmp, acc);
+    double norm = tmp[0] + tmp[1];
+    for (; k<n; k++) {
+        col[k] *= emit[k];
+        norm += col[k];
+    }
+    return norm;
+}
+
+
+__attribute__((target("sse2")))
+static void normalize_sse2(double *col, double norm, int n)
+{
+    const __m128d d = _mm_set1_pd(norm);
+    int k = 0;
+    for (; k+2<=n; k+=2)
+        _mm_storeu_pd(col+k, _mm_div_pd(_mm_loadu_pd(col+k), d));
+    for (; k<n; k++)
+        col[k] /= norm;
+}
+
+
+//=============================================================================
+// AVX2 kernels
+
+__attribute__((target("avx2,fma")))
+static double hsum_avx2(__m256d v)
+{
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+
+__attribute__((target("avx2,fma")))
+static double dot_avx2(const double *x, const double *y, int n)
+{
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i+8<=n; i+=8) {
+        acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i),
+                               _mm256_loadu_pd(y+i), acc0);
+        acc1 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i+4),
+                               _mm256_loadu_pd(y+i+4), acc1);
+    }
+    for (; i+4<=n; i+=4)
+        acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i),
+                               _mm256_loadu_pd(y+i), acc0);
+    double sum = hsum_avx2(_mm256_add_pd(acc0, acc1));
+    for (; i<n; i++)
+        sum += x[i] * y[i];
+    return sum;
+}
+
+
+__attribute__((target("avx2,fma")))
+static double emit_norm_avx2(double *col, const double *emit, int n)
+{
+    __m256d acc = _mm256_setzero_pd();
+    int k = 0;
+    for (; k+4<=n; k+=4) {
+        __m256d v = _mm256_mul_pd(_mm256_loadu_pd(col+k),
+                                  _mm256_loadu_pd(emit+k));
+        _mm256_storeu_pd(col+k, v);
+        acc = _mm256_add_pd(acc, v);
+    }
+    double norm = hsum_avx2(acc);
+    for (; k<n; k++) {
+        col[k] *= emit[k];
+        norm += col[k];
+    }
+    return norm;
+}
+
+
+__attribute__((target("avx2,fma")))
+static void normalize_avx2(double *col, double norm, int n)
+{
+    const __m256d d = _mm256_set1_pd(norm);
+    int k = 0;
+    for (; k+4<=n; k+=4)
+        _mm256_storeu_pd(col+k, _mm256_div_pd(_mm256_loadu_pd(col+k), d));
+    for (; k<n; k++)
+        col[k] /= norm;
+}
+
+
+//=============================================================================
+// AVX-512 kernels
+
+// sum of the elements of v in the order of _mm512_reduce_add_pd(), whose
+// extraction of the upper half reads an undefined vector and trips
+// -Wuninitialized
+__attribute__((target("avx512f")))
+static double hsum_avx512(__m512d v)
+{
+    const __m256d lo = _mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), 0xf,
+                                                   v, 0);
+    const __m256d hi = _mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), 0xf,
+                                                   v, 1);
+    return hsum_avx2(_mm256_add_pd(lo, hi));
+}
+
+
+__attribute__((target("avx512f")))
+static double dot_avx512(const double *x, const double *y, int n)
+{
+    __m512d acc = _mm512_setzero_pd();
+    int i = 0;
+    for (; i+8<=n; i+=8)
+        acc = _mm512_fmadd_pd(_mm512_loadu_pd(x+i), _mm512_loadu_pd(y+i),
+                              acc);
+    if (i < n) {
+        const __mmask8 mask = (__mmask8) ((1u << (n - i)) - 1);
+        acc = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, x+i),
+                              _mm512_maskz_loadu_pd(mask, y+i), acc);
+    }
+    return hsum_avx512(acc);
+}
+
+
+__attribute__((target("avx512f")))
+static double emit_norm_avx512(double *col, const double *emit, int n)
+{
+    __m512d acc = _mm512_setzero_pd();
+    int k = 0;
+    for (; k+8<=n; k+=8) {
+        __m512d v = _mm512_mul_pd(_mm512_loadu_pd(col+k),
+                                  _mm512_loadu_pd(emit+k));
+        _mm512_storeu_pd(col+k, v);
+        acc = _mm512_add_pd(acc, v);
+    }
+    if (k < n) {
+        const __mmask8 mask = (__mmask8) ((1u << (n - k)) - 1);
+        __m512d v = _mm512_mul_pd(_mm512_maskz_loadu_pd(mask, col+k),
+                                  _mm512_maskz_loadu_pd(mask, emit+k));
+        _mm512_mask_storeu_pd(col+k, mask, v);
+        acc = _mm512_add_pd(acc, v);
+    }
+    return hsum_avx512(acc);
+}
+
+
+__attribute__((target("avx512f")))
+static void normalize_avx512(double *col, double norm, int n)
+{
+    const __m512d d = _mm512_set1_pd(norm);
+    int k = 0;
+    for (; k+8<=n; k+=8)
+        _mm512_storeu_pd(col+k, _mm512_div_pd(_mm512_loadu_pd(col+k), d));
+    if (k < n) {
+        const __mmask8 mask = (__mmask8) ((1u << (n - k)) - 1);
+        _mm512_mask_storeu_pd(
+            col+k, mask, _mm512_div_pd(_mm512_maskz_loadu_pd(mask, col+k), d));
+    }
+}
+
+#endif // ARGWEAVER_X86_KERNELS
+
+
+//=============================================================================
+// kernel selection
+
+static const ForwardKernel g_kernels[] = {
+    {FORWARD_KERNEL_SCALAR, "scalar",
+     dot_scalar, emit_norm_scalar, normalize_scalar},
+#ifdef ARGWEAVER_X86_KERNELS
+    {FORWARD_KERNEL_SSE2, "sse2",
+     dot_sse2, emit_norm_sse2, normalize_sse2},
+    {FORWARD_KERNEL_AVX2, "avx2",
+     dot_avx2, emit_norm_avx2, normalize_avx2},
+    {FORWARD_KERNEL_AVX512, "avx512",
+     dot_avx512, emit_norm_avx512, normalize_avx512},
+#endif
+};
+static const int g_nkernels = sizeof(g_kernels) / sizeof(g_kernels[0]);
+
+// kernel chosen by set_forward_kernel(), or NULL for the automatic one;
+// the forward algorithm reads it from many threads
+static std::atomic<const ForwardKernel*> g_forward_kernel(NULL);
+
+
+static const ForwardKernel *find_kernel(ForwardKernelType type)
+{
+    for (int i=0; i<g_nkernels; i++)
+        if (g_kernels[i].type == type)
+            return &g_kernels[i];
+    return NULL;
+}
+
+
+bool forward_kernel_supported(ForwardKernelType type)
+{
+    if (type == FORWARD_KERNEL_AUTO || type == FORWARD_KERNEL_SCALAR)
+        return true;
+    if (!find_kernel(type))
+        return false;
+
+#ifdef ARGWEAVER_X86_KERNELS
+    __builtin_cpu_init();
+    switch (type) {
+    case FORWARD_KERNEL_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case FORWARD_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case FORWARD_KERNEL_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    default:
+        return false;
+    }
+#else
+    return false;
+#endif
+}
+
+
+// choose the fastest kernel supported by the CPU
+static const ForwardKernel *auto_kernel()
+{
+    const ForwardKernelType order[] = {
+        FORWARD_KERNEL_AVX512, FORWARD_KERNEL_AVX2, FORWARD_KERNEL_SSE2};
+    for (int i=0; i<3; i++)
+        if (forward_kernel_supported(order[i]))
+            return find_kernel(order[i]);
+    return find_kernel(FORWARD_KERNEL_SCALAR);
+}
+
+
+const ForwardKernel *get_forward_kernel()
+{
+    const ForwardKernel *kernel = g_forward_kernel.load();
+    if (kernel)
+        return kernel;
+
+    // probed once, even when the first calls race
+    static const ForwardKernel *const default_kernel = auto_kernel();
+    return default_kernel;
+}
+
+
+bool set_forward_kernel(ForwardKernelType type)
+{
+    if (type == FORWARD_KERNEL_AUTO) {
+        g_forward_kernel = NULL;
+        return true;
+    }
+    if (!forward_kernel_supported(type))
+        return false;
+    g_forward_kernel = find_kernel(type);
+    return true;
+}
+
+
+bool parse_forward_kernel(const char *name, ForwardKernelType *type)
+{
+    if (strcmp(name, "auto") == 0)
+        *type = FORWARD_KERNEL_AUTO;
+    else if (strcmp(name, "scalar") == 0)
+        *type = FORWARD_KERNEL_SCALAR;
+    else if (strcmp(name, "sse2") == 0)
+        *type = FORWARD_KERNEL_SSE2;
+    else if (strcmp(name, "avx2") == 0)
+        *type = FORWARD_KERNEL_AVX2;
+    else if (strcmp(name, "avx512") == 0)
+        *type = FORWARD_KERNEL_AVX512;
+    else
+        return false;
+    return true;
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,68 @@
+//=============================================================================
+// Vectorized inner loops of the forward algorithm
+//
+// arghmm_forward_block() spends most of its time in a few dense loops over
+// the states of a column.  These are factored out here into a small table
+// of kernels so that SSE2, AVX2 and AVX-512 versions can be selected at
+// runtime from the capabilities of the CPU.
+//
+// The scalar kernel reproduces the original loops exactly.  The vector
+// kernels reorder the floating point additions of the dot products and of
+// the column norm, so a normalized forward column agrees with the scalar
+// one to a relative error of about nstates * 2^-52 (< 1e-12 for all
+// practical state spaces).  A sampled thread path can only differ from the
+// scalar one when a uniform draw in sample() falls within that distance of
+// a cumulative probability boundary.
+
+#ifndef ARGWEAVER_FORWARD_KERNEL_H
+#define ARGWEAVER_FORWARD_KERNEL_H
+
+
+namespace argweaver {
+
+
+enum ForwardKernelType {
+    FORWARD_KERNEL_AUTO=0,
+    FORWARD_KERNEL_SCALAR,
+    FORWARD_KERNEL_SSE2,
+    FORWARD_KERNEL_AVX2,
+    FORWARD_KERNEL_AVX512
+};
+
+
+// a set of implementations for the forward algorithm inner loops
+struct ForwardKernel
+{
+    ForwardKernelType type;
+    const char *name;
+
+    // returns sum_i x[i] * y[i]
+    double (*dot)(const double *x, const double *y, int n);
+
+    // sets col[k] *= emit[k] and returns the sum of the new col
+    double (*emit_norm)(double *col, const double *emit, int n);
+
+    // sets col[k] /= norm
+    void (*normalize)(double *col, double norm, int n);
+};
+
+
+// returns the kernel currently used by the forward algorithm.  On first use
+// the fastest kernel supported by the CPU is chosen.
+const ForwardKernel *get_forward_kernel();
+
+// forces a specific kernel (FORWARD_KERNEL_AUTO restores the default).
+// Returns false if the kernel is not supported by this CPU or build.
+bool set_forward_kernel(ForwardKernelType type);
+
+// returns true if the kernel can be used on this CPU
+bool forward_kernel_supported(ForwardKernelType type);
+
+// parses a kernel name ("auto", "scalar", "sse2", "avx2", "avx512").
+// Returns false if the name is unknown.
+bool parse_forward_kernel(const char *name, ForwardKernelType *type);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_FORWARD_KERNEL_H
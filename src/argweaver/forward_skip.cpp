@@ -0,0 +1,203 @@
+
+#include <string.h>
+
+#include "common.h"
+#include "forward_kernel.h"
+#include "forward_skip.h"
+#include "sample_thread.h"
+
+
+namespace argweaver {
+
+
+// maximum number of distinct emission vectors with skipped runs per block
+static const int MAX_RUN_OPERATORS = 8;
+
+
+ForwardRunSkip::ForwardRunSkip(const LocalTree *tree, const States &states,
+                               const TransMatrix *matrix, int ntimes) :
+    tree(tree),
+    states(states),
+    matrix(matrix),
+    ntimes(ntimes),
+    nstates(states.size()),
+    tmp(2 * states.size()),
+    nskipped(0)
+{}
+
+
+ForwardRunSkip::~ForwardRunSkip()
+{
+    clear();
+}
+
+
+void ForwardRunSkip::clear()
+{
+    for (unsigned int i=0; i<ops.size(); i++)
+        for (unsigned int b=0; b<ops[i].powers.size(); b++)
+            delete [] ops[i].powers[b];
+    ops.clear();
+}
+
+
+// compute powers M^(2^b) for b < nlevels
+void ForwardRunSkip::build_operator(RunOperator &op, int nlevels)
+{
+    const int n = nstates;
+
+    // M[k][j] = emit[k] * T[j][k]
+    double *mat = new double [n * n];
+    for (int k=0; k<n; k++)
+        for (int j=0; j<n; j++)
+            mat[k*n + j] = op.emit[k] * matrix->get(tree, states, j, k);
+    op.powers.push_back(mat);
+
+    // repeated squaring, rescaled to avoid underflow
+    for (int b=1; b<nlevels; b++) {
+        const double *a = op.powers[b-1];
+        double *c = new double [n * n];
+        fill(c, c + n * n, 0.0);
+        for (int i=0; i<n; i++) {
+            for (int k=0; k<n; k++) {
+                const double aik = a[i*n + k];
+                if (aik == 0.0)
+                    continue;
+                for (int j=0; j<n; j++)
+                    c[i*n + j] += aik * a[k*n + j];
+            }
+        }
+        double top = max_array(c, n * n);
+        assert(top > 0.0);
+        for (int i=0; i<n*n; i++)
+            c[i] /= top;
+        op.powers.push_back(c);
+    }
+}
+
+
+void ForwardRunSkip::plan(const double *const *emit, int ncols,
+                          const ArgHmmForwardTable *forward, int start)
+{
+    struct Run {
+        int first;
+        int last;
+        int op;
+    };
+
+    const int n = nstates;
+    const size_t rowsize = n * sizeof(double);
+    clear();
+    jumps.assign(max(ncols, 1), 0);
+    jump_ops.assign(max(ncols, 1), -1);
+    nskipped = 0;
+
+    // find runs of identical emissions that do not cross a stored column
+    vector<Run> runs;
+    vector<const double*> emits;
+    for (int i=1; i<ncols; ) {
+        int j = i;
+        while (j + 1 < ncols && memcmp(emit[j+1], emit[i], rowsize) == 0)
+            j++;
+
+        int first = i;
+        while (first <= j) {
+            int last = first;
+            while (last < j && !forward->is_stored(start + last))
+                last++;
+            if (last > first) {
+                Run run = {first, last, -1};
+                for (unsigned int k=0; k<emits.size(); k++)
+                    if (memcmp(emits[k], emit[first], rowsize) == 0)
+                        run.op = k;
+                if (run.op == -1 && emits.size() < MAX_RUN_OPERATORS) {
+                    run.op = emits.size();
+                    emits.push_back(emit[first]);
+                }
+                if (run.op != -1)
+                    runs.push_back(run);
+            }
+            first = last + 1;
+        }
+        i = j + 1;
+    }
+
+    // approximate costs in multiply-adds
+    const double step_cost = double(n) * (ntimes + 2) + ntimes * ntimes;
+    const double apply_cost = double(n) * n;
+    const double square_cost = double(n) * n * n;
+
+    // decide which emission vectors are worth building operators for
+    for (unsigned int k=0; k<emits.size(); k++) {
+        double benefit = 0.0;
+        int maxlen = 0;
+        for (unsigned int r=0; r<runs.size(); r++) {
+            if (runs[r].op != (int) k)
+                continue;
+            const int len = runs[r].last - runs[r].first + 1;
+            const double gain = len * step_cost -
+                __builtin_popcount(len) * apply_cost;
+            if (gain > 0) {
+                benefit += gain;
+                maxlen = max(maxlen, len);
+            }
+        }
+        if (maxlen == 0)
+            continue;
+
+        int nlevels = 1;
+        while ((1 << nlevels) <= maxlen)
+            nlevels++;
+        if (benefit <= (nlevels - 1) * square_cost + 10 * apply_cost)
+            continue;
+
+        RunOperator op;
+        op.emit = emits[k];
+        build_operator(op, nlevels);
+        ops.push_back(op);
+
+        for (unsigned int r=0; r<runs.size(); r++) {
+            if (runs[r].op != (int) k)
+                continue;
+            const int len = runs[r].last - runs[r].first + 1;
+            if (len * step_cost > __builtin_popcount(len) * apply_cost) {
+                jumps[runs[r].first] = runs[r].last;
+                jump_ops[runs[r].first] = ops.size() - 1;
+                nskipped += len - 1;
+            }
+        }
+    }
+}
+
+
+void ForwardRunSkip::apply(int i, const double *col1, double *col2)
+{
+    const ForwardKernel *kernel = get_forward_kernel();
+    const RunOperator &op = ops[jump_ops[i]];
+    const int len = jumps[i] - i + 1;
+    const int n = nstates;
+
+    // col1 and col2 may share storage
+    double *v = &tmp[0];
+    double *w = &tmp[n];
+    copy(col1, col1 + n, v);
+
+    for (int b=0; (1 << b) <= len; b++) {
+        if (!(len & (1 << b)))
+            continue;
+        const double *mat = op.powers[b];
+        double norm = 0.0;
+        for (int k=0; k<n; k++) {
+            w[k] = kernel->dot(&mat[k*n], v, n);
+            norm += w[k];
+        }
+        assert(norm > 0.0);
+        kernel->normalize(w, norm, n);
+        swap(v, w);
+    }
+
+    copy(v, v + n, col2);
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,89 @@
+//=============================================================================
+// Skipping runs of identical sites in the forward algorithm
+//
+// Within a block the transition matrix T is fixed, and most columns use
+// the same emission vector e (invariant sites, or fully masked sites).  A
+// run of r such columns applies the linear operator M = diag(e) T' r times,
+// so the last column of the run can be computed directly as M^r col, using
+// powers M^(2^b) obtained by repeated squaring.
+//
+// Columns inside a run are never materialized, so this is only useful with
+// forward tables that recompute unstored columns during traceback (see
+// ArgHmmForwardTableCheckpoint).  A run is never jumped over a stored
+// column.  Whether a run is skipped is decided with a simple cost model:
+// the squarings cost O(nstates^3) each, which only pays off for small
+// state spaces or very long runs.
+
+#ifndef ARGWEAVER_FORWARD_SKIP_H
+#define ARGWEAVER_FORWARD_SKIP_H
+
+#include <vector>
+
+#include "local_tree.h"
+#include "states.h"
+#include "trans.h"
+
+namespace argweaver {
+
+using namespace std;
+
+class ArgHmmForwardTable;
+
+
+class ForwardRunSkip
+{
+public:
+    ForwardRunSkip(const LocalTree *tree, const States &states,
+                   const TransMatrix *matrix, int ntimes);
+    ~ForwardRunSkip();
+
+    // Choose the runs to skip in a forward block of ncols columns.
+    // Column i of the block has emissions emit[i] and is column 'start + i'
+    // of the forward table (column 0 is already computed).
+    void plan(const double *const *emit, int ncols,
+              const ArgHmmForwardTable *forward, int start);
+
+    // Returns the last column of the run starting at column i of the
+    // block, or 0 if column i should be computed normally.
+    inline int get_jump(int i) const
+    {
+        return jumps[i];
+    }
+
+    // compute the last column of the run starting at column i from col1
+    void apply(int i, const double *col1, double *col2);
+
+    // number of columns skipped by plan()
+    int get_num_skipped() const
+    {
+        return nskipped;
+    }
+
+protected:
+    // powers of the operator for one emission vector
+    struct RunOperator
+    {
+        const double *emit;
+        vector<double*> powers;  // powers[b] = M^(2^b), rescaled
+    };
+
+    void build_operator(RunOperator &op, int nlevels);
+    void clear();
+
+    const LocalTree *tree;
+    const States &states;
+    const TransMatrix *matrix;
+    const int ntimes;
+    const int nstates;
+
+    vector<RunOperator> ops;
+    vector<int> jumps;     // last column of a run, for each first column
+    vector<int> jump_ops;  // operator used, for each first column
+    vector<double> tmp;
+    int nskipped;
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_FORWARD_SKIP_H
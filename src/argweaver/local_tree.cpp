@@ -22,6 +22,45 @@ namespace argweaver {
 LocalNode null_node;
 
 
+//=============================================================================
+// slab allocation of node arrays and mappings
+
+static SlabArena &get_node_arena()
+{
+    static SlabArena *arena = new SlabArena(sizeof(LocalNode));
+    return *arena;
+}
+
+static SlabArena &get_mapping_arena()
+{
+    static SlabArena *arena = new SlabArena(sizeof(int));
+    return *arena;
+}
+
+LocalNode *alloc_local_nodes(int n)
+{
+    LocalNode *nodes = (LocalNode*) get_node_arena().alloc(n);
+    for (int i=0; i<n; i++)
+        new (&nodes[i]) LocalNode();
+    return nodes;
+}
+
+void free_local_nodes(LocalNode *nodes)
+{
+    get_node_arena().free(nodes);
+}
+
+int *alloc_node_mapping(int n)
+{
+    return (int*) get_mapping_arena().alloc(n);
+}
+
+void free_node_mapping(int *mapping)
+{
+    get_mapping_arena().free(mapping);
+}
+
+
 // Counts the number of lineages in a tree for each time segment
 //
 // NOTE: Nodes in the tree are not allowed to exist at the top time point
@@ -471,7 +510,7 @@ LocalTrees::LocalTrees(int **ptrees, int**ages, int **isprs, int *blocklens,
         // make mapping
         int *mapping = NULL;
         if (i > 0) {
-            mapping = new int [nnodes];
+            mapping = alloc_node_mapping(nnodes);
             make_node_mapping(ptrees[i-1], nnodes, isprs[i][0], mapping);
         }
 
@@ -489,8 +528,9 @@ LocalTrees::LocalTrees(int **ptrees, int**ages, int **isprs, int *blocklens,
 // Copy tree structure from another tree
 void LocalTrees::copy(const LocalTrees &other)
 {
-    // clear previous data
-    clear();
+    // keep previous trees for reuse
+    LocalTrees::TreeList spare;
+    spare.swap(trees);
 
     // copy over information
     chrom = other.chrom;
@@ -502,19 +542,94 @@ void LocalTrees::copy(const LocalTrees &other)
     // copy local trees
     for (const_iterator it=other.begin(); it != other.end(); ++it) {
         const int nnodes = it->tree->nnodes;
-        LocalTree *tree2 = new LocalTree();
-        tree2->copy(*it->tree);
-
         int *mapping = it->mapping;
-        int *mapping2 = NULL;
+
+        if (spare.empty()) {
+            LocalTree *tree2 = new LocalTree();
+            tree2->copy(*it->tree);
+
+            int *mapping2 = NULL;
+            if (mapping) {
+                mapping2 = alloc_node_mapping(nnodes);
+                for (int i=0; i<nnodes; i++)
+                    mapping2[i] = mapping[i];
+            }
+
+            trees.push_back(LocalTreeSpr(tree2, it->spr, it->blocklen,
+                                         mapping2));
+            continue;
+        }
+
+        // reuse a previous tree and its mapping, which holds at least as
+        // many nodes as that tree
+        trees.splice(trees.end(), spare, spare.begin());
+        LocalTreeSpr &tree_spr = trees.back();
+        if (tree_spr.mapping && (!mapping || tree_spr.tree->nnodes < nnodes)) {
+            free_node_mapping(tree_spr.mapping);
+            tree_spr.mapping = NULL;
+        }
         if (mapping) {
-            mapping2 = new int [nnodes];
+            if (!tree_spr.mapping)
+                tree_spr.mapping = alloc_node_mapping(nnodes);
             for (int i=0; i<nnodes; i++)
-                mapping2[i] = mapping[i];
+                tree_spr.mapping[i] = mapping[i];
         }
+        tree_spr.tree->copy(*it->tree);
+        tree_spr.spr = it->spr;
+        tree_spr.blocklen = it->blocklen;
+    }
 
-        trees.push_back(LocalTreeSpr(tree2, it->spr, it->blocklen, mapping2));
+    // deallocate unused trees
+    for (iterator it=spare.begin(); it != spare.end(); ++it)
+        it->clear();
+
+    // the reused trees have new blocks
+    invalidate_index();
+}
+
+
+bool LocalTrees::has_index() const
+{
+    // compare the ends of the index with the trees, without following
+    // iterators that may no longer be in the list
+    const int ntrees = trees.size();
+    if (ntrees == 0 || index.size() != ntrees)
+        return false;
+
+    int first_start, last_start;
+    iterator first, last;
+    index.get(0, &first_start, &first);
+    index.get(ntrees - 1, &last_start, &last);
+    return (first == const_cast<TreeList&>(trees).begin() &&
+            first_start == start_coord &&
+            last == --const_cast<TreeList&>(trees).end() &&
+            last_start + last->blocklen == end_coord);
+}
+
+
+LocalTrees::iterator LocalTrees::find_block(int pos, int *start) const
+{
+    iterator end = const_cast<TreeList&>(trees).end();
+    if (pos < start_coord || pos >= end_coord)
+        return end;
+
+    // the block found must contain pos, or the index is out of date
+    int block_start, rank;
+    iterator it;
+    ensure_index();
+    if (!index.find(pos, &block_start, &it, &rank) ||
+        pos >= block_start + it->blocklen)
+    {
+        invalidate_index();
+        ensure_index();
+        if (!index.find(pos, &block_start, &it, &rank) ||
+            pos >= block_start + it->blocklen)
+            return end;
     }
+
+    if (start)
+        *start = block_start;
+    return it;
 }
 
 
@@ -523,27 +638,33 @@ double get_arglen(const LocalTrees *trees, const double *times)
 {
     double arglen = 0.0;
 
-    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end(); ++it) {
-        const LocalNode *nodes = it->tree->nodes;
-        const int nnodes = it->tree->nnodes;
+    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end(); ++it)
+        arglen += get_arglen(it->tree, times) * it->blocklen;
 
-        double treelen = 0.0;
-        for (int i=0; i<nnodes; i++) {
-            int parent = nodes[i].parent;
-            if (parent != -1)
-                treelen += times[nodes[parent].age] - times[nodes[i].age];
-        }
+    return arglen;
+}
 
-        arglen += treelen * it->blocklen;
-    }
 
-    return arglen;
+// get total branch length of one local tree, as used by get_arglen
+double get_arglen(const LocalTree *tree, const double *times)
+{
+    const LocalNode *nodes = tree->nodes;
+    const int nnodes = tree->nnodes;
+
+    double treelen = 0.0;
+    for (int i=0; i<nnodes; i++) {
+        int parent = nodes[i].parent;
+        if (parent != -1)
+            treelen += times[nodes[parent].age] - times[nodes[i].age];
+    }
+    return treelen;
 }
 
 
-// removes a null SPR from one local tree
-bool remove_null_spr(LocalTrees *trees, LocalTrees::iterator it,
-                     const PopulationTree *pop_tree)
+// removes a null SPR from one local tree, leaving the position index of
+// trees for the caller to update or invalidate
+static bool merge_null_spr(LocalTrees *trees, LocalTrees::iterator it,
+                           const PopulationTree *pop_tree)
 {
     // look one tree ahead
     LocalTrees::iterator it2 = it;
@@ -577,7 +698,7 @@ bool remove_null_spr(LocalTrees *trees, LocalTrees::iterator it,
 
     if (it->mapping == NULL) {
         // it2 will become first tree and therefore does not need a mapping
-        delete [] it2->mapping;
+        free_node_mapping(it2->mapping);
         it2->mapping = NULL;
     } else {
         // compute transitive mapping
@@ -610,6 +731,17 @@ bool remove_null_spr(LocalTrees *trees, LocalTrees::iterator it,
 }
 
 
+// removes a null SPR from one local tree
+bool remove_null_spr(LocalTrees *trees, LocalTrees::iterator it,
+                     const PopulationTree *pop_tree)
+{
+    if (!merge_null_spr(trees, it, pop_tree))
+        return false;
+    trees->invalidate_index();
+    return true;
+}
+
+
 
 // Removes trees with null SPRs from the local trees
 void remove_null_sprs(LocalTrees *trees, const PopulationTree *pop_tree)
@@ -617,9 +749,10 @@ void remove_null_sprs(LocalTrees *trees, const PopulationTree *pop_tree)
     for (LocalTrees::iterator it=trees->begin(); it != trees->end();) {
         LocalTrees::iterator it2 = it;
         ++it2;
-        remove_null_spr(trees, it, pop_tree);
+        merge_null_spr(trees, it, pop_tree);
         it = it2;
     }
+    trees->invalidate_index();
 }
 
 
@@ -661,14 +794,32 @@ LocalTrees *partition_local_trees(LocalTrees *trees, int pos,
                                   LocalTrees::iterator it, int it_start,
                                   bool trim)
 {
+    // find the rank of the block in the position index, if it is current
+    int rank = -1;
+    if (trees->has_index()) {
+        int start;
+        LocalTrees::iterator it3;
+        if (!trees->index.find(it_start, &start, &it3, &rank) || it3 != it)
+            rank = -1;
+    }
+
     // create new local trees
     LocalTrees *trees2 = new LocalTrees(pos, trees->end_coord, trees->nnodes);
     trees2->chrom = trees->chrom;
     trees2->seqids.insert(trees2->seqids.end(), trees->seqids.begin(),
                           trees->seqids.end());
 
-    // splice trees over
-    trees2->trees.splice(trees2->begin(), trees->trees, it, trees->end());
+    // splice trees over; splicing a range counts its trees, so when the
+    // index tells that the trees before it are fewer, those are moved out
+    // and the lists are swapped
+    if (rank != -1 && rank < trees->index.size() - rank) {
+        LocalTrees::TreeList head;
+        head.splice(head.begin(), trees->trees, trees->begin(), it);
+        trees2->trees.swap(trees->trees);
+        trees->trees.swap(head);
+    } else {
+        trees2->trees.splice(trees2->begin(), trees->trees, it, trees->end());
+    }
 
     LocalTrees::iterator it2 = trees2->begin();
     if (trim) {
@@ -679,7 +830,7 @@ LocalTrees *partition_local_trees(LocalTrees *trees, int pos,
 
             int *mapping = NULL;
             if (it2->mapping) {
-                mapping = new int[trees->nnodes];
+                mapping = alloc_node_mapping(trees->nnodes);
                 for (int i=0; i<trees->nnodes; i++)
                     mapping[i] = it2->mapping[i];
             }
@@ -689,7 +840,7 @@ LocalTrees *partition_local_trees(LocalTrees *trees, int pos,
 
         // modify first tree of trees2
         if (it2->mapping)
-            delete [] it2->mapping;
+            free_node_mapping(it2->mapping);
         it2->mapping = NULL;
         it2->spr.set_null();
     }
@@ -698,6 +849,16 @@ LocalTrees *partition_local_trees(LocalTrees *trees, int pos,
     it2->blocklen -= pos - it_start;
     assert(it2->blocklen > 0);
 
+    // split the position index at the block
+    if (rank != -1) {
+        trees->index.split(rank, trees2->index);
+        trees2->index.set(0, pos, it2);
+        if (trim)
+            trees->index.push_back(it_start, --trees->end());
+    } else {
+        trees->invalidate_index();
+    }
+
     //assert_trees(trees);
     //assert_trees(trees2);
 
@@ -718,6 +879,7 @@ LocalTrees *partition_local_trees(LocalTrees *trees, int pos, bool trim)
                               trees->seqids.end());
         trees2->trees.splice(trees2->begin(), trees->trees,
                              trees->begin(), trees->end());
+        trees2->index.swap(trees->index);
         trees->end_coord = pos;
         return trees2;
     }
@@ -915,6 +1077,14 @@ void append_local_trees(LocalTrees *trees, LocalTrees *trees2, bool merge,
         assert(trees->seqids[i] == trees2->seqids[i]);
     assert(trees->nnodes == trees2->nnodes);
 
+    // join the position indexes if the index of trees is current
+    const bool indexed = (ntrees == 0 || trees->has_index());
+    if (indexed) {
+        if (ntrees == 0)
+            trees->index.clear();
+        trees2->ensure_index();
+    }
+
     // move trees2 onto end of trees
     LocalTrees::iterator it = trees->end();
     --it;
@@ -923,6 +1093,12 @@ void append_local_trees(LocalTrees *trees, LocalTrees *trees2, bool merge,
     trees->end_coord = trees2->end_coord;
     trees2->end_coord = trees2->start_coord;
 
+    if (indexed)
+        trees->index.append(trees2->index);
+    else
+        trees->invalidate_index();
+    trees2->invalidate_index();
+
     // set the mapping the newly neighboring trees
     if (merge && ntrees > 0 && ntrees2 > 0) {
         LocalTrees::iterator it2 = it;
@@ -932,10 +1108,17 @@ void append_local_trees(LocalTrees *trees, LocalTrees *trees2, bool merge,
             // there is no SPR between these trees
             // infer a congruent mapping and remove redunant local blocks
             if (it2->mapping == NULL)
-                it2->mapping = new int [trees2->nnodes];
+                it2->mapping = alloc_node_mapping(trees2->nnodes);
             map_congruent_trees(it->tree, &trees->seqids[0],
                                 it2->tree, &trees2->seqids[0], it2->mapping);
-            remove_null_spr(trees, it, pop_tree);
+            if (merge_null_spr(trees, it, pop_tree) && indexed) {
+                // the block of it2 now starts where the block of it did
+                int start;
+                LocalTrees::iterator it3;
+                trees->index.get(ntrees - 1, &start, &it3);
+                trees->index.erase(ntrees);
+                trees->index.set(ntrees - 1, start, it2);
+            }
         } else {
             // there should be an SPR between these trees, repair it.
             repair_spr(it->tree, it2->tree, it2->spr, it2->mapping);
@@ -946,6 +1129,170 @@ void append_local_trees(LocalTrees *trees, LocalTrees *trees2, bool merge,
     //assert_trees(trees2);
 }
 
+
+// returns the smallest leaf below node
+static int get_min_leaf(const LocalNode *nodes, int node)
+{
+    if (nodes[node].is_leaf())
+        return node;
+    return min(get_min_leaf(nodes, nodes[node].child[0]),
+               get_min_leaf(nodes, nodes[node].child[1]));
+}
+
+
+static void get_leaves_below(const LocalNode *nodes, int node, int maxleaf,
+                             vector<int> &leaves)
+{
+    if (nodes[node].is_leaf()) {
+        if (node < maxleaf)
+            leaves.push_back(node);
+    } else {
+        get_leaves_below(nodes, nodes[node].child[0], maxleaf, leaves);
+        get_leaves_below(nodes, nodes[node].child[1], maxleaf, leaves);
+    }
+}
+
+
+// find the SPR that regrafts leaf in tree where it joins the leaves
+// 0..leaf-1 in target.  The leaves 0..leaf-1 must already have the same
+// subtree in both trees.  Returns false if leaf is already in place.
+static bool get_regraft_spr(const LocalTree *tree, const LocalTree *target,
+                            int leaf, Spr *spr)
+{
+    const LocalNode *nodes = tree->nodes;
+    const LocalNode *tnodes = target->nodes;
+
+    // in target, walk up from leaf until it joins a lineage of smaller leaves
+    int node = leaf;
+    int sib = target->get_sibling(node);
+    while (get_min_leaf(tnodes, sib) > leaf) {
+        node = tnodes[node].parent;
+        sib = target->get_sibling(node);
+    }
+    const int coal_time = tnodes[tnodes[node].parent].age;
+    vector<int> leaves;
+    get_leaves_below(tnodes, sib, leaf, leaves);
+
+    // find the MRCA of the same leaves in tree
+    int counts[tree->nnodes];
+    fill(counts, counts + tree->nnodes, 0);
+    int mrca = -1;
+    for (unsigned int i=0; i<leaves.size() && mrca == -1; i++) {
+        for (int j=leaves[i]; j != -1; j=nodes[j].parent) {
+            if (++counts[j] == (int) leaves.size()) {
+                mrca = j;
+                break;
+            }
+        }
+    }
+    assert(mrca != -1);
+
+    // walk up the tree without leaf to the lowest branch that spans the
+    // coalescence
+    const int broken = nodes[leaf].parent;
+    const int leaf_sib = tree->get_sibling(leaf);
+    int coal_node = mrca;
+    while (true) {
+        int parent = nodes[coal_node].parent;
+        if (parent == broken)
+            parent = nodes[broken].parent;
+        if (parent == -1 || nodes[parent].age >= coal_time)
+            break;
+        coal_node = parent;
+    }
+
+    // the lineage of leaf's sibling is named by the broken node above it
+    if (coal_node == leaf_sib) {
+        if (coal_time == nodes[broken].age)
+            return false;
+        if (coal_time > nodes[broken].age)
+            coal_node = broken;
+    }
+
+    *spr = Spr(leaf, nodes[leaf].age, coal_node, coal_time, 0);
+    return true;
+}
+
+
+// appends the data in 'trees2' to 'trees' when the last tree of 'trees'
+// and the first tree of 'trees2' need not be the same.  The leaves of the
+// last tree are regrafted one at a time until it is the tree of 'trees2'
+// nleaves-1 positions into 'trees2'; these regrafted trees replace the
+// start of 'trees2'.  trees2 is then empty.
+void stitch_local_trees(LocalTrees *trees, LocalTrees *trees2)
+{
+    const int nleaves = trees->get_num_leaves();
+    assert(trees->end_coord == trees2->start_coord);
+    assert(trees->seqids == trees2->seqids);
+    if (nleaves < 2) {
+        append_local_trees(trees, trees2);
+        return;
+    }
+
+    // drop the zero length block that partitioning may leave
+    if (trees->back().blocklen == 0) {
+        trees->back().clear();
+        trees->trees.pop_back();
+        trees->invalidate_index();
+    }
+
+    // split off the trees the regrafting replaces
+    const int bridge_start = trees2->start_coord;
+    const int bridge_end = bridge_start + nleaves - 1;
+    assert(trees2->end_coord > bridge_end);
+    LocalTrees *rest = partition_local_trees(trees2, bridge_end);
+    trees2->clear();
+    trees2->end_coord = trees2->start_coord;
+    const LocalTree *target = rest->front().tree;
+
+    // regraft leaves, one block each
+    LocalTrees bridge(bridge_start, bridge_start, trees->nnodes);
+    bridge.chrom = trees->chrom;
+    bridge.seqids = trees->seqids;
+    const LocalTree *last_tree = trees->back().tree;
+    for (int leaf=1; leaf<nleaves; leaf++) {
+        Spr spr;
+        if (!get_regraft_spr(last_tree, target, leaf, &spr))
+            continue;
+
+        LocalTree *tree = new LocalTree(last_tree->nnodes,
+                                        last_tree->capacity);
+        tree->copy(*last_tree);
+        apply_spr(tree, spr);
+
+        // all nodes keep their name except the broken node
+        int *mapping = alloc_node_mapping(tree->capacity);
+        for (int j=0; j<tree->nnodes; j++)
+            mapping[j] = j;
+        mapping[last_tree->nodes[spr.recomb_node].parent] = -1;
+
+        bridge.trees.push_back(LocalTreeSpr(tree, spr, 1, mapping));
+        bridge.end_coord++;
+        last_tree = tree;
+    }
+
+    // the last block of the bridge fills the rest of it
+    const int pad = bridge_end - bridge.end_coord;
+    if (bridge.get_num_trees() > 0) {
+        bridge.trees.back().blocklen += pad;
+        bridge.end_coord = bridge_end;
+        append_local_trees(trees, &bridge, false);
+    } else {
+        trees->back().blocklen += pad;
+        trees->end_coord = bridge_end;
+    }
+
+    // the last tree now has the same subtree as the first tree of rest
+    LocalTreeSpr &first = rest->front();
+    first.spr.set_null();
+    if (first.mapping) {
+        free_node_mapping(first.mapping);
+        first.mapping = NULL;
+    }
+    append_local_trees(trees, rest);
+    delete rest;
+}
+
 void remove_population_paths(LocalTrees *trees) {
     for (LocalTrees::iterator it=trees->begin();
          it != trees->end(); ++it)
@@ -986,6 +1333,7 @@ void uncompress_local_trees(LocalTrees *trees,
 
     trees->start_coord = sites_mapping->old_start;
     trees->end_coord = sites_mapping->old_end;
+    trees->invalidate_index();
 
     //assert_trees(trees);
 }
@@ -1038,6 +1386,7 @@ void compress_local_trees(LocalTrees *trees, const SitesMapping *sites_mapping,
 
     trees->start_coord = sites_mapping->new_start;
     trees->end_coord = sites_mapping->new_end;
+    trees->invalidate_index();
 }
 
 
@@ -1806,7 +2155,7 @@ bool read_local_trees(FILE *infile, const double *times, int ntimes,
             // setup mapping
             int *mapping = NULL;
             if (!spr.is_null()) {
-                mapping = new int [nnodes];
+                mapping = alloc_node_mapping(nnodes);
                 for (int i=0; i<nnodes; i++)
                     mapping[i] = i;
                 if (spr.recomb_node != spr.coal_node)
@@ -2042,8 +2391,6 @@ bool assert_spr(const LocalTree *last_tree, const LocalTree *tree,
 {
     LocalNode *last_nodes = last_tree->nodes;
     LocalNode *nodes = tree->nodes;
-    static int count=0;
-    count++;
 
     if (spr->is_null()) {
         // just check that mapping is 1-to-1
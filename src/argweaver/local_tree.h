@@ -6,6 +6,7 @@
 
 // c++ includes
 #include <assert.h>
+#include <algorithm>
 #include <list>
 #include <vector>
 #include <string.h>
@@ -14,6 +15,8 @@
 // arghmm includes
 #include "sequences.h"
 #include "model.h"
+#include "position_index.h"
+#include "slab.h"
 
 namespace argweaver {
 
@@ -50,6 +53,7 @@ public:
     Spr(const Spr &other) {
         copy(other);
     }
+    Spr &operator=(const Spr &other) = default;
     void copy(const Spr &other) {
         recomb_node = other.recomb_node;
         recomb_time = other.recomb_time;
@@ -157,6 +161,13 @@ public:
 extern LocalNode null_node;
 
 
+// node arrays and node mappings of local trees are allocated from slabs
+LocalNode *alloc_local_nodes(int n);
+void free_local_nodes(LocalNode *nodes);
+int *alloc_node_mapping(int n);
+void free_node_mapping(int *mapping);
+
+
 // A local tree in a set of local trees
 //
 //   Leaves are always listed first in nodes array
@@ -178,7 +189,7 @@ public:
     {
         if (capacity < nnodes)
             capacity = nnodes;
-        nodes = new LocalNode [capacity];
+        nodes = alloc_local_nodes(capacity);
     }
 
 
@@ -204,19 +215,30 @@ public:
 
     ~LocalTree() {
         if (nodes) {
-            delete [] nodes;
+            free_local_nodes(nodes);
             nodes = NULL;
         }
     }
 
+    // local trees themselves are allocated from a slab
+    static void *operator new(size_t size)
+    {
+        assert(size == sizeof(LocalTree));
+        (void) size;
+        return SlabAllocator<LocalTree>::get_arena().alloc(1);
+    }
+    static void operator delete(void *ptr)
+    {
+        SlabAllocator<LocalTree>::get_arena().free(ptr);
+    }
+
     // initialize a local tree by on a parent array
     void set_ptree(int *ptree, int _nnodes, int *ages=NULL, int *paths=NULL,
                    int _capacity=-1)
     {
         // delete existing nodes if they exist
-        if (nodes) {
-	    delete [] nodes;
-	}
+        if (nodes)
+            free_local_nodes(nodes);
 
         nnodes = _nnodes;
         if (_capacity >= 0)
@@ -224,7 +246,7 @@ public:
         if (capacity < nnodes)
             capacity = nnodes;
 
-        nodes = new LocalNode [capacity];
+        nodes = alloc_local_nodes(capacity);
 
         // populate parent pointers
         for (int i=0; i<nnodes; i++) {
@@ -277,11 +299,11 @@ public:
         if (_capacity == capacity)
             return;
 
-        LocalNode *tmp = new LocalNode[_capacity];
-	assert(tmp);
-
-        std::copy(nodes, nodes + capacity, tmp);
-        delete [] nodes;
+        LocalNode *tmp = alloc_local_nodes(_capacity);
+        if (nodes) {
+            std::copy(nodes, nodes + min(capacity, _capacity), tmp);
+            free_local_nodes(nodes);
+        }
 
         nodes = tmp;
         capacity = _capacity;
@@ -483,7 +505,7 @@ public:
         }
 
         if (mapping) {
-            delete [] mapping;
+            free_node_mapping(mapping);
             mapping = NULL;
         }
     }
@@ -498,11 +520,9 @@ public:
 
         // ensure capacity of mapping
         if (mapping) {
-            int *tmp = new int [_capacity];
-            assert(tmp);
-
-            std::copy(mapping, mapping + _capacity, tmp);
-            delete [] mapping;
+            int *tmp = alloc_node_mapping(_capacity);
+            std::copy(mapping, mapping + min(tree->nnodes, _capacity), tmp);
+            free_node_mapping(mapping);
 
             mapping = tmp;
         }
@@ -544,11 +564,14 @@ public:
         clear();
     }
 
+    // list of local trees, with its entries allocated from a slab
+    typedef list<LocalTreeSpr, SlabAllocator<LocalTreeSpr> > TreeList;
+
     // iterators for the local trees
-    typedef list<LocalTreeSpr>::iterator iterator;
-    typedef list<LocalTreeSpr>::reverse_iterator reverse_iterator;
-    typedef list<LocalTreeSpr>::const_iterator const_iterator;
-    typedef list<LocalTreeSpr>::const_reverse_iterator const_reverse_iterator;
+    typedef TreeList::iterator iterator;
+    typedef TreeList::reverse_iterator reverse_iterator;
+    typedef TreeList::const_iterator const_iterator;
+    typedef TreeList::const_reverse_iterator const_reverse_iterator;
 
 
     // Returns iterator for first local tree
@@ -589,15 +612,29 @@ public:
         return trees.size();
     }
 
-    // Copy trees from another set of local trees
+    // Copy trees from another set of local trees, reusing the trees
+    // already allocated here
     void copy(const LocalTrees &other);
 
+    // Exchange trees with another set of local trees in constant time
+    void swap(LocalTrees &other)
+    {
+        chrom.swap(other.chrom);
+        std::swap(start_coord, other.start_coord);
+        std::swap(end_coord, other.end_coord);
+        std::swap(nnodes, other.nnodes);
+        seqids.swap(other.seqids);
+        trees.swap(other.trees);
+        index.swap(other.index);
+    }
+
     // deallocate local trees
     void clear()
     {
         for (iterator it=begin(); it!=end(); it++)
             it->clear();
         trees.clear();
+        index.clear();
     }
 
     // make trunk genealogy
@@ -656,43 +693,70 @@ public:
     // return local block containing site
     const_iterator get_block(int site, int &start, int &end) const
     {
-        start = end = start_coord;
-        for (const_iterator it = begin(); it != this->end(); ++it) {
-            start = end;
-            end += it->blocklen;
-            if (start <= site && site < end)
-                return it;
-        }
-        return this->end();
+        const_iterator it = find(site, &start);
+        if (it != this->end())
+            end = start + it->blocklen;
+        return it;
     }
 
     // return local block containing site
     const_iterator get_block(int site) const
     {
-        int start, end;
-        return get_block(site, start, end);
+        return find(site);
     }
 
     // return local block containing site
     iterator get_block(int site, int &start, int &end)
     {
-        start = end = start_coord;
-        for (iterator it = begin(); it != this->end(); ++it) {
-            start = end;
-            end += it->blocklen;
-            if (start <= site && site < end)
-                return it;
-        }
-        return this->end();
+        iterator it = find(site, &start);
+        if (it != this->end())
+            end = start + it->blocklen;
+        return it;
     }
 
     // return local block containing site
     iterator get_block(int site)
     {
-        int start, end;
-        return get_block(site, start, end);
+        return find(site);
+    }
+
+
+    // Returns the block containing pos and sets start to its start
+    // coordinate, or returns end() if pos is outside the trees.  Blocks are
+    // found with the position index, which is built when first needed.
+    // The const version also builds the mutable index, so threads must not
+    // call find() on the same LocalTrees at the same time.
+    iterator find(int pos, int *start=NULL)
+    {
+        return find_block(pos, start);
+    }
+
+    const_iterator find(int pos, int *start=NULL) const
+    {
+        return find_block(pos, start);
+    }
+
+    // Returns true if the position index matches the trees.  Only the
+    // number of blocks and the ends of the list are checked, so the index
+    // is only trustworthy if every change to the blocks keeps or clears it.
+    // partition_local_trees() and append_local_trees() keep the index, and
+    // copy(), clear(), remove_null_spr(), remove_null_sprs(),
+    // stitch_local_trees(), compress_local_trees(),
+    // uncompress_local_trees() and the threading functions clear it.  Any
+    // other code that inserts or removes blocks, or changes the length of
+    // any block but the last, must call invalidate_index().  The last block
+    // may grow or shrink together with end_coord.
+    bool has_index() const;
+
+    // build the position index unless it matches the trees
+    void ensure_index() const
+    {
+        if (!has_index())
+            index.build(const_cast<TreeList&>(trees).begin(),
+                        const_cast<TreeList&>(trees).end(), start_coord);
     }
 
+    void invalidate_index() const { index.clear(); }
 
 
     string chrom;              // chromosome name of region
@@ -700,9 +764,15 @@ public:
                                // 0-based coordinate system
     int end_coord;             // end coordinate of whole tree list
     int nnodes;                // number of nodes in each tree
-    list<LocalTreeSpr> trees;  // linked list of local trees
+    TreeList trees;            // linked list of local trees
 
     vector<int> seqids;        // mapping from tree leaves to sequence ids
+
+    // position index of the blocks, see has_index()
+    mutable PositionIndex<iterator> index;
+
+protected:
+    iterator find_block(int pos, int *start) const;
 };
 
 
@@ -793,6 +863,7 @@ double get_basal_branch(const LocalTree *tree, const double *times,
 // trees functions
 
 double get_arglen(const LocalTrees *trees, const double *times);
+double get_arglen(const LocalTree *tree, const double *times);
 
 void map_congruent_trees(const LocalTree *tree1, const int *seqids1,
                          const LocalTree *tree2, const int *seqids2,
@@ -813,6 +884,7 @@ LocalTrees *partition_local_trees(LocalTrees *trees, int pos,
 LocalTrees *partition_local_trees(LocalTrees *trees, int pos, bool trim=true);
 void append_local_trees(LocalTrees *trees, LocalTrees *trees2, bool merge=true,
                         const PopulationTree *pop_tree=NULL);
+void stitch_local_trees(LocalTrees *trees, LocalTrees *trees2);
 
 void uncompress_local_trees(LocalTrees *trees,
                             const SitesMapping *sites_mapping);
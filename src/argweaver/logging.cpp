@@ -15,6 +15,7 @@ namespace argweaver {
 // Errors and Logging
 
 Logger g_logger(stderr, LOG_QUIET);
+thread_local Logger *g_thread_logger = NULL;
 
 
 void Logger::printTimerLog(const Timer &timer, int level, const char *fmt, ...)
@@ -65,6 +66,15 @@ void printLog(int level, const char *fmt, ...)
 {
     va_list ap;
 
+    if (g_thread_logger) {
+        if (g_thread_logger->isLogLevel(level)) {
+            va_start(ap, fmt);
+            g_thread_logger->printLog(level, fmt, ap);
+            va_end(ap);
+        }
+        return;
+    }
+
     if (g_logger.isLogLevel(level)) {
         va_start(ap, fmt);
         g_logger.printLog(level, fmt, ap);
@@ -84,6 +94,15 @@ void printTimerLog(const Timer &timer, int level, const char *fmt, ...)
 {
     va_list ap;
 
+    if (g_thread_logger) {
+        if (g_thread_logger->isLogLevel(level)) {
+            va_start(ap, fmt);
+            g_thread_logger->printTimerLog(timer, level, fmt, ap);
+            va_end(ap);
+        }
+        return;
+    }
+
     if (g_logger.isLogLevel(level)) {
         va_start(ap, fmt);
         g_logger.printTimerLog(timer, level, fmt, ap);
@@ -11,6 +11,7 @@
 #define ARGWEAVER_LOGGING_H
 
 // c/c++ includes
+#include <atomic>
 #include <assert.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -143,16 +144,14 @@ public:
     {
         if (chain)
             chain->incLogLevel();
-        loglevel++;
-        return loglevel;
+        return ++loglevel;
     }
 
     int decLogLevel()
     {
         if (chain)
             chain->decLogLevel();
-        loglevel--;
-        return loglevel;
+        return --loglevel;
     }
 
     int getLogLevel()
@@ -214,7 +213,7 @@ public:
 protected:
 
     FILE *logstream;
-    int loglevel;
+    std::atomic<int> loglevel;  // changed temporarily by sampling threads
     Logger *chain;
 };
 
@@ -224,6 +223,14 @@ protected:
 
 extern Logger g_logger;
 
+// When set, the global logging functions of the calling thread write to this
+// logger instead of g_logger, e.g. for (MC)^3 chains run as threads that each
+// keep their own log file.
+extern thread_local Logger *g_thread_logger;
+
+inline Logger *getLogger()
+{ return g_thread_logger ? g_thread_logger : &g_logger; }
+
 inline bool openLogFile(const char *filename, const char* mode="w")
 { return g_logger.openLogFile(filename, mode); }
 
@@ -237,13 +244,13 @@ inline FILE *getLogFile()
 { return g_logger.getLogFile(); }
 
 inline bool isLogLevel(int level)
-{ return g_logger.isLogLevel(level); }
+{ return getLogger()->isLogLevel(level); }
 
 inline int incLogLevel()
-{ return g_logger.incLogLevel(); }
+{ return getLogger()->incLogLevel(); }
 
 inline int decLogLevel()
-{ return g_logger.decLogLevel(); }
+{ return getLogger()->decLogLevel(); }
 
 
 // global function API
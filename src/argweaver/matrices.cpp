@@ -1,15 +1,325 @@
 
 
+#include <atomic>
+
 #include "matrices.h"
 
 namespace argweaver {
 
+
+//=============================================================================
+// transition matrix cache
+
+static atomic<long> g_matrix_cache_hits(0);
+static atomic<long> g_matrix_cache_misses(0);
+
+// bytes held by all caches, which share their max_bytes as one budget so
+// that threads and chains do not each take a full budget
+static atomic<size_t> g_matrix_cache_bytes(0);
+
+
+void get_matrix_cache_counts(long *nhits, long *nmisses)
+{
+    *nhits = g_matrix_cache_hits;
+    *nmisses = g_matrix_cache_misses;
+}
+
+
+TransMatrixCache::~TransMatrixCache()
+{
+    if (nhits + nmisses > 0)
+        printLog(LOG_HIGH, "matrix cache: %ld hits, %ld misses\n",
+                 nhits, nmisses);
+    g_matrix_cache_hits += nhits;
+    g_matrix_cache_misses += nmisses;
+    clear();
+}
+
+
+void TransMatrixCache::clear()
+{
+    lock_guard<mutex> guard(lock);
+    entries.clear();
+    index.clear();
+    g_matrix_cache_bytes -= nbytes;
+    nbytes = 0;
+}
+
+
+TransMatrixCache::Entry *TransMatrixCache::lookup(const string &key)
+{
+    unordered_map<string, EntryIter>::iterator it = index.find(key);
+    if (it == index.end()) {
+        nmisses++;
+        return NULL;
+    }
+
+    // move to front of LRU list
+    nhits++;
+    entries.splice(entries.begin(), entries, it->second);
+    return &entries.front();
+}
+
+
+void TransMatrixCache::insert(Entry &entry)
+{
+    entry.nbytes += 2 * entry.key.size() + sizeof(Entry);
+    if (entry.nbytes > max_bytes || index.count(entry.key))
+        return;
+
+    // evict least recently used matrices to fit this cache and the budget
+    // shared by all caches
+    while (!entries.empty() &&
+           (nbytes + entry.nbytes > max_bytes ||
+            g_matrix_cache_bytes + entry.nbytes > max_bytes))
+        evict();
+    if (g_matrix_cache_bytes.fetch_add(entry.nbytes) + entry.nbytes >
+        max_bytes) {
+        // other caches hold the budget
+        g_matrix_cache_bytes -= entry.nbytes;
+        return;
+    }
+
+    nbytes += entry.nbytes;
+    entries.push_front(std::move(entry));
+    index[entries.front().key] = entries.begin();
+}
+
+
+void TransMatrixCache::evict()
+{
+    Entry &last = entries.back();
+    nbytes -= last.nbytes;
+    g_matrix_cache_bytes -= last.nbytes;
+    index.erase(last.key);
+    entries.pop_back();
+}
+
+
+shared_ptr<TransMatrix> TransMatrixCache::get_transmat(const string &key)
+{
+    lock_guard<mutex> guard(lock);
+    Entry *entry = lookup(key);
+    return entry ? entry->transmat : shared_ptr<TransMatrix>();
+}
+
+
+shared_ptr<TransMatrixSwitch> TransMatrixCache::get_transmat_switch(
+    const string &key)
+{
+    lock_guard<mutex> guard(lock);
+    Entry *entry = lookup(key);
+    return entry ? entry->transmat_switch : shared_ptr<TransMatrixSwitch>();
+}
+
+
+void TransMatrixCache::add(const string &key,
+                           const shared_ptr<TransMatrix> &matrix)
+{
+    Entry entry;
+    entry.key = key;
+    entry.transmat = matrix;
+    entry.nbytes = matrix->memory_size();
+
+    lock_guard<mutex> guard(lock);
+    insert(entry);
+}
+
+
+void TransMatrixCache::add(const string &key,
+                           const shared_ptr<TransMatrixSwitch> &matrix)
+{
+    Entry entry;
+    entry.key = key;
+    entry.transmat_switch = matrix;
+    entry.nbytes = matrix->memory_size();
+
+    lock_guard<mutex> guard(lock);
+    insert(entry);
+}
+
+
+//=============================================================================
+// transition matrix store
+
+static atomic<long> g_matrix_store_reused(0);
+// bytes held by all stores, which share their max_bytes as one budget
+static atomic<size_t> g_matrix_store_bytes(0);
+static double g_matrix_store_time_saved = 0.0;
+static mutex g_matrix_store_lock;
+
+
+void get_matrix_store_counts(long *nreused, double *time_saved)
+{
+    lock_guard<mutex> guard(g_matrix_store_lock);
+    *nreused = g_matrix_store_reused;
+    *time_saved = g_matrix_store_time_saved;
+}
+
+
+TransMatrixStore::~TransMatrixStore()
+{
+    g_matrix_store_reused += nreused;
+    {
+        lock_guard<mutex> guard(g_matrix_store_lock);
+        g_matrix_store_time_saved += time_saved;
+    }
+    clear();
+}
+
+
+void TransMatrixStore::clear()
+{
+    lock_guard<mutex> guard(lock);
+    entries.clear();
+    g_matrix_store_bytes -= nbytes;
+    nbytes = 0;
+}
+
+
+bool TransMatrixStore::get(int index, ArgHmmMatrices *matrices)
+{
+    lock_guard<mutex> guard(lock);
+    if (index >= int(entries.size()) || !entries[index].stored)
+        return false;
+
+    const Entry &entry = entries[index];
+    matrices->transmat_ref = entry.transmat;
+    matrices->transmat = entry.transmat.get();
+    matrices->transmat_switch_ref = entry.transmat_switch;
+    matrices->transmat_switch = entry.transmat_switch.get();
+    nreused++;
+    time_saved += entry.trans_time;
+    return true;
+}
+
+
+void TransMatrixStore::add(int index, const ArgHmmMatrices &matrices)
+{
+    // matrices owned by the caller cannot be shared
+    if (!matrices.transmat_ref ||
+        (matrices.transmat_switch && !matrices.transmat_switch_ref))
+        return;
+
+    size_t size = sizeof(Entry) + matrices.transmat->memory_size();
+    if (matrices.transmat_switch)
+        size += matrices.transmat_switch->memory_size();
+
+    lock_guard<mutex> guard(lock);
+    if (nbytes + size > max_bytes)
+        return;
+    if (index < int(entries.size()) && entries[index].stored)
+        return;
+    if (g_matrix_store_bytes.fetch_add(size) + size > max_bytes) {
+        // other stores hold the budget
+        g_matrix_store_bytes -= size;
+        return;
+    }
+    if (index >= int(entries.size()))
+        entries.resize(index + 1);
+
+    Entry &entry = entries[index];
+    entry.stored = true;
+    entry.transmat = matrices.transmat_ref;
+    entry.transmat_switch = matrices.transmat_switch_ref;
+    entry.trans_time = matrices.trans_time;
+    nbytes += size;
+    nstored++;
+}
+
+
+//=============================================================================
+// matrix calculation
+
+// calculate the transition matrix of a block, or reuse it from the cache
+static void calc_block_transmat(
+    const ArgModel *model, const LocalTree *tree, const States &states,
+    bool internal, ArgHmmMatrices *matrices, TransMatrixCache *cache)
+{
+    // matrix replayed from a TransMatrixStore
+    if (matrices->transmat)
+        return;
+
+    Timer timer;
+    const int nstates = states.size();
+    const int minage = matrices->states_model.minage;
+    LineageCounts lineages(model->ntimes, model->num_pops());
+    lineages.count(tree, model->pop_tree, internal);
+
+    string key;
+    if (cache) {
+        get_transmat_key(tree, model, states, &lineages, internal, minage,
+                         key);
+        matrices->transmat_ref = cache->get_transmat(key);
+        if (matrices->transmat_ref) {
+            matrices->transmat = matrices->transmat_ref.get();
+            matrices->trans_time += timer.time();
+            return;
+        }
+    }
+
+    matrices->transmat = new TransMatrix(model, nstates);
+    matrices->transmat->calc_transition_probs(tree, model, states, &lineages,
+                                              internal, minage);
+    matrices->transmat_ref.reset(matrices->transmat);
+    if (cache)
+        cache->add(key, matrices->transmat_ref);
+    matrices->trans_time += timer.time();
+}
+
+
+// calculate the switch transition matrix between the previous block and
+// this one, or reuse it from the cache
+static void calc_block_transmat_switch(
+    const ArgModel *model, const LocalTreeSpr *last_tree_spr,
+    const LocalTreeSpr *tree_spr, const States &last_states,
+    const States &states, bool internal, ArgHmmMatrices *matrices,
+    TransMatrixCache *cache)
+{
+    // matrix replayed from a TransMatrixStore
+    if (matrices->transmat_switch)
+        return;
+
+    Timer timer;
+    const LocalTree *tree = tree_spr->tree;
+    const LocalTree *last_tree = last_tree_spr->tree;
+
+    string key;
+    if (cache) {
+        get_transmat_switch_key(tree, last_tree, tree_spr->spr,
+                                tree_spr->mapping, model,
+                                matrices->states_model, key);
+        matrices->transmat_switch_ref = cache->get_transmat_switch(key);
+        if (matrices->transmat_switch_ref) {
+            matrices->transmat_switch = matrices->transmat_switch_ref.get();
+            matrices->trans_time += timer.time();
+            return;
+        }
+    }
+
+    LineageCounts lineages(model->ntimes, model->num_pops());
+    lineages.count(last_tree, model->pop_tree, internal);
+    matrices->transmat_switch = new TransMatrixSwitch(
+        matrices->nstates1, matrices->nstates2, model->num_pop_paths());
+    calc_transition_probs_switch(tree, last_tree,
+                                 tree_spr->spr, tree_spr->mapping,
+                                 last_states, states, model,
+                                 &lineages, matrices->transmat_switch,
+                                 internal);
+    matrices->transmat_switch_ref.reset(matrices->transmat_switch);
+    if (cache)
+        cache->add(key, matrices->transmat_switch_ref);
+    matrices->trans_time += timer.time();
+}
+
+
 // calculate transition and emission matrices for current block
 void calc_arghmm_matrices_internal(
     const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, int minage,
-    ArgHmmMatrices *matrices, PhaseProbs *phase_pr)
+    ArgHmmMatrices *matrices, PhaseProbs *phase_pr, LikelihoodCache *lk_cache,
+    TransMatrixCache *matrix_cache)
 {
     const bool internal = true;
 
@@ -18,7 +328,6 @@ void calc_arghmm_matrices_internal(
     matrices->blocklen = blocklen;
     const LocalTree *tree = tree_spr->tree;
 
-    LineageCounts lineages(model->ntimes, model->num_pops());  // only allocates
     States last_states;
     States states;
     matrices->states_model.set(model->ntimes, internal, minage, model->pop_tree);
@@ -47,7 +356,8 @@ void calc_arghmm_matrices_internal(
             }
         }
 	calc_emissions_internal(states, tree, subseqs, sub_base_probs, nleaves,
-                                blocklen, model, matrices->emit, phase_pr);
+                                blocklen, model, matrices->emit, phase_pr,
+                                lk_cache);
     } else {
         matrices->emit = NULL;
     }
@@ -64,25 +374,16 @@ void calc_arghmm_matrices_internal(
         matrices->states_model.get_coal_states(last_tree, last_states);
         matrices->nstates1 = last_states.size();
         matrices->nstates2 = nstates;
-        lineages.count(last_tree, model->pop_tree, internal);
 
         // calculate transmat_switch
-        matrices->transmat_switch = new TransMatrixSwitch(
-                      matrices->nstates1, matrices->nstates2,
-                      model->num_pop_paths());
-        calc_transition_probs_switch_internal(tree, last_tree,
-            tree_spr->spr, tree_spr->mapping,
-            last_states, states, model, &lineages,
-            matrices->transmat_switch);
+        calc_block_transmat_switch(model, last_tree_spr, tree_spr,
+                                   last_states, states, internal, matrices,
+                                   matrix_cache);
     }
 
-    // update lineages to current tree
-    lineages.count(tree, model->pop_tree, internal);
-
     // calculate transmat and use it for rest of block
-    matrices->transmat = new TransMatrix(model, nstates);
-    matrices->transmat->calc_transition_probs(tree, model, states, &lineages,
-                          internal, matrices->states_model.minage);
+    calc_block_transmat(model, tree, states, internal, matrices,
+                        matrix_cache);
 }
 
 
@@ -92,14 +393,14 @@ void calc_arghmm_matrices_external(
     const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, const int new_chrom,
-    ArgHmmMatrices *matrices, PhaseProbs *phase_pr, int start_pop)
+    ArgHmmMatrices *matrices, PhaseProbs *phase_pr, int start_pop,
+    LikelihoodCache *lk_cache, TransMatrixCache *matrix_cache)
 {
     // get block information
     const int blocklen = end - start;
     matrices->blocklen = blocklen;
     const LocalTree *tree = tree_spr->tree;
 
-    LineageCounts lineages(model->ntimes, model->num_pops());
     States last_states;
     States states;
     matrices->states_model.set(model->ntimes, false, 0, model->pop_tree,
@@ -129,7 +430,7 @@ void calc_arghmm_matrices_external(
         }
         calc_emissions_external(states, tree, subseqs, sub_base_probs,
                                 nleaves + 1, blocklen,
-                                model, matrices->emit, phase_pr);
+                                model, matrices->emit, phase_pr, lk_cache);
     } else {
         matrices->emit = NULL;
     }
@@ -146,26 +447,15 @@ void calc_arghmm_matrices_external(
         matrices->states_model.get_coal_states(last_tree, last_states);
         matrices->nstates1 = last_states.size();
         matrices->nstates2 = nstates;
-        lineages.count(last_tree, model->pop_tree);
 
         // calculate transmat_switch
-        matrices->transmat_switch = new TransMatrixSwitch(
-            matrices->nstates1, matrices->nstates2,
-            model->num_pop_paths());
-        calc_transition_probs_switch(tree, last_tree,
-                                     tree_spr->spr, tree_spr->mapping,
-                                     last_states, states, model,
-                                     &lineages, matrices->transmat_switch);
+        calc_block_transmat_switch(model, last_tree_spr, tree_spr,
+                                   last_states, states, false, matrices,
+                                   matrix_cache);
     }
 
-    // update lineages to current tree
-    lineages.count(tree, model->pop_tree);
-
     // calculate transmat and use it for rest of block
-    matrices->transmat = new TransMatrix(model, nstates);
-    matrices->transmat->calc_transition_probs(tree, model, states, &lineages,
-                                              false,
-                                              matrices->states_model.minage);
+    calc_block_transmat(model, tree, states, false, matrices, matrix_cache);
 }
 
 
@@ -175,17 +465,19 @@ void calc_arghmm_matrices(
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, const int new_chrom,
     const StatesModel &states_model, ArgHmmMatrices *matrices,
-    PhaseProbs *phase_pr, int start_pop)
+    PhaseProbs *phase_pr, int start_pop, LikelihoodCache *lk_cache,
+    TransMatrixCache *matrix_cache)
 {
     if (states_model.internal)
         calc_arghmm_matrices_internal(
             model, seqs, trees, last_tree_spr, tree_spr,
             start, end, states_model.minage, matrices,
-            phase_pr);
+            phase_pr, lk_cache, matrix_cache);
     else
         calc_arghmm_matrices_external(
             model, seqs, trees, last_tree_spr,  tree_spr,
-            start, end, new_chrom, matrices, phase_pr, start_pop);
+            start, end, new_chrom, matrices, phase_pr, start_pop, lk_cache,
+            matrix_cache);
 }
 
 
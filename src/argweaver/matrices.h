@@ -7,6 +7,10 @@
 
 // c++ includes
 #include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <string.h>
 
@@ -37,7 +41,8 @@ public:
         blocklen(0),
         transmat(NULL),
         transmat_switch(NULL),
-        emit(NULL)
+        emit(NULL),
+        trans_time(0.0)
     {}
 
     ArgHmmMatrices(int nstates1, int nstates2, int blocklen,
@@ -49,7 +54,8 @@ public:
         blocklen(blocklen),
         transmat(transmat),
         transmat_switch(transmat_switch),
-        emit(emit)
+        emit(emit),
+        trans_time(0.0)
     {}
 
     ~ArgHmmMatrices()
@@ -60,11 +66,17 @@ public:
     // delete all matrices
     void clear()
     {
-        if (transmat) {
+        if (transmat_ref) {
+            transmat_ref.reset();
+            transmat = NULL;
+        } else if (transmat) {
             delete transmat;
             transmat = NULL;
         }
-        if (transmat_switch) {
+        if (transmat_switch_ref) {
+            transmat_switch_ref.reset();
+            transmat_switch = NULL;
+        } else if (transmat_switch) {
             delete transmat_switch;
             transmat_switch = NULL;
         }
@@ -72,6 +84,7 @@ public:
             delete_matrix<double>(emit, blocklen);
             emit = NULL;
         }
+        trans_time = 0.0;
     }
 
     // release ownership of underlying data
@@ -79,6 +92,8 @@ public:
     {
         transmat = NULL;
         transmat_switch = NULL;
+        transmat_ref.reset();
+        transmat_switch_ref.reset();
         emit = NULL;
     }
 
@@ -95,16 +110,153 @@ public:
     TransMatrix* transmat; // transition matrix within this block
     TransMatrixSwitch* transmat_switch; // transition matrix from previous block
     double **emit; // emission matrix
+    double trans_time; // seconds spent computing transmat and transmat_switch
+
+    // set if the transition matrices are shared with a TransMatrixCache
+    // or TransMatrixStore
+    shared_ptr<TransMatrix> transmat_ref;
+    shared_ptr<TransMatrixSwitch> transmat_switch_ref;
 };
 
 
+// A least-recently-used cache of transition matrices.
+//
+// Matrices are keyed by get_transmat_key() and get_transmat_switch_key(),
+// so blocks with the same local model and lineage counts share one
+// TransMatrix.  Matrices stay valid while an ArgHmmMatrices refers to
+// them, even after being evicted.  A cache may be shared by threads.
+// All caches of the process share max_bytes as one budget.
+class TransMatrixCache
+{
+public:
+    TransMatrixCache(double max_bytes=0) :
+        max_bytes(max_bytes),
+        nbytes(0),
+        nhits(0),
+        nmisses(0)
+    {}
+
+    ~TransMatrixCache();
+
+    bool enabled() const
+    {
+        return max_bytes > 0;
+    }
+
+    // returns the matrix stored under 'key', or NULL
+    shared_ptr<TransMatrix> get_transmat(const string &key);
+    shared_ptr<TransMatrixSwitch> get_transmat_switch(const string &key);
+
+    // store a matrix under 'key'
+    void add(const string &key, const shared_ptr<TransMatrix> &matrix);
+    void add(const string &key, const shared_ptr<TransMatrixSwitch> &matrix);
+
+    void clear();
+
+    long get_num_hits() const { return nhits; }
+    long get_num_misses() const { return nmisses; }
+
+protected:
+    struct Entry
+    {
+        string key;
+        shared_ptr<TransMatrix> transmat;
+        shared_ptr<TransMatrixSwitch> transmat_switch;
+        size_t nbytes;
+    };
+    typedef list<Entry>::iterator EntryIter;
+
+    Entry *lookup(const string &key);
+    void insert(Entry &entry);
+    void evict();
+
+    double max_bytes;
+    size_t nbytes;
+    mutex lock;
+    list<Entry> entries;  // most recently used first
+    unordered_map<string, EntryIter> index;
+    long nhits;
+    long nmisses;
+};
+
+
+// returns the number of transition matrices found in and added to
+// matrix caches
+void get_matrix_cache_counts(long *nhits, long *nmisses);
+
+
+// The transition matrices of each block of one threading.
+//
+// Matrices built by the forward algorithm are kept by block index so that
+// traceback and recombination sampling replay them instead of rebuilding
+// them.  Blocks are stored as they are first computed until 'max_bytes' is
+// reached, counting the blocks of all stores of the process; later blocks
+// are recomputed whenever they are needed.
+class TransMatrixStore
+{
+public:
+    TransMatrixStore(double max_bytes=0) :
+        max_bytes(max_bytes),
+        nbytes(0),
+        nstored(0),
+        nreused(0),
+        time_saved(0.0)
+    {}
+
+    ~TransMatrixStore();
+
+    bool enabled() const
+    {
+        return max_bytes > 0;
+    }
+
+    // sets the transition matrices of block 'index' in 'matrices' and
+    // returns true, if the block is stored
+    bool get(int index, ArgHmmMatrices *matrices);
+
+    // stores the transition matrices of block 'index'
+    void add(int index, const ArgHmmMatrices &matrices);
+
+    void clear();
+
+    int get_num_stored() const { return nstored; }
+    int get_num_reused() const { return nreused; }
+    double get_time_saved() const { return time_saved; }
+
+protected:
+    struct Entry
+    {
+        Entry() : stored(false), trans_time(0.0) {}
+
+        bool stored;
+        shared_ptr<TransMatrix> transmat;
+        shared_ptr<TransMatrixSwitch> transmat_switch;
+        double trans_time;
+    };
+
+    double max_bytes;
+    size_t nbytes;
+    mutex lock;
+    vector<Entry> entries;
+    int nstored;
+    int nreused;
+    double time_saved;
+};
+
+
+// returns the number of blocks whose transition matrices were replayed
+// from matrix stores, and the time spent building them originally
+void get_matrix_store_counts(long *nreused, double *time_saved);
+
+
 void calc_arghmm_matrices(
     const ArgModel *model, const Sequences *seqs,
     const LocalTrees *trees,
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, const int new_chrom,
     const StatesModel &states_model, ArgHmmMatrices *matrices,
-    PhaseProbs *phase_pr, int start_pop);
+    PhaseProbs *phase_pr, int start_pop, LikelihoodCache *lk_cache=NULL,
+    TransMatrixCache *matrix_cache=NULL);
 
 
 
@@ -223,6 +375,10 @@ public:
         seqs(seqs),
         trees(trees),
         new_chrom(_new_chrom),
+        own_matrix_cache(model->forward_table.matrix_cache),
+        matrix_cache(&own_matrix_cache),
+        own_matrix_store(model->forward_table.matrix_store),
+        matrix_store(&own_matrix_store),
         blocks(model, trees)
     {
         if (new_chrom == -1)
@@ -255,6 +411,25 @@ public:
         states_model.set_start_pop(start_pop, model->pop_tree);
     }
 
+    // share the transition matrices of another iterator over the same ARG
+    void set_matrix_cache(TransMatrixCache *cache) {
+        matrix_cache = cache;
+    }
+
+    TransMatrixCache *get_matrix_cache() {
+        return matrix_cache;
+    }
+
+    // replay the transition matrices computed by another iterator over
+    // the same ARG and states
+    void set_matrix_store(TransMatrixStore *store) {
+        matrix_store = store;
+    }
+
+    TransMatrixStore *get_matrix_store() {
+        return matrix_store;
+    }
+
     //==================================================
     // iteration methods
 
@@ -352,17 +527,31 @@ public:
 protected:
 
     void calc_matrices(ArgHmmMatrices *matrices, PhaseProbs *phase_pr = NULL)
+    {
+        calc_matrices(matrices, block_index, phase_pr, &lk_cache);
+    }
+
+    // calculate the matrices of block 'index'
+    void calc_matrices(ArgHmmMatrices *matrices, int index,
+                       PhaseProbs *phase_pr, LikelihoodCache *lk_cache)
     {
         ArgModel local_model;
-        ArgModelBlock &block = blocks.at(block_index);
+        const ArgModelBlock &block = blocks.at(index);
 
         model->get_local_model_index(block.model_index, local_model);
-        const LocalTreeSpr * last_tree_spr = get_last_tree_spr();
+        const LocalTreeSpr * last_tree_spr =
+            index > 0 ? blocks.at(index-1).tree_spr : NULL;
+        const bool use_store = matrix_store->enabled();
+        const bool stored = use_store && matrix_store->get(index, matrices);
 
         argweaver::calc_arghmm_matrices(
             &local_model, seqs, trees, last_tree_spr, block.tree_spr,
             block.start, block.end, new_chrom, states_model, matrices,
-	    phase_pr, start_pop);
+	    phase_pr, start_pop, lk_cache,
+            matrix_cache->enabled() ? matrix_cache : NULL);
+
+        if (use_store && !stored)
+            matrix_store->add(index, *matrices);
     }
 
 
@@ -375,6 +564,17 @@ protected:
 
     ArgHmmMatrices mat;
 
+    // likelihood tables of the previous block's site patterns
+    LikelihoodCache lk_cache;
+
+    // transition matrices of recent blocks
+    TransMatrixCache own_matrix_cache;
+    TransMatrixCache *matrix_cache;
+
+    // transition matrices of the blocks of this threading
+    TransMatrixStore own_matrix_store;
+    TransMatrixStore *matrix_store;
+
     // record of common blocks
     ArgModelBlocks blocks;
     int block_index;
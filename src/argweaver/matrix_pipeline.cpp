@@ -0,0 +1,157 @@
+
+#include "forward_kernel.h"
+#include "matrix_pipeline.h"
+
+
+namespace argweaver {
+
+
+ArgHmmMatrixPipeline::ArgHmmMatrixPipeline(
+    const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
+    int new_chrom, int nthreads, int lookahead) :
+    ArgHmmMatrixIter(model, seqs, trees, new_chrom),
+    nthreads(nthreads >= 0 ? nthreads : model->forward_table.matrix_threads),
+    lookahead(max(1, lookahead >= 0 ? lookahead :
+                  model->forward_table.matrix_lookahead)),
+    forward(false),
+    running(false),
+    stopping(false),
+    consumed(0),
+    slots(this->lookahead),
+    lk_caches(this->nthreads)
+{}
+
+
+ArgHmmMatrixPipeline::~ArgHmmMatrixPipeline()
+{
+    stop();
+}
+
+
+void ArgHmmMatrixPipeline::begin()
+{
+    stop();
+    ArgHmmMatrixIter::begin();
+    forward = true;
+}
+
+
+void ArgHmmMatrixPipeline::rbegin()
+{
+    stop();
+    forward = false;
+    ArgHmmMatrixIter::rbegin();
+}
+
+
+bool ArgHmmMatrixPipeline::next()
+{
+    if (running) {
+        // release the slot of the current block
+        {
+            lock_guard<mutex> guard(lock);
+            consumed = block_index + 1;
+        }
+        freed.notify_all();
+    }
+    return ArgHmmMatrixIter::next();
+}
+
+
+bool ArgHmmMatrixPipeline::prev()
+{
+    stop();
+    forward = false;
+    return ArgHmmMatrixIter::prev();
+}
+
+
+ArgHmmMatrices &ArgHmmMatrixPipeline::ref_matrices(PhaseProbs *phase_pr)
+{
+    // emissions of unphased data depend on phase_pr, which changes during
+    // sampling, so they are always computed inline
+    if (nthreads <= 0 || !forward || phase_pr != NULL)
+        return ArgHmmMatrixIter::ref_matrices(phase_pr);
+
+    if (!running)
+        start();
+
+    unique_lock<mutex> guard(lock);
+    Slot &slot = slots[block_index % lookahead];
+    while (slot.block != block_index)
+        ready.wait(guard);
+    return slot.mat;
+}
+
+
+// start computing blocks from the current block onwards
+void ArgHmmMatrixPipeline::start()
+{
+    // select the kernels before workers use them
+    get_forward_kernel();
+
+    for (unsigned int i=0; i<lk_caches.size(); i++)
+        lk_caches[i].clear();
+    consumed = block_index;
+    running = true;
+    for (int i=0; i<nthreads; i++)
+        workers.push_back(thread(&ArgHmmMatrixPipeline::run_worker, this,
+                                 i, block_index));
+
+    printLog(LOG_HIGH, "matrix pipeline: %d threads, %d blocks ahead\n",
+             nthreads, lookahead);
+}
+
+
+// wait for all workers and discard computed matrices
+void ArgHmmMatrixPipeline::stop()
+{
+    if (!running)
+        return;
+
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    freed.notify_all();
+    for (unsigned int i=0; i<workers.size(); i++)
+        workers[i].join();
+    workers.clear();
+
+    for (unsigned int i=0; i<slots.size(); i++) {
+        slots[i].mat.clear();
+        slots[i].block = -1;
+    }
+    stopping = false;
+    running = false;
+}
+
+
+void ArgHmmMatrixPipeline::run_worker(int worker, int first)
+{
+    const int nblocks = blocks.size();
+    for (int i=first + worker; i<nblocks; i+=nthreads) {
+        Slot &slot = slots[i % lookahead];
+
+        // wait until the slot's previous block has been used
+        {
+            unique_lock<mutex> guard(lock);
+            while (!stopping && i >= consumed + lookahead)
+                freed.wait(guard);
+            if (stopping)
+                return;
+        }
+
+        slot.mat.clear();
+        calc_matrices(&slot.mat, i, NULL, &lk_caches[worker]);
+
+        {
+            lock_guard<mutex> guard(lock);
+            slot.block = i;
+        }
+        ready.notify_all();
+    }
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,92 @@
+//=============================================================================
+// Computing matrices ahead of the forward algorithm
+//
+// The emission and transition matrices of a block do not depend on the
+// forward table, so while the forward algorithm runs over one block the
+// matrices of the following blocks can be computed on worker threads.
+// Worker w computes blocks w, w + nthreads, ... into a ring of 'lookahead'
+// slots, and the iterator hands them out in order.
+//
+// Only forward iteration is pipelined.  rbegin(), prev() and matrices that
+// depend on phase probabilities fall back to ArgHmmMatrixIter, so the same
+// iterator can be reused for traceback.  Workers keep their own
+// LikelihoodCache and share the TransMatrixCache of the iterator, and the
+// matrices are identical to those computed inline.
+
+#ifndef ARGWEAVER_MATRIX_PIPELINE_H
+#define ARGWEAVER_MATRIX_PIPELINE_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "matrices.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+class ArgHmmMatrixPipeline : public ArgHmmMatrixIter
+{
+public:
+    // nthreads and lookahead default to model->forward_table
+    ArgHmmMatrixPipeline(const ArgModel *model, const Sequences *seqs,
+                         const LocalTrees *trees, int new_chrom=-1,
+                         int nthreads=-1, int lookahead=-1);
+    virtual ~ArgHmmMatrixPipeline();
+
+    //==================================================
+    // iteration methods
+
+    virtual void begin();
+    virtual void rbegin();
+    virtual bool next();
+    virtual bool prev();
+
+    //==================================================
+    // accessors
+
+    virtual ArgHmmMatrices &ref_matrices(PhaseProbs *phase_pr = NULL);
+
+    bool is_running() const {
+        return running;
+    }
+
+protected:
+    struct Slot
+    {
+        Slot() : block(-1) {}
+
+        ArgHmmMatrices mat;
+        int block;  // block stored in mat, or -1
+    };
+
+    void start();
+    void stop();
+    // compute blocks first + worker, first + worker + nthreads, ...
+    void run_worker(int worker, int first);
+
+    const int nthreads;
+    const int lookahead;
+
+    // true between begin() and the first backward step
+    bool forward;
+    bool running;
+    bool stopping;
+    int consumed;  // first block whose slot is still in use
+
+    vector<Slot> slots;
+    vector<LikelihoodCache> lk_caches;
+    vector<thread> workers;
+    mutex lock;
+    condition_variable ready;  // a slot was filled
+    condition_variable freed;  // a slot was released
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_MATRIX_PIPELINE_H
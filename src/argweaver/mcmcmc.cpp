@@ -2,17 +2,21 @@
 #include "mpi.h"
 #endif
 
+#include <math.h>
+#include <algorithm>
+
+#include "common.h"
 #include "mcmcmc.h"
 
 namespace argweaver {
 
  Mc3Config::Mc3Config(int group, double heat_interval) :
-        group(group), heat_interval(heat_interval) {
+        group(group), max_group(0), heat_interval(heat_interval) {
+    heat = 1.0 - heat_interval * group;
 #ifdef ARGWEAVER_MPI
     int numthread=MPI::COMM_WORLD.Get_size();
     int *groups = (int*)malloc(numthread*sizeof(int));
     MPI::COMM_WORLD.Allgather(&group, 1, MPI::INT, groups, 1, MPI::INT);
-    heat = 1.0 - heat_interval * group;
     group_comm = new MPI::Intracomm(MPI::COMM_WORLD.Split(group, 0));
 
     //check that configuration makes sense.
@@ -43,4 +47,85 @@ namespace argweaver {
     free(groups);
 #endif
 }
+
+
+Mc3Exchange::Mc3Exchange(int ngroups, double heat_interval, int niters,
+                         unsigned long long seed) :
+    ngroups(ngroups),
+    heat_interval(heat_interval),
+    pairs(niters + 1),
+    uniforms(niters + 1),
+    attempts(ngroups * ngroups, 0),
+    accepts(ngroups * ngroups, 0)
+{
+    // draw pairs as mcmcmc_swap does for MPI
+    RandomStream stream(seed);
+    ScopedRandomStream scoped(&stream);
+    for (int i=0; i<=niters; i++) {
+        int group1 = irand(ngroups);
+        int group2 = irand(ngroups - 1);
+        if (group2 >= group1)
+            group2++;
+        pairs[i] = std::make_pair(group1, group2);
+        uniforms[i] = frand();
+    }
+}
+
+
+bool Mc3Exchange::swap(int iter, int group, double logp,
+                       double *accept_ratio)
+{
+    const std::pair<int, int> &pair = pairs[iter];
+    assert(group == pair.first || group == pair.second);
+    const int side = (group == pair.first ? 0 : 1);
+
+    std::unique_lock<std::mutex> guard(lock);
+    Offer &offer = offers[iter];
+    offer.logp[side] = logp;
+    offer.posted[side] = true;
+
+    if (offer.posted[1 - side]) {
+        // the second chain to arrive decides
+        const double heat1 = get_heat(pair.first);
+        const double heat2 = get_heat(pair.second);
+        offer.accept_ratio = (heat1 - heat2) * offer.logp[1] +
+            (heat2 - heat1) * offer.logp[0];
+        offer.accept = (offer.accept_ratio >= 0.0 ||
+                        uniforms[iter] < exp(offer.accept_ratio));
+        offer.decided = true;
+
+        const int low = std::min(pair.first, pair.second);
+        const int high = std::max(pair.first, pair.second);
+        attempts[low * ngroups + high]++;
+        if (offer.accept)
+            accepts[low * ngroups + high]++;
+        decided.notify_all();
+    } else {
+        while (!offer.decided)
+            decided.wait(guard);
+    }
+
+    const bool accept = offer.accept;
+    *accept_ratio = offer.accept_ratio;
+    if (++offer.nread == 2)
+        offers.erase(iter);
+    return accept;
+}
+
+
+void Mc3Exchange::log_stats(int level) const
+{
+    for (int i=0; i<ngroups; i++) {
+        for (int j=i+1; j<ngroups; j++) {
+            const long n = attempts[i * ngroups + j];
+            if (n == 0)
+                continue;
+            const long k = accepts[i * ngroups + j];
+            printLog(level, "mc3 swaps %d <-> %d (heat %.3f <-> %.3f):"
+                     " %ld of %ld accepted (%.1f%%)\n",
+                     i, j, get_heat(i), get_heat(j), k, n, 100.0 * k / n);
+        }
+    }
 }
+
+} // namespace argweaver
@@ -1,6 +1,11 @@
 #ifndef ARGWEAVER_MCMCMC_H
 #define ARGWEAVER_MCMCMC_H
 
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <vector>
+
 #include "logging.h"
 
 #ifdef ARGWEAVER_MPI
@@ -34,6 +39,64 @@ class Mc3Config
 #endif
 };
 
+
+// Exchanges heats between (MC)^3 chains that run as threads of one process
+//
+// Every chain calls swap() once per iteration.  The two groups that may
+// swap at each iteration, and the uniform deciding whether they do, are
+// drawn up front from the seed, so the outcome does not depend on how the
+// chains are scheduled.  Only the two chains of a pair wait for each other.
+class Mc3Exchange
+{
+public:
+    Mc3Exchange(int ngroups, double heat_interval, int niters,
+                unsigned long long seed);
+
+    double get_heat(int group) const {
+        return 1.0 - heat_interval * group;
+    }
+
+    // groups that may swap at iteration iter
+    void get_pair(int iter, int *group1, int *group2) const {
+        *group1 = pairs[iter].first;
+        *group2 = pairs[iter].second;
+    }
+
+    // Offer the state of the chain in 'group' (which must be in the pair
+    // of iteration iter) with log posterior 'logp'.  Returns true if the
+    // two chains of the pair exchange heats.
+    bool swap(int iter, int group, double logp, double *accept_ratio);
+
+    // log acceptance rate of each pair of groups
+    void log_stats(int level) const;
+
+    const int ngroups;
+    const double heat_interval;
+
+protected:
+    struct Offer
+    {
+        Offer() : decided(false), nread(0) {
+            posted[0] = posted[1] = false;
+        }
+
+        double logp[2];
+        bool posted[2];
+        bool decided;
+        bool accept;
+        double accept_ratio;
+        int nread;
+    };
+
+    std::vector<std::pair<int, int> > pairs;
+    std::vector<double> uniforms;
+    std::map<int, Offer> offers;  // pending swaps by iteration
+    std::vector<long> attempts;   // indexed by group1 * ngroups + group2
+    std::vector<long> accepts;
+    std::mutex lock;
+    std::condition_variable decided;
+};
+
 } //namespace argweaver
 
 #endif
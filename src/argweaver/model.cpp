@@ -180,6 +180,7 @@ void ArgModel::copy(const ArgModel &other) {
     unphased_file = other.unphased_file;
     popsize_config = other.popsize_config;
     mc3 = other.mc3;
+    forward_table = other.forward_table;
     smc_prime = other.smc_prime;
 
     if (other.pop_tree)
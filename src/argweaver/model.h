@@ -140,6 +140,47 @@ class PopsizeConfig
 };
 
 
+// storage modes for the forward table used while threading
+enum ForwardTableMode {
+    FORWARD_TABLE_AUTO=0,     // full, float or checkpoint by memory_budget
+    FORWARD_TABLE_FULL,       // keep every column of the forward table
+    FORWARD_TABLE_CHECKPOINT, // keep checkpoint columns, recompute the rest
+    FORWARD_TABLE_FLOAT       // keep every column in single precision
+};
+
+
+// options controlling how forward tables and matrices are stored during
+// threading
+class ForwardTableConfig
+{
+ public:
+    ForwardTableConfig() :
+        mode(FORWARD_TABLE_AUTO),
+        memory_budget(0),
+        checkpoint_spacing(0),
+        skip_invariant(false),
+        matrix_cache(0),
+        matrix_store(0),
+        matrix_threads(0),
+        matrix_lookahead(16)
+    {}
+
+    ForwardTableMode mode;
+    double memory_budget;   // max bytes for a full table (0 = no limit)
+    int checkpoint_spacing; // columns between checkpoints (0 = sqrt(length))
+    bool skip_invariant;    // jump over runs of identical sites
+    double matrix_cache;    // max bytes of cached transition matrices,
+                            // shared by all threadings (0 = no cache)
+    double matrix_store;    // max bytes of transition matrices kept from
+                            // the forward algorithm for traceback and
+                            // recombination sampling, shared by all
+                            // threadings (0 = recompute)
+    int matrix_threads;     // threads computing matrices ahead of the
+                            // forward algorithm (0 = compute inline)
+    int matrix_lookahead;   // max blocks computed ahead
+};
+
+
 // The model parameters and time discretization scheme
 class ArgModel
 {
@@ -241,6 +282,7 @@ class ArgModel
     unphased_file(other.unphased_file),
     popsize_config(other.popsize_config),
     mc3(other.mc3),
+    forward_table(other.forward_table),
     pop_tree(other.pop_tree),
     smc_prime(other.smc_prime) {}
 
@@ -258,6 +300,7 @@ class ArgModel
         unphased_file(other.unphased_file),
         popsize_config(other.popsize_config),
         mc3(other.mc3),
+        forward_table(other.forward_table),
         smc_prime(other.smc_prime)
     {
         copy(other);
@@ -588,6 +631,7 @@ protected:
     string unphased_file;
     PopsizeConfig popsize_config;
     Mc3Config mc3;
+    ForwardTableConfig forward_table;
     Track<double> mutmap;    // mutation map
     Track<double> recombmap; // recombination map
     PopulationTree *pop_tree;
@@ -0,0 +1,271 @@
+//=============================================================================
+// Position index of local trees
+//
+// Finding the local tree at a position means walking the list of local
+// trees from its start and summing block lengths, which makes every region
+// lookup, and every partition of an ARG into windows, linear in the number
+// of trees.  A PositionIndex keeps the blocks of an ARG in a treap, a binary
+// tree in block order that is balanced by random priorities, where each
+// node holds the start coordinate of its block and its list iterator.
+// Block coordinates are absolute, so a position is found by its start
+// coordinate in O(log n) time, and splitting an ARG in two or appending one
+// ARG to another splits or joins their indexes in O(log n) time as well.
+// Nodes also count their subtree, so blocks are addressed by their rank,
+// which stays well defined when a block of length zero shares its start.
+//
+// The priority of a node is a hash of the start coordinate its block had
+// when the node was made, so that an index does not draw from the random
+// streams of the sampler.
+
+#ifndef ARGWEAVER_POSITION_INDEX_H
+#define ARGWEAVER_POSITION_INDEX_H
+
+#include <stdint.h>
+#include <new>
+#include <vector>
+
+#include "slab.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+template <class Iterator>
+class PositionIndex
+{
+public:
+    PositionIndex() : root(NULL) {}
+    ~PositionIndex() { clear(); }
+
+    // the iterators of an index belong to one list, so a copy starts empty
+    PositionIndex(const PositionIndex &/*other*/) : root(NULL) {}
+    PositionIndex &operator=(const PositionIndex &/*other*/)
+    {
+        clear();
+        return *this;
+    }
+
+    void clear()
+    {
+        free_nodes(root);
+        root = NULL;
+    }
+
+    void swap(PositionIndex &other) { std::swap(root, other.root); }
+
+    // number of blocks
+    int size() const { return get_size(root); }
+
+    // index the blocks [begin, end) whose first block starts at start
+    void build(Iterator begin, Iterator end, int start)
+    {
+        clear();
+
+        // make the treap from the right spine up in linear time
+        vector<Node*> spine;
+        for (Iterator it=begin; it != end; ++it) {
+            Node *node = new_node(start, it);
+            start += it->blocklen;
+
+            Node *last = NULL;
+            while (!spine.empty() &&
+                   spine.back()->priority < node->priority) {
+                last = spine.back();
+                spine.pop_back();
+            }
+            node->left = last;
+            if (!spine.empty())
+                spine.back()->right = node;
+            spine.push_back(node);
+        }
+        if (!spine.empty()) {
+            root = spine.front();
+            update_sizes(root);
+        }
+    }
+
+    // find the last block starting at or before pos; returns false if
+    // every block starts after pos
+    bool find(int pos, int *start, Iterator *it, int *rank) const
+    {
+        const Node *best = NULL;
+        int best_rank = -1;
+        int before = 0;
+        for (const Node *node = root; node;) {
+            if (node->start <= pos) {
+                best = node;
+                best_rank = before + get_size(node->left);
+                before = best_rank + 1;
+                node = node->right;
+            } else {
+                node = node->left;
+            }
+        }
+
+        if (!best)
+            return false;
+        *start = best->start;
+        *it = best->it;
+        *rank = best_rank;
+        return true;
+    }
+
+    // get the block of a rank
+    void get(int rank, int *start, Iterator *it) const
+    {
+        const Node *node = find_rank(rank);
+        *start = node->start;
+        *it = node->it;
+    }
+
+    // set the start and iterator of the block of a rank; the start must
+    // stay between the starts of its neighbors
+    void set(int rank, int start, Iterator it)
+    {
+        Node *node = find_rank(rank);
+        node->start = start;
+        node->it = it;
+    }
+
+    // add a block after the last one
+    void push_back(int start, Iterator it)
+    {
+        root = merge(root, new_node(start, it));
+    }
+
+    // remove the block of a rank
+    void erase(int rank)
+    {
+        Node *left, *mid, *right;
+        split_nodes(root, rank, &left, &right);
+        split_nodes(right, 1, &mid, &right);
+        free_nodes(mid);
+        root = merge(left, right);
+    }
+
+    // move the blocks from rank on into other, which must be empty
+    void split(int rank, PositionIndex &other)
+    {
+        other.clear();
+        split_nodes(root, rank, &root, &other.root);
+    }
+
+    // move the blocks of other after the last block here
+    void append(PositionIndex &other)
+    {
+        root = merge(root, other.root);
+        other.root = NULL;
+    }
+
+protected:
+    struct Node
+    {
+        int start;
+        Iterator it;
+        uint32_t priority;
+        int size;
+        Node *left;
+        Node *right;
+    };
+
+    static int get_size(const Node *node) { return node ? node->size : 0; }
+
+    static void update(Node *node)
+    {
+        node->size = 1 + get_size(node->left) + get_size(node->right);
+    }
+
+    static int update_sizes(Node *node)
+    {
+        if (!node)
+            return 0;
+        node->size = 1 + update_sizes(node->left) + update_sizes(node->right);
+        return node->size;
+    }
+
+    static Node *new_node(int start, Iterator it)
+    {
+        // mix the bits of the start coordinate into a priority
+        uint64_t h = (uint64_t) start + 0x9e3779b97f4a7c15ULL;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+
+        Node *node = new (SlabAllocator<Node>().allocate(1)) Node;
+        node->start = start;
+        node->it = it;
+        node->priority = (uint32_t) h;
+        node->size = 1;
+        node->left = node->right = NULL;
+        return node;
+    }
+
+    static void free_nodes(Node *node)
+    {
+        if (!node)
+            return;
+        free_nodes(node->left);
+        free_nodes(node->right);
+        node->~Node();
+        SlabAllocator<Node>().deallocate(node, 1);
+    }
+
+    Node *find_rank(int rank) const
+    {
+        Node *node = root;
+        while (true) {
+            const int nleft = get_size(node->left);
+            if (rank == nleft)
+                return node;
+            if (rank < nleft) {
+                node = node->left;
+            } else {
+                rank -= nleft + 1;
+                node = node->right;
+            }
+        }
+    }
+
+    // split the first n blocks under node from the rest
+    static void split_nodes(Node *node, int n, Node **left, Node **right)
+    {
+        if (!node) {
+            *left = *right = NULL;
+        } else if (get_size(node->left) >= n) {
+            split_nodes(node->left, n, left, &node->left);
+            update(node);
+            *right = node;
+        } else {
+            split_nodes(node->right, n - get_size(node->left) - 1,
+                        &node->right, right);
+            update(node);
+            *left = node;
+        }
+    }
+
+    static Node *merge(Node *left, Node *right)
+    {
+        if (!left)
+            return right;
+        if (!right)
+            return left;
+        if (left->priority > right->priority) {
+            left->right = merge(left->right, right);
+            update(left);
+            return left;
+        } else {
+            right->left = merge(left, right->left);
+            update(right);
+            return right;
+        }
+    }
+
+    Node *root;
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_POSITION_INDEX_H
@@ -3,6 +3,8 @@
 //
 
 // c++ includes
+#include <atomic>
+#include <thread>
 #include <vector>
 
 // arghmm includes
@@ -27,7 +29,6 @@ void sample_arg_seq(const ArgModel *model, Sequences *sequences,
                     LocalTrees *trees, bool random, int num_buildup)
 {
     const int nseqs = sequences->get_num_seqs();
-    const int seqlen = sequences->length();
 
     vector<int> seqids;
     for (int i=0; i<nseqs; i++)
@@ -35,6 +36,19 @@ void sample_arg_seq(const ArgModel *model, Sequences *sequences,
     if (random)
         shuffle(&seqids[0], seqids.size());
 
+    sample_arg_seq(model, sequences, trees, seqids, num_buildup);
+}
+
+
+// sequentially sample an ARG from scratch, adding sequences in the order of
+// seqids
+void sample_arg_seq(const ArgModel *model, Sequences *sequences,
+                    LocalTrees *trees, const vector<int> &seqids,
+                    int num_buildup)
+{
+    const int nseqs = sequences->get_num_seqs();
+    const int seqlen = sequences->length();
+
     if (trees->get_num_leaves() == 0) {
         // initialize ARG as trunk
         const int capacity = 2 * sequences->get_num_seqs() - 1;
@@ -172,7 +186,7 @@ bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
     double accept_prob = exp(npaths - npaths2);
     bool accept = (frand() < accept_prob);
     if (!accept)
-        trees->copy(trees2);
+        trees->swap(trees2);
 
     // logging
     printLog(LOG_LOW, "accept_prob = exp(%lf - %lf) = %f, accept = %d\n",
@@ -190,7 +204,8 @@ bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
 void resample_arg_mcmc_all(const ArgModel *model, Sequences *sequences,
                            LocalTrees *trees, bool do_leaf,
                            int window, int niters, double heat,
-                           bool no_resample_mig)
+                           bool no_resample_mig, int nthreads,
+                           WindowSchedule *schedule)
 {
     if (do_leaf) {
         resample_arg_random_leaf(model, sequences, trees);
@@ -231,7 +246,8 @@ void resample_arg_mcmc_all(const ArgModel *model, Sequences *sequences,
                      time_interval, sequences->names[hap].c_str(), num_break);
         } else {
             double accept_rate = resample_arg_regions(
-              model, sequences, trees, window, niters, heat);
+              model, sequences, trees, window, niters, heat, nthreads,
+              schedule);
             printLog(LOG_LOW, "resample_arg_regions: accept=%f\n", accept_rate);
         }
     }
@@ -471,7 +487,6 @@ int resample_arg_by_time_and_hap(
     LocalTrees *trees, int time_interval, int hap)
 {
     const int maxtime = model->get_removed_root_time();
-    static int count=0;
     const bool open_ended=true;
     LocalTrees orig_trees;
     decLogLevel();
@@ -488,7 +503,6 @@ int resample_arg_by_time_and_hap(
                                          break_coords);
     int num_break = (int)break_coords.size();
     for (int i=0; i <= num_break; i++) {
-        count++;
         int region_start, region_end;
         if (i == 0) {
             region_start = trees->start_coord;
@@ -513,10 +527,11 @@ int resample_arg_by_time_and_hap(
         if (i != num_break) {
             if (trees2->trees.back().blocklen == 0) {
                 stub_spr = trees2->back().spr;
-                stub_mapping = new int[trees2->nnodes];
+                stub_mapping = alloc_node_mapping(trees2->nnodes);
                 for (int j=0; j < trees2->nnodes; j++)
                     stub_mapping[j] = trees2->back().mapping[j];
                 trees2->trees.pop_back();
+                trees2->invalidate_index();
             }
             assert(trees2->trees.back().blocklen == 1);
         }
@@ -549,7 +564,7 @@ int resample_arg_by_time_and_hap(
                 // same as above (except for beginning state)
                 // the removal node at first tree does not matter
                 int prev_nodes[2];
-                list<LocalTreeSpr>::iterator it = trees2->begin();
+                LocalTrees::iterator it = trees2->begin();
                 ++it;
                 get_prev_removal_nodes(trees2->front().tree,
                                        it->tree, it->spr,
@@ -620,31 +635,16 @@ int resample_arg_by_time_and_hap(
 }
 
 
-// resample an ARG only for a given region
-// all branches are possible to resample
-// open_ended -- If true and region touches start or end of local trees do not
-//               conditioned on state.
-double resample_arg_region(
-    const ArgModel *model, Sequences *sequences,
-    LocalTrees *trees, int region_start, int region_end, int niters,
-    bool open_ended, double heat)
+// resample the internal branches of a window of the ARG, conditioned on
+// the threading at its ends unless open_start/open_end are set
+// returns the number of accepted iterations
+static int resample_arg_window(
+    const ArgModel *model, const Sequences *sequences, LocalTrees *trees2,
+    int niters, bool open_start, bool open_end, double heat)
 {
     const int maxtime = model->get_removed_root_time();
-    static int count=0;
-
-    // special case: zero length region
-    if (region_start == region_end)
-        return 1.0;
-
-    // assert region is within trees
-    assert(region_start >= trees->start_coord);
-    assert(region_end <= trees->end_coord);
-    assert(region_start < region_end);
-
-    // partion trees into three segments
-    LocalTrees *trees2 = partition_local_trees(trees, region_start);
-    LocalTrees *trees3 = partition_local_trees(trees2, region_end);
-    assert(trees2->length() == region_end - region_start);
+    const int region_start = trees2->start_coord;
+    const int region_end = trees2->end_coord;
 
     // TODO: refactor
     // extend stub (zero length block) if it happens to exist
@@ -656,14 +656,15 @@ double resample_arg_region(
 
 
     // perform several iterations of resampling
+    // the saved copy of the trees is kept across iterations so that its
+    // trees are reused, and is swapped back in on rejection
     int accepts = 0;
+    LocalTrees old_trees2;
     for (int i=0; i<niters; i++) {
-        count++;
         printLog(LOG_LOW, "region sample: iter=%d, region=(%d, %d)\n",
                  i, region_start, region_end);
 
         // save a copy of the local trees
-        LocalTrees old_trees2;
         old_trees2.copy(*trees2);
 
         // get starting and ending trees
@@ -687,12 +688,11 @@ double resample_arg_region(
             &end_tree, end_tree_partial, maxtime);
 
         // set start/end state to null if open ended is requested
-        if (open_ended) {
-            if (region_start == trees->start_coord)
-                start_state.set_null();
-            if (region_end == trees3->end_coord)
-                end_state.set_null();
-        }
+        if (open_start)
+            start_state.set_null();
+        if (open_end)
+            end_state.set_null();
+
         // sample new ARG conditional on start and end states
         decLogLevel();
         cond_sample_arg_thread_internal(model, sequences, trees2,
@@ -707,7 +707,7 @@ double resample_arg_region(
         bool accept = (frand() < accept_prob);
 
         if (!accept) {
-            trees2->copy(old_trees2);
+            trees2->swap(old_trees2);
         } else {
             accepts++;
         }
@@ -725,6 +725,38 @@ double resample_arg_region(
         trees2->end_coord--;
     }
 
+    return accepts;
+}
+
+
+// resample an ARG only for a given region
+// all branches are possible to resample
+// open_ended -- If true and region touches start or end of local trees do not
+//               conditioned on state.
+double resample_arg_region(
+    const ArgModel *model, Sequences *sequences,
+    LocalTrees *trees, int region_start, int region_end, int niters,
+    bool open_ended, double heat)
+{
+    // special case: zero length region
+    if (region_start == region_end)
+        return 1.0;
+
+    // assert region is within trees
+    assert(region_start >= trees->start_coord);
+    assert(region_end <= trees->end_coord);
+    assert(region_start < region_end);
+
+    // partion trees into three segments
+    LocalTrees *trees2 = partition_local_trees(trees, region_start);
+    LocalTrees *trees3 = partition_local_trees(trees2, region_end);
+    assert(trees2->length() == region_end - region_start);
+
+    int accepts = resample_arg_window(
+        model, sequences, trees2, niters,
+        open_ended && region_start == trees->start_coord,
+        open_ended && region_end == trees3->end_coord, heat);
+
     // rejoin trees
     append_local_trees(trees, trees2, true, model->pop_tree);
     append_local_trees(trees, trees3, true, model->pop_tree);
@@ -737,26 +769,154 @@ double resample_arg_region(
 }
 
 
+// resample the windows [bounds[i], bounds[i+1]) of an ARG at the same time
+// on nthreads threads, window i for niters[i] iterations.  Each window is
+// split off, resampled with its own random stream and joined back, so the
+// result does not depend on the number of threads.  If records is given,
+// the outcome of each window is appended to it.
+// returns the sum of the windows' acceptance rates
+double resample_arg_windows_parallel(
+    const ArgModel *model, const Sequences *sequences, LocalTrees *trees,
+    const vector<int> &bounds, const vector<int> &niters, double heat,
+    int nthreads, vector<WindowRecord> *records)
+{
+    const int nwindows = bounds.size() - 1;
+    const int chrom_start = trees->start_coord;
+    const int chrom_end = trees->end_coord;
+    assert((int) niters.size() == nwindows);
+
+    // split trees into windows
+    vector<LocalTrees*> windows(nwindows);
+    windows[0] = partition_local_trees(trees, bounds[0]);
+    for (int i=1; i<nwindows; i++)
+        windows[i] = partition_local_trees(windows[i-1], bounds[i]);
+
+    const unsigned long long seed = rand_seed();
+    vector<RandomStream> streams;
+    for (int i=0; i<nwindows; i++)
+        streams.push_back(RandomStream(seed, i));
+
+    // resample windows, taking the next unclaimed window when idle
+    vector<int> accepts(nwindows, 0);
+    vector<int> ntrees(nwindows, 0);
+    vector<double> times(nwindows, 0.0);
+    atomic<int> next_window(0);
+    Logger *logger = g_thread_logger;
+    auto worker = [&]() {
+        g_thread_logger = logger;
+        for (int i=next_window++; i<nwindows; i=next_window++) {
+            if (niters[i] == 0)
+                continue;
+            ScopedRandomStream stream(&streams[i]);
+            Timer timer;
+            ntrees[i] = windows[i]->get_num_trees();
+            accepts[i] = resample_arg_window(
+                model, sequences, windows[i], niters[i],
+                bounds[i] == chrom_start, bounds[i+1] == chrom_end, heat);
+            times[i] = timer.time();
+        }
+    };
+    vector<thread> threads;
+    for (int i=1; i<min(nthreads, nwindows); i++)
+        threads.push_back(thread(worker));
+    worker();
+    for (unsigned int i=0; i<threads.size(); i++)
+        threads[i].join();
+
+    // rejoin trees
+    double accept_rate = 0.0;
+    for (int i=0; i<nwindows; i++) {
+        append_local_trees(trees, windows[i], true, model->pop_tree);
+        delete windows[i];
+        if (niters[i] > 0)
+            accept_rate += accepts[i] / double(niters[i]);
+        if (records && niters[i] > 0)
+            records->push_back(WindowRecord(
+                bounds[i], bounds[i+1], ntrees[i], niters[i],
+                accepts[i] / double(niters[i]), times[i]));
+    }
+    return accept_rate;
+}
+
+
+// resample an ARG in windows of two neighboring tiles of a schedule
+// returns the mean acceptance rate of the windows
+static double resample_arg_scheduled_regions(
+    const ArgModel *model, Sequences *sequences, LocalTrees *trees,
+    WindowSchedule *schedule, double heat, int nthreads)
+{
+    vector<int> cuts;
+    schedule->get_cuts(trees, cuts);
+    const int ntiles = cuts.size() - 1;
+    const int niters = schedule->get_niters();
+    vector<WindowRecord> records;
+
+    // two passes of disjoint windows, the second offset by a tile
+    const int first_pass = irand(2);
+    for (int pass=0; pass<2; pass++) {
+        vector<int> bounds(1, cuts[0]);
+        for (int k=((pass + first_pass) % 2 == 0 ? 2 : 1); k<ntiles; k+=2)
+            bounds.push_back(cuts[k]);
+        bounds.push_back(cuts[ntiles]);
+        resample_arg_windows_parallel(
+            model, sequences, trees, bounds,
+            vector<int>(bounds.size() - 1, niters), heat, nthreads,
+            &records);
+    }
+
+    schedule->update(records);
+    double accept_rate = 0.0;
+    for (unsigned int i=0; i<records.size(); i++)
+        accept_rate += records[i].accept;
+    return accept_rate / records.size();
+}
 
 
 // resample an ARG a region at a time in a sliding window
+//
+// The windows are resampled in two passes of disjoint windows that tile
+// the ARG.  The second pass is offset by half a window, so that, as with
+// overlapping sliding windows, the ends of every window are resampled in
+// the other pass.  Each window is conditioned on the threading at its ends
+// and resampled with its own random stream, on one thread or many, so the
+// result is the same for any nthreads.
+//
+// If a schedule is given, it chooses the windows and their iterations
+// instead of window and niters.
 double resample_arg_regions(
     const ArgModel *model, Sequences *sequences,
-    LocalTrees *trees, int window, int niters, double heat)
+    LocalTrees *trees, int window, int niters, double heat, int nthreads,
+    WindowSchedule *schedule)
 {
     decLogLevel();
+    if (schedule) {
+        double accept_rate = resample_arg_scheduled_regions(
+            model, sequences, trees, schedule, heat, nthreads);
+        incLogLevel();
+        schedule->log(LOG_LOW);
+        return accept_rate;
+    }
+
     double accept_rate = 0.0;
     int nwindows = 0;
     int currwindow = irand(window - window/4, window + window/4);
-    int currstep = (int)currwindow/2+1;
-    for (int start=trees->start_coord;
-         start == trees->start_coord || start+currwindow/2 <trees->end_coord;
-         start+=currstep)
-    {
-        nwindows++;
-        int end = min(start + currwindow, trees->end_coord);
-        accept_rate += resample_arg_region(
-             model, sequences, trees, start, end, niters, true, heat);
+
+    // alternate which pass starts at the beginning of the ARG
+    const int first_offset = irand(2) * (currwindow / 2);
+    for (int pass=0; pass<2; pass++) {
+        const int offset = (pass == 0 ? first_offset :
+                            currwindow / 2 - first_offset);
+        vector<int> bounds(1, trees->start_coord);
+        for (int pos = trees->start_coord + (offset > 0 ? offset :
+                                             currwindow);
+             pos < trees->end_coord; pos += currwindow)
+            bounds.push_back(pos);
+        bounds.push_back(trees->end_coord);
+
+        nwindows += bounds.size() - 1;
+        accept_rate += resample_arg_windows_parallel(
+            model, sequences, trees, bounds,
+            vector<int>(bounds.size() - 1, niters), heat, nthreads);
     }
     incLogLevel();
 
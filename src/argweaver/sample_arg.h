@@ -12,6 +12,7 @@
 #include "local_tree.h"
 #include "model.h"
 #include "sequences.h"
+#include "window_schedule.h"
 
 
 namespace argweaver {
@@ -20,6 +21,9 @@ using namespace std;
 
 void sample_arg_seq(const ArgModel *model, Sequences *sequences,
                     LocalTrees *trees, bool random=false, int num_buildup=1);
+void sample_arg_seq(const ArgModel *model, Sequences *sequences,
+                    LocalTrees *trees, const vector<int> &seqids,
+                    int num_buildup=1);
 
 void resample_arg(const ArgModel *model, Sequences *sequences,
                   LocalTrees *trees);
@@ -39,7 +43,8 @@ bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
 void resample_arg_mcmc_all(const ArgModel *model, Sequences *sequences,
                            LocalTrees *trees, bool do_leaf,
                            int window, int niters, double heat=1.0,
-                           bool no_resample_mig=false);
+                           bool no_resample_mig=false, int nthreads=1,
+                           WindowSchedule *schedule=NULL);
 
 void resample_arg_climb(const ArgModel *model, Sequences *sequences,
                         LocalTrees *trees, double recomb_preference);
@@ -69,10 +74,15 @@ double resample_arg_cut(
     const ArgModel *model, const Sequences *sequences, LocalTrees *trees,
     int window, int step, int niters);
 
+double resample_arg_windows_parallel(
+    const ArgModel *model, const Sequences *sequences, LocalTrees *trees,
+    const vector<int> &bounds, const vector<int> &niters, double heat=1.0,
+    int nthreads=1, vector<WindowRecord> *records=NULL);
+
 double resample_arg_regions(
     const ArgModel *model, Sequences *sequences,
     LocalTrees *trees, int window, int niters=1,
-    double heat=1.0);
+    double heat=1.0, int nthreads=1, WindowSchedule *schedule=NULL);
 
 int resample_arg_by_time_and_hap(
     const ArgModel *model, Sequences *sequences,
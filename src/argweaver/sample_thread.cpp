@@ -6,10 +6,13 @@
 // arghmm includes
 #include "common.h"
 #include "emit.h"
+#include "forward_kernel.h"
+#include "forward_skip.h"
 #include "hmm.h"
 #include "local_tree.h"
 #include "logging.h"
 #include "matrices.h"
+#include "matrix_pipeline.h"
 #include "model.h"
 #include "recomb.h"
 #include "sample_thread.h"
@@ -31,12 +34,15 @@ using namespace std;
 
 // compute one block of forward algorithm with compressed transition matrices
 // NOTE: first column of forward table should be pre-populated
+// If 'skip' is given, the runs it has planned are jumped over and the
+// columns inside them are left uncomputed.
 void arghmm_forward_block(const ArgModel *model,
                           const LocalTree *tree,
                           const int blocklen, const States &states,
                           const LineageCounts &lineages,
                           const TransMatrix *matrix,
-                          const double* const *emit, double **fw)
+                          const double* const *emit, double **fw,
+                          ForwardRunSkip *skip=NULL)
 {
     const int nstates = states.size();
     const LocalNode *nodes = tree->nodes;
@@ -115,7 +121,14 @@ void arghmm_forward_block(const ArgModel *model,
     }
 
     // compute ntimes*ntimes and ntime*nstates temp matrices
+    // unused path entries are zero so that each row of tmatrix can be
+    // multiplied with fgroups as one dense vector
+    const ForwardKernel *kernel = get_forward_kernel();
+    const int tmatrix_rowlen = (ntimes-1) * max_numpath;
     double tmatrix[ntimes-1][max_numpath][ntimes-1][max_numpath];
+    fill(&tmatrix[0][0][0][0],
+         &tmatrix[0][0][0][0] + (ntimes-1) * max_numpath * tmatrix_rowlen,
+         0.0);
     for (int b=0; b<ntimes-1; b++) {
         for (int pb=0; pb < numpath_per_time[b]; pb++) {
             for (int a=0; a<ntimes-1; a++) {
@@ -219,37 +232,38 @@ void arghmm_forward_block(const ArgModel *model,
 
 
     double tmatrix_fgroups[max_numpath][ntimes];
-    double fgroups[max_numpath][ntimes];
+    double fgroups[ntimes][max_numpath];
     for (int i=1; i<blocklen; i++) {
+        // jump to the end of a run of identical columns
+        if (skip && skip->get_jump(i)) {
+            const int j = skip->get_jump(i);
+            skip->apply(i, fw[i-1], fw[j]);
+            i = j;
+            continue;
+        }
+
         const double *col1 = fw[i-1];
         double *col2 = fw[i];
         const double *emit2 = emit[i];
         idx = 0;
 
         // precompute the fgroup sums
-        for (int p=0; p < max_numpath; p++)
-            fill(fgroups[p], fgroups[p]+ntimes, 0.0);
+        fill(fgroups[0], fgroups[0] + ntimes * max_numpath, 0.0);
         for (int j=0; j<nstates; j++) {
             const int a = states[j].time;
-            fgroups[path_map[j]][a] += col1[j];
+            fgroups[a][path_map[j]] += col1[j];
             assert(!isinf(col1[j]));
         }
 
         // multiply tmatrix and fgroups together
         for (int b=0; b<ntimes-1; b++) {
             for (int pb=0; pb < numpath_per_time[b]; pb++) {
-                double sum = 0.0;
-                for (int a=0; a<ntimes-1; a++) {
-                    for (int pa=0; pa < numpath_per_time[a]; pa++) {
-                        sum += tmatrix[b][pb][a][pa] * fgroups[pa][a];
-                    }
-                }
-                tmatrix_fgroups[pb][b] = sum;
+                tmatrix_fgroups[pb][b] = kernel->dot(
+                    tmatrix[b][pb][0], fgroups[0], tmatrix_rowlen);
             }
         }
 
         // fill in one column of forward table
-        double norm = 0.0;
         for (int k=0; k<nstates; k++) {
             const int b = states[k].time;
             const int node2 = states[k].node;
@@ -273,19 +287,19 @@ void arghmm_forward_block(const ArgModel *model,
                     }
                 }
             }
-            col2[k] = sum * emit2[k];
-            norm += col2[k];
+            col2[k] = sum;
             if (isnan(col2[k]))
                 assert(false);
         }
+
+        // apply emissions
+        double norm = kernel->emit_norm(col2, emit2, nstates);
         assert(norm > 0);
         assert(!isnan(norm));
         assert(!isinf(norm));
 
         // normalize column for numerical stability
-        for (int k=0; k<nstates; k++)
-            col2[k] /= norm;
-
+        kernel->normalize(col2, norm, nstates);
     }
 }
 
@@ -419,6 +433,22 @@ void arghmm_forward_switch(const double *col1, double* col2,
 
 
 
+// compute columns of a block with the fast or slow forward algorithm
+static inline void arghmm_forward_chunk(
+    const ArgModel *model, const LocalTree *tree, const int ncols,
+    const States &states, const LineageCounts &lineages,
+    const TransMatrix *matrix, const double* const *emit, double **fw,
+    bool slow, ForwardRunSkip *skip=NULL)
+{
+    if (slow)
+        arghmm_forward_block_slow(tree, model->ntimes, ncols,
+                                  states, lineages, matrix, emit, fw);
+    else
+        arghmm_forward_block(model, tree, ncols,
+                             states, lineages, matrix, emit, fw, skip);
+}
+
+
 // Run forward algorithm for all blocks
 void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
     const Sequences *sequences, ArgHmmMatrixIter *matrix_iter,
@@ -434,6 +464,12 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
     LocalTree *last_tree = NULL;
 #endif
 
+    // runs of identical sites can only be skipped if the columns inside
+    // them are recomputed during traceback
+    const bool skip_runs = model->forward_table.skip_invariant &&
+        forward->needs_recompute() && sequences && !slow;
+    int nskipped = 0;
+
     double **fw = forward->get_table();
     // forward algorithm over local trees
     for (matrix_iter->begin(); matrix_iter->more(); matrix_iter->next()) {
@@ -446,8 +482,15 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
         double **emit = matrices.emit;
 
         // allocate the forward table
-        if (pos > trees->start_coord || !prior_given)
-            forward->new_block(pos, pos+matrices.blocklen, matrices.nstates2);
+        // long blocks may be allocated in several chunks
+        const int end = pos + blocklen;
+        int chunk_end = end;
+        if (pos > trees->start_coord || !prior_given) {
+            if (blocklen > forward->get_chunk_length())
+                chunk_end = pos + forward->get_chunk_length();
+            forward->new_block(pos, chunk_end, matrices.nstates2);
+        }
+        int ncols = chunk_end - pos;
         double **fw_block = &fw[pos];
 
         matrices.states_model.get_coal_states(tree, states);
@@ -476,7 +519,7 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
             // state-space does not change and no switch matrix is needed
             fw_block = &fw[pos-1];
             emit--;
-            blocklen++;
+            ncols++;
         }
 
         int nstates = max(matrices.transmat->nstates, 1);
@@ -486,24 +529,45 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
         assert(!isnan(top));
         assert(top > 0.0);
 
+        // plan which runs of identical sites to skip
+        ForwardRunSkip *skip = NULL;
+        if (skip_runs && matrices.transmat->nstates > 0) {
+            skip = new ForwardRunSkip(tree, states, matrices.transmat,
+                                      model->ntimes);
+            skip->plan(emit, ncols, forward, (fw_block - fw));
+            nskipped += skip->get_num_skipped();
+        }
+
         // calculate rest of block
-        if (slow)
-            arghmm_forward_block_slow(tree, model->ntimes, blocklen,
-                                      states, lineages, matrices.transmat,
-                                      emit, fw_block);
-        else
-            arghmm_forward_block(model, tree, blocklen,
+        arghmm_forward_chunk(model, tree, ncols, states, lineages,
+                             matrices.transmat, emit, fw_block, slow, skip);
+        forward->end_block(pos, chunk_end);
+        delete skip;
+
+        // calculate remaining chunks of block
+        while (chunk_end < end) {
+            const int chunk_start = chunk_end;
+            chunk_end = min(end, chunk_start + forward->get_chunk_length());
+            forward->new_block(chunk_start, chunk_end, matrices.nstates2);
+            arghmm_forward_chunk(model, tree, chunk_end - chunk_start + 1,
                                  states, lineages, matrices.transmat,
-                                 emit, fw_block);
+                                 &matrices.emit[chunk_start - pos - 1],
+                                 &fw[chunk_start - 1], slow);
+            forward->end_block(chunk_start, chunk_end);
+        }
 
         // safety check
-        double top2 = max_array(fw[pos + matrices.blocklen - 1], nstates);
+        double top2 = max_array(fw[end - 1], nstates);
         //        printf("%i %i top2=%f\n", count++, pos, top2);
         assert(top2 > 0.0);
 #ifdef DEBUG
         last_tree = tree;
 #endif
     }
+
+    if (skip_runs)
+        printLog(LOG_HIGH, "forward: skipped %d of %d columns\n",
+                 nskipped, trees->length());
 }
 
 
@@ -619,16 +683,203 @@ double stochastic_traceback(
 
 
 
+// sample the states of one block of the traceback from a forward table
+// that does not keep all columns as doubles.  Columns are read one segment
+// at a time and columns that are not stored are recomputed from the
+// previous checkpoint (which requires emissions).
+static double stochastic_traceback_block(
+    const ArgModel *model, const LocalTree *tree, const States &states,
+    const LineageCounts &lineages, const ArgHmmMatrices &mat,
+    const ArgHmmForwardTable *forward, int start, int *path,
+    vector<double> &buf)
+{
+    const int nstates = max(mat.nstates2, 1);
+    const int seglen = forward->get_segment_length();
+    double lnl = 0.0;
+
+    // walk backwards one segment at a time
+    int hi = start + mat.blocklen - 1;
+    while (hi > start) {
+        // find previous stored column (or the block start)
+        int lo = hi - 1;
+        while (lo > start && (hi - lo < seglen || !forward->is_stored(lo)))
+            lo--;
+
+        // read stored columns of the segment (last column is not needed)
+        const int ncols = hi - lo + 1;
+        buf.resize((ncols + 1) * max(nstates, max(mat.nstates1, 1)));
+        double *cols[ncols];
+        for (int j=0; j<ncols; j++)
+            cols[j] = &buf[j * nstates];
+        for (int j=0; j<ncols-1; j++)
+            if (forward->is_stored(lo + j))
+                forward->get_column(lo + j, cols[j], nstates);
+
+        if (forward->needs_recompute()) {
+            assert(mat.emit);
+
+            // recompute block start from the previous block
+            if (!forward->is_stored(lo)) {
+                assert(lo == start);
+                double *prev = &buf[ncols * nstates];
+                forward->get_column(lo - 1, prev, mat.nstates1);
+                if (mat.transmat_switch) {
+                    arghmm_forward_switch(prev, cols[0],
+                                          mat.transmat_switch, mat.emit[0]);
+                } else {
+                    double *cols2[2] = {prev, cols[0]};
+                    arghmm_forward_block(model, tree, 2, states, lineages,
+                                         mat.transmat, mat.emit - 1, cols2);
+                }
+            }
+
+            // recompute rest of segment
+            if (ncols > 2)
+                arghmm_forward_block(model, tree, ncols - 1, states,
+                                     lineages, mat.transmat,
+                                     &mat.emit[lo - start], cols);
+        }
+
+        lnl += sample_hmm_posterior(ncols, tree, states, mat.transmat,
+                                    cols, &path[lo]);
+        hi = lo;
+    }
+
+    return lnl;
+}
+
+
+double stochastic_traceback(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardTable *forward,
+    int *path, bool last_state_given, bool internal)
+{
+    if (forward->has_all_columns())
+        return stochastic_traceback(trees, model, matrix_iter,
+                                    forward->get_table(), path,
+                                    last_state_given, internal);
+
+    LineageCounts lineages(model->ntimes, model->num_pops());
+    States states;
+    vector<double> buf;
+    vector<double> col;
+    double lnl = 0.0;
+
+    // choose last column first
+    matrix_iter->rbegin();
+    int pos = trees->end_coord;
+
+    if (!last_state_given) {
+        ArgHmmMatrices &mat = matrix_iter->ref_matrices();
+        const int nstates = max(mat.nstates2, 1);
+        col.resize(nstates);
+        forward->get_column(pos-1, &col[0], nstates);
+        path[pos-1] = sample(&col[0], nstates);
+        lnl = col[path[pos-1]];
+    }
+
+    // iterate backward through blocks
+    for (; matrix_iter->more(); matrix_iter->prev()) {
+        ArgHmmMatrices &mat = matrix_iter->ref_matrices();
+        LocalTree *tree = matrix_iter->get_tree_spr()->tree;
+        mat.states_model.get_coal_states(tree, states);
+        lineages.count(tree, model->pop_tree, internal);
+        pos -= mat.blocklen;
+
+        lnl += stochastic_traceback_block(model, tree, states, lineages, mat,
+                                          forward, pos, path, buf);
+
+        // fill in last col of next block (always stored)
+        if (pos > trees->start_coord) {
+            int i = pos - 1;
+            col.resize(max(mat.nstates1, 1));
+            forward->get_column(i, &col[0], mat.nstates1);
+            if (mat.transmat_switch) {
+                // use switch matrix
+                path[i] = sample_hmm_posterior_step(
+                    mat.transmat_switch, &col[0], path[i+1]);
+                lnl += log(col[path[i]] *
+                           mat.transmat_switch->get(path[i], path[i+1]));
+            } else {
+                // use normal matrix
+                double *cols[2] = {&col[0], NULL};
+                lnl += sample_hmm_posterior(2, tree, states,
+                    mat.transmat, cols, &path[i]);
+            }
+        }
+    }
+
+    return lnl;
+}
+
+
+
 //=============================================================================
 // ARG sampling
 
 
+ArgHmmForwardTable *new_forward_table(const ArgModel *model,
+                                      const LocalTrees *trees, int nstates,
+                                      bool allow_checkpoint)
+{
+    const ForwardTableConfig &config = model->forward_table;
+    const int seqlen = trees->length();
+    const double ncells = double(seqlen) * max(nstates, 1);
+
+    // choose storage mode
+    ForwardTableMode mode = config.mode;
+    if (mode == FORWARD_TABLE_AUTO && config.skip_invariant &&
+        allow_checkpoint)
+        mode = FORWARD_TABLE_CHECKPOINT;
+    if (mode == FORWARD_TABLE_AUTO) {
+        if (config.memory_budget <= 0 ||
+            ncells * sizeof(double) <= config.memory_budget)
+            mode = FORWARD_TABLE_FULL;
+        else if (ncells * sizeof(float) <= config.memory_budget ||
+                 !allow_checkpoint)
+            mode = FORWARD_TABLE_FLOAT;
+        else
+            mode = FORWARD_TABLE_CHECKPOINT;
+    }
+    if (mode == FORWARD_TABLE_CHECKPOINT && !allow_checkpoint)
+        mode = FORWARD_TABLE_FLOAT;
+
+    if (mode == FORWARD_TABLE_FULL)
+        return new ArgHmmForwardTable(trees->start_coord, seqlen);
+    if (mode == FORWARD_TABLE_FLOAT) {
+        printLog(LOG_MEDIUM, "forward table: single precision\n");
+        return new ArgHmmForwardTableFloat(trees->start_coord, seqlen);
+    }
+
+    int spacing = config.checkpoint_spacing;
+    if (spacing <= 0)
+        spacing = int(sqrt(double(seqlen)));
+    printLog(LOG_MEDIUM, "forward table: checkpoint every %d columns\n",
+             spacing);
+    return new ArgHmmForwardTableCheckpoint(trees->start_coord, seqlen,
+                                            spacing);
+}
+
+
+// log the matrix computations saved by traceback and recombination
+// sampling during one threading
+static void log_matrix_store(const TransMatrixStore *store)
+{
+    if (store->enabled())
+        printLog(LOG_HIGH, "matrices reused (%6d blocks):     %5.1f ms\n",
+                 store->get_num_reused(), store->get_time_saved() * 1e3);
+}
+
+
 // sample the thread of the last chromosome
 void sample_arg_thread(const ArgModel *model, Sequences *sequences,
                        LocalTrees *trees, int new_chrom)
 {
     // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
+    int nstates = get_num_coal_states(trees->front().tree, model->ntimes);
+    // emissions of unphased data depend on phase_pr and are not recomputed
+    ArgHmmForwardTable *forward = new_forward_table(
+        model, trees, nstates, !model->unphased);
     int *thread_path_alloc = new int [trees->length()];
     int *thread_path = &thread_path_alloc[-trees->start_coord];
     int start_pop = sequences->get_pop(new_chrom);
@@ -643,24 +894,27 @@ void sample_arg_thread(const ArgModel *model, Sequences *sequences,
       printf("treemap = %i %i\n", phase_pr.treemap1, phase_pr.treemap2);
 
     // build matrices
-    ArgHmmMatrixIter matrix_iter(model, sequences, trees, new_chrom);
+    ArgHmmMatrixPipeline matrix_iter(model, sequences, trees, new_chrom);
     matrix_iter.set_start_pop(start_pop);
 
     // compute forward table
     Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward,
+    arghmm_forward_alg(trees, model, sequences, &matrix_iter, forward,
 		       model->unphased ? &phase_pr : NULL);
-    int nstates = get_num_coal_states(trees->front().tree, model->ntimes);
     printTimerLog(time, LOG_LOW,
                   "forward (%3d states, %6d blocks):",
                   nstates, trees->get_num_trees());
 
     // traceback
+    // a checkpointed table needs emissions, which matrix_iter computes
     time.start();
-    double **fw = forward.get_table();
     ArgHmmMatrixIter matrix_iter2(model, NULL, trees, new_chrom);
     matrix_iter2.set_start_pop(start_pop);
-    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path);
+    matrix_iter2.set_matrix_cache(matrix_iter.get_matrix_cache());
+    matrix_iter2.set_matrix_store(matrix_iter.get_matrix_store());
+    stochastic_traceback(trees, model,
+        forward->needs_recompute() ? &matrix_iter : &matrix_iter2,
+        forward, thread_path);
     printTimerLog(time, LOG_LOW,
                   "trace:                              ");
 
@@ -684,8 +938,10 @@ void sample_arg_thread(const ArgModel *model, Sequences *sequences,
     assert_trees(trees, model->pop_tree);
     printTimerLog(time, LOG_LOW,
                   "add thread:                         ");
+    log_matrix_store(matrix_iter.get_matrix_store());
 
     // clean up
+    delete forward;
     delete [] thread_path_alloc;
 }
 
@@ -698,12 +954,15 @@ void sample_arg_thread_internal(
     const bool internal = true;
 
     // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
+    int nstates = get_num_coal_states_internal(
+           trees->front().tree, model->ntimes, minage);
+    ArgHmmForwardTable *forward = new_forward_table(
+        model, trees, nstates, phase_pr == NULL);
     int *thread_path_alloc = new int [trees->length()];
     int *thread_path = &thread_path_alloc[-trees->start_coord];
 
     // build matrices
-    ArgHmmMatrixIter matrix_iter(model, sequences, trees);
+    ArgHmmMatrixPipeline matrix_iter(model, sequences, trees);
     matrix_iter.set_internal(internal, minage);
 
     if (phase_pr != NULL)
@@ -712,21 +971,21 @@ void sample_arg_thread_internal(
 
     // compute forward table
     Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward,
+    arghmm_forward_alg(trees, model, sequences, &matrix_iter, forward,
                        phase_pr, false, internal);
-    int nstates = get_num_coal_states_internal(
-           trees->front().tree, model->ntimes, minage);
     printTimerLog(time, LOG_LOW,
                   "forward (%3d states, %6d blocks):",
                   nstates, trees->get_num_trees());
 
     // traceback
     time.start();
-    double **fw = forward.get_table();
     ArgHmmMatrixIter matrix_iter2(model, NULL, trees);
     matrix_iter2.set_internal(internal, minage);
-    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path,
-                         false, internal);
+    matrix_iter2.set_matrix_cache(matrix_iter.get_matrix_cache());
+    matrix_iter2.set_matrix_store(matrix_iter.get_matrix_store());
+    stochastic_traceback(trees, model,
+        forward->needs_recompute() ? &matrix_iter : &matrix_iter2,
+        forward, thread_path, false, internal);
     printTimerLog(time, LOG_LOW,
                   "trace:                              ");
 
@@ -746,8 +1005,10 @@ void sample_arg_thread_internal(
                         recomb_pos, recombs, model->pop_tree);
     printTimerLog(time, LOG_LOW,
                   "add thread:                         ");
+    log_matrix_store(matrix_iter.get_matrix_store());
 
     // clean up
+    delete forward;
     delete [] thread_path_alloc;
 }
 
@@ -846,7 +1107,7 @@ void cond_sample_arg_thread_internal(
     assert_trees(trees, model->pop_tree, true);
 
     // build matrices
-    ArgHmmMatrixIter matrix_iter(model, sequences, trees);
+    ArgHmmMatrixPipeline matrix_iter(model, sequences, trees);
     matrix_iter.set_internal(internal);
 
     // fill in first column of forward table
@@ -913,6 +1174,8 @@ void cond_sample_arg_thread_internal(
     time.start();
     ArgHmmMatrixIter matrix_iter2(model, NULL, trees);
     matrix_iter2.set_internal(internal);
+    matrix_iter2.set_matrix_cache(matrix_iter.get_matrix_cache());
+    matrix_iter2.set_matrix_store(matrix_iter.get_matrix_store());
     stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path,
                          last_state_given, internal);
     printTimerLog(time, LOG_LOW,
@@ -935,6 +1198,7 @@ void cond_sample_arg_thread_internal(
     assert_trees(trees, model->pop_tree);
     printTimerLog(time, LOG_LOW,
                   "add thread:                         ");
+    log_matrix_store(matrix_iter.get_matrix_store());
 
     // clean up
     delete [] thread_path_alloc;
@@ -1077,6 +1341,8 @@ void arghmm_sample_arg_thread_internal(LocalTrees *trees,
     double **fw = forward.get_table();
     ArgHmmMatrixIter matrix_iter2(&model, NULL, trees);
     matrix_iter2.set_internal(internal);
+    matrix_iter2.set_matrix_cache(matrix_iter.get_matrix_cache());
+    matrix_iter2.set_matrix_store(matrix_iter.get_matrix_store());
     stochastic_traceback(trees, &model, &matrix_iter2, fw, thread_path,
                          false, internal);
 }
@@ -2,6 +2,7 @@
 #define ARGWEAVER_SAMPLE_THREAD_H
 
 // c++ includes
+#include <limits.h>
 #include <list>
 #include <vector>
 #include <string.h>
@@ -88,6 +89,48 @@ public:
         return ptr;
     }
 
+    // called once columns [start, end) have been computed
+    virtual void end_block(int /*start*/, int /*end*/) {}
+
+    // max number of columns to compute between new_block() and end_block()
+    virtual int get_chunk_length() const
+    {
+        return INT_MAX;
+    }
+
+    // returns true if every column of the table is kept as doubles in
+    // get_table() after the forward algorithm
+    virtual bool has_all_columns() const
+    {
+        return true;
+    }
+
+    // returns true if columns that are not stored must be recomputed
+    // during traceback (requires emissions)
+    virtual bool needs_recompute() const
+    {
+        return false;
+    }
+
+    // returns true if column pos can be read with get_column()
+    virtual bool is_stored(int /*pos*/) const
+    {
+        return true;
+    }
+
+    // copies column pos with nstates entries into col
+    virtual void get_column(int pos, double *col, int nstates) const
+    {
+        const double *col2 = fw[pos-start_coord];
+        std::copy(col2, col2 + max(nstates, 1), col);
+    }
+
+    // number of columns traceback should read at once
+    virtual int get_segment_length() const
+    {
+        return 1;
+    }
+
     int start_coord;
     int seqlen;
 
@@ -124,6 +167,221 @@ public:
 };
 
 
+// Forward table that only keeps checkpoint columns
+//
+// The last column of each block, the first column of the table and every
+// spacing-th column within a block are stored.  All other columns share a
+// two column scratch buffer, which is enough for the forward algorithm since
+// it only reads the previous column.  During traceback the columns between
+// two checkpoints are recomputed one segment at a time (see
+// stochastic_traceback), so memory scales as O((L/spacing + nblocks) *
+// nstates) instead of O(L * nstates).
+class ArgHmmForwardTableCheckpoint : public ArgHmmForwardTable
+{
+public:
+    ArgHmmForwardTableCheckpoint(int start_coord, int seqlen, int spacing) :
+        ArgHmmForwardTable(start_coord, seqlen),
+        spacing(max(spacing, 2)),
+        stored(seqlen, false),
+        nstored(0),
+        scratch(NULL),
+        scratch_size(0)
+    {}
+
+    virtual ~ArgHmmForwardTableCheckpoint() {}
+
+    // allocate another block of the forward table
+    virtual void new_block(int start, int end, int nstates)
+    {
+        nstates = max(nstates, 1);
+
+        // determine which columns are checkpoints
+        int ncols = 0;
+        for (int i=start; i<end; i++) {
+            assert(i-start_coord >= 0 && i-start_coord < seqlen);
+            stored[i-start_coord] = (i == end - 1 || i == start_coord ||
+                                     (i - start + 1) % spacing == 0);
+            if (stored[i-start_coord])
+                ncols++;
+        }
+        nstored += ncols;
+
+        // scratch columns are reused by all blocks
+        if (nstates > scratch_size) {
+            scratch = new double [2 * nstates];
+            blocks.push_back(scratch);
+            scratch_size = nstates;
+        }
+
+        // link block to fw table
+        double *block = new double [ncols * nstates];
+        blocks.push_back(block);
+        for (int i=start; i<end; i++) {
+            if (stored[i-start_coord]) {
+                fw[i-start_coord] = block;
+                block += nstates;
+            } else {
+                fw[i-start_coord] =
+                    &scratch[((i-start_coord) & 1) * scratch_size];
+            }
+        }
+    }
+
+    virtual void delete_blocks()
+    {
+        ArgHmmForwardTable::delete_blocks();
+        scratch = NULL;
+        scratch_size = 0;
+        nstored = 0;
+    }
+
+    virtual bool has_all_columns() const
+    {
+        return false;
+    }
+
+    virtual bool needs_recompute() const
+    {
+        return true;
+    }
+
+    // returns true if column pos is kept after the forward algorithm
+    virtual bool is_stored(int pos) const
+    {
+        return stored[pos-start_coord];
+    }
+
+    int get_num_stored() const
+    {
+        return nstored;
+    }
+
+    int spacing;
+
+protected:
+    vector<bool> stored;
+    int nstored;
+    double *scratch;
+    int scratch_size;
+};
+
+
+// Forward table that stores columns in single precision
+//
+// Columns are still computed in double precision.  They are computed into a
+// staging buffer one chunk at a time and then stored as floats relative to
+// the column maximum, with the log of the maximum kept as a per-column
+// scale.  The last computed column is kept in double precision so that the
+// recursion itself never loses precision.  Traceback reads columns back with
+// get_column(), so sampled paths differ from the double table only through
+// float rounding of the stored probabilities (relative error 2^-24).
+class ArgHmmForwardTableFloat : public ArgHmmForwardTable
+{
+public:
+    ArgHmmForwardTableFloat(int start_coord, int seqlen,
+                            int chunk_length=1024) :
+        ArgHmmForwardTable(start_coord, seqlen),
+        chunk_length(chunk_length),
+        logscale(seqlen, 0.0),
+        nstates(0)
+    {
+        ffw = new float *[seqlen];
+    }
+
+    virtual ~ArgHmmForwardTableFloat()
+    {
+        delete_blocks();
+        delete [] ffw;
+    }
+
+    // allocate another chunk of the forward table
+    virtual void new_block(int start, int end, int _nstates)
+    {
+        nstates = max(_nstates, 1);
+        int blocklen = end - start;
+        float *block = new float [blocklen * nstates];
+        fblocks.push_back(block);
+
+        // columns are computed in the staging buffer
+        staging.resize(max(staging.size(), size_t(blocklen * nstates)));
+        for (int i=start; i<end; i++) {
+            assert(i-start_coord >= 0 && i-start_coord < seqlen);
+            ffw[i-start_coord] = &block[(i-start)*nstates];
+            fw[i-start_coord] = &staging[(i-start)*nstates];
+        }
+    }
+
+    // convert computed columns to single precision
+    virtual void end_block(int start, int end)
+    {
+        for (int i=start; i<end; i++) {
+            const double *col = fw[i-start_coord];
+            float *fcol = ffw[i-start_coord];
+            double top = col[0];
+            for (int k=1; k<nstates; k++)
+                if (col[k] > top)
+                    top = col[k];
+            if (top <= 0.0)
+                top = 1.0;
+            for (int k=0; k<nstates; k++)
+                fcol[k] = float(col[k] / top);
+            logscale[i-start_coord] = float(log(top));
+        }
+
+        // keep last column in double precision for the next chunk
+        carry.assign(fw[end-1-start_coord], fw[end-1-start_coord] + nstates);
+        fw[end-1-start_coord] = &carry[0];
+    }
+
+    virtual void delete_blocks()
+    {
+        for (unsigned int i=0; i<fblocks.size(); i++)
+            delete [] fblocks[i];
+        fblocks.clear();
+    }
+
+    virtual int get_chunk_length() const
+    {
+        return chunk_length;
+    }
+
+    virtual bool has_all_columns() const
+    {
+        return false;
+    }
+
+    virtual void get_column(int pos, double *col, int nstates) const
+    {
+        const float *fcol = ffw[pos-start_coord];
+        const double scale = exp(double(logscale[pos-start_coord]));
+        for (int k=0; k<max(nstates, 1); k++)
+            col[k] = fcol[k] * scale;
+    }
+
+    virtual int get_segment_length() const
+    {
+        return chunk_length;
+    }
+
+    int chunk_length;
+
+protected:
+    float **ffw;
+    vector<float*> fblocks;
+    vector<float> logscale;
+    vector<double> staging;
+    vector<double> carry;
+    int nstates;
+};
+
+
+// allocate a forward table for threading a region of the ARG
+// chooses checkpointing according to model->forward_table
+ArgHmmForwardTable *new_forward_table(const ArgModel *model,
+                                      const LocalTrees *trees, int nstates,
+                                      bool allow_checkpoint=true);
+
+
 //=============================================================================
 // Forward algorithm for thread path
 
@@ -137,6 +395,13 @@ double stochastic_traceback(
     ArgHmmMatrixIter *matrix_iter,
     double **fw, int *path, bool last_state_given=false, bool internal=false);
 
+// traceback that recomputes forward columns if the table does not keep them
+// matrix_iter must compute emissions in that case
+double stochastic_traceback(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardTable *forward,
+    int *path, bool last_state_given=false, bool internal=false);
+
 //=============================================================================
 // ARG thread sampling
 
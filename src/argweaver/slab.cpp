@@ -0,0 +1,178 @@
+// c/c++ includes
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+// arghmm includes
+#include "logging.h"
+#include "slab.h"
+
+
+namespace argweaver {
+
+
+struct SlabArena::Slab
+{
+    int size_class;   // -1 for a region holding a single large array
+    size_t bytes;     // bytes of the region
+    size_t chunk_size;
+    int nused;        // arrays in use
+    char *next;       // first array never handed out
+    char *end;
+    void *free_list;  // freed arrays, linked through their first word
+    Slab *prev;       // neighbors in the list of partial slabs
+    Slab *next_slab;
+};
+
+// arrays start after the slab header
+static const size_t SLAB_HEADER_BYTES = 128;
+
+
+// map a region of bytes aligned to SlabArena::SLAB_BYTES
+static char *map_slab(size_t bytes)
+{
+    const size_t align = SlabArena::SLAB_BYTES;
+    char *region = (char*) mmap(NULL, bytes + align, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        printError("cannot allocate %lu bytes for local trees",
+                   (unsigned long) bytes);
+        abort();
+    }
+
+    // trim the region to the alignment
+    char *slab = (char*) (((uintptr_t) region + align - 1) & ~(align - 1));
+    if (slab > region)
+        munmap(region, slab - region);
+    munmap(slab + bytes, region + align - slab);
+    return slab;
+}
+
+
+static inline SlabArena::Slab *get_slab(void *ptr)
+{
+    return (SlabArena::Slab*) ((uintptr_t) ptr &
+                               ~(SlabArena::SLAB_BYTES - 1));
+}
+
+
+static void link_slab(SlabArena::Slab **list, SlabArena::Slab *slab)
+{
+    slab->prev = NULL;
+    slab->next_slab = *list;
+    if (*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+
+static void unlink_slab(SlabArena::Slab **list, SlabArena::Slab *slab)
+{
+    if (slab->prev)
+        slab->prev->next_slab = slab->next_slab;
+    else
+        *list = slab->next_slab;
+    if (slab->next_slab)
+        slab->next_slab->prev = slab->prev;
+    slab->prev = slab->next_slab = NULL;
+}
+
+
+SlabArena::SlabArena(size_t elem_size) :
+    elem_size(elem_size),
+    bytes(0)
+{}
+
+
+SlabArena::Slab *SlabArena::add_slab(Pool *pool, int size_class)
+{
+    Slab *slab = (Slab*) map_slab(SLAB_BYTES);
+    slab->size_class = size_class;
+    slab->bytes = SLAB_BYTES;
+    slab->chunk_size = (size_class + 1) * CLASS_BYTES;
+    slab->nused = 0;
+    slab->next = (char*) slab + SLAB_HEADER_BYTES;
+    slab->end = slab->next + (SLAB_BYTES - SLAB_HEADER_BYTES) /
+        slab->chunk_size * slab->chunk_size;
+    slab->free_list = NULL;
+    link_slab(&pool->partial, slab);
+    bytes += SLAB_BYTES;
+    return slab;
+}
+
+
+void *SlabArena::alloc(size_t n)
+{
+    const size_t size = max(n * elem_size, sizeof(void*));
+    const int size_class = (size - 1) / CLASS_BYTES;
+
+    // large arrays get a region of their own
+    if (size_class >= MAX_CLASSES ||
+        size > SLAB_BYTES - SLAB_HEADER_BYTES) {
+        const size_t region_bytes = (size + SLAB_HEADER_BYTES +
+                                     SLAB_BYTES - 1) & ~(SLAB_BYTES - 1);
+        Slab *slab = (Slab*) map_slab(region_bytes);
+        slab->size_class = -1;
+        slab->bytes = region_bytes;
+        bytes += region_bytes;
+        return (char*) slab + SLAB_HEADER_BYTES;
+    }
+
+    Pool *pool = &pools[size_class];
+    unique_lock<mutex> guard(pool->lock);
+    Slab *slab = pool->partial;
+    if (!slab)
+        slab = add_slab(pool, size_class);
+
+    // reuse a freed array, or hand out a new one
+    void *ptr;
+    if (slab->free_list) {
+        ptr = slab->free_list;
+        slab->free_list = *(void**) ptr;
+    } else {
+        ptr = slab->next;
+        slab->next += slab->chunk_size;
+    }
+    slab->nused++;
+
+    if (!slab->free_list && slab->next == slab->end)
+        unlink_slab(&pool->partial, slab);
+    return ptr;
+}
+
+
+void SlabArena::free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    Slab *slab = get_slab(ptr);
+    if (slab->size_class == -1) {
+        bytes -= slab->bytes;
+        munmap(slab, slab->bytes);
+        return;
+    }
+
+    assert(slab->size_class >= 0 && slab->size_class < MAX_CLASSES);
+    Pool *pool = &pools[slab->size_class];
+    unique_lock<mutex> guard(pool->lock);
+    const bool full = (!slab->free_list && slab->next == slab->end);
+    *(void**) ptr = slab->free_list;
+    slab->free_list = ptr;
+    slab->nused--;
+
+    if (full) {
+        link_slab(&pool->partial, slab);
+    } else if (slab->nused == 0 &&
+               (slab->prev || slab->next_slab)) {
+        // return an empty slab unless it is the last one with space
+        unlink_slab(&pool->partial, slab);
+        bytes -= slab->bytes;
+        munmap(slab, slab->bytes);
+    }
+}
+
+
+} // namespace argweaver
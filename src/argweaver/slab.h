@@ -0,0 +1,109 @@
+//=============================================================================
+// Slab allocation of local trees
+//
+// An ARG holds tens of thousands of local trees, and each of them is a list
+// entry, a LocalTree, its array of nodes and its node mapping.  Allocating
+// them one by one with new scatters an ARG across the heap and costs a
+// malloc() and free() for every array whenever an ARG is copied or a window
+// is resampled.
+//
+// A SlabArena hands out arrays from slabs of 256 KB instead.  Arrays are
+// grouped into size classes of 16 bytes, and each slab holds arrays of one
+// class.  Node arrays, mappings, LocalTrees and list entries each have an
+// arena of their own, so the trees of an ARG are packed densely by kind.
+// Slabs are aligned to their size and start with a header, so arrays carry
+// no header of their own and are freed without their size.  A slab is
+// returned to the system once all of its arrays are freed, unless it is the
+// last slab of its class with free space.  Arrays larger than a slab get a
+// region of their own.
+
+#ifndef ARGWEAVER_SLAB_H
+#define ARGWEAVER_SLAB_H
+
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+class SlabArena
+{
+public:
+    // arrays of elements of elem_size bytes
+    explicit SlabArena(size_t elem_size);
+
+    // allocate an array of n elements
+    void *alloc(size_t n);
+
+    // free an array returned by alloc()
+    void free(void *ptr);
+
+    // bytes of memory held by the arena
+    size_t get_bytes() const { return bytes; }
+
+    static const size_t SLAB_BYTES = 1 << 18;
+
+    struct Slab;
+
+protected:
+    static const size_t CLASS_BYTES = 16;
+    static const int MAX_CLASSES = 4096;
+
+    struct Pool
+    {
+        Pool() : partial(NULL) {}
+
+        mutex lock;
+        Slab *partial;  // slabs with free arrays
+    };
+
+    Slab *add_slab(Pool *pool, int size_class);
+
+    const size_t elem_size;
+    atomic<size_t> bytes;
+    Pool pools[MAX_CLASSES];
+};
+
+
+// allocator of std containers backed by a SlabArena of its element type
+template <class T>
+class SlabAllocator
+{
+public:
+    typedef T value_type;
+
+    SlabAllocator() {}
+    template <class U>
+    SlabAllocator(const SlabAllocator<U> &/*other*/) {}
+
+    T *allocate(size_t n)
+    {
+        return (T*) get_arena().alloc(n);
+    }
+
+    void deallocate(T *ptr, size_t /*n*/)
+    {
+        get_arena().free(ptr);
+    }
+
+    // one arena for each element type that lives as long as the process
+    static SlabArena &get_arena()
+    {
+        static SlabArena *arena = new SlabArena(sizeof(T));
+        return *arena;
+    }
+
+    template <class U>
+    bool operator==(const SlabAllocator<U> &/*other*/) const { return true; }
+    template <class U>
+    bool operator!=(const SlabAllocator<U> &/*other*/) const { return false; }
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_SLAB_H
@@ -33,7 +33,7 @@ FILE *read_tabix(const char *filename, const char *region,
 
 
 int close_tabix(FILE *stream) {
-    return pclose(stream);
+    return close_compress(stream);
 }
 
 }
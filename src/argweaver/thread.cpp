@@ -443,7 +443,7 @@ void add_arg_thread(LocalTrees *trees, const StatesModel &states_model,
             // determine mapping:
             // all nodes keep their name expect the broken node, which is the
             // parent of recomb
-            int *mapping2 = new int [tree->capacity];
+            int *mapping2 = alloc_node_mapping(tree->capacity);
             for (int j=0; j<nnodes2; j++)
                 mapping2[j] = j;
             if (spr2.recomb_node != spr2.coal_node)
@@ -469,6 +469,7 @@ void add_arg_thread(LocalTrees *trees, const StatesModel &states_model,
             ++it;
             it = trees->trees.insert(it,
                 LocalTreeSpr(new_tree, spr2, block_end - pos, mapping2));
+            trees->invalidate_index();
 
 
             // assert tree and SPR
@@ -832,7 +833,7 @@ void sample_arg_removal_path_forward(
             if (next_nodes[1] == -1)
                 j = 0;
             else
-                j = int(rand() < prob_switch);
+                j = int(rand_int() < prob_switch);
             path[i++] = next_nodes[j];
 
             // ensure that a removal path re-enters the local tree correctly
@@ -869,7 +870,7 @@ void sample_arg_removal_path_backward(
         if (prev_nodes[1] == -1)
             j = 0;
         else
-            j = int(rand() < prob_switch);
+            j = int(rand_int() < prob_switch);
         path[i--] = prev_nodes[j];
 
         spr2 = &it->spr;
@@ -1392,9 +1393,7 @@ void add_spr_branch(const LocalTree *tree, const LocalTree *last_tree,
     const LocalNode *last_nodes = last_tree->nodes;
     int node2 = state.node;
     int last_newcoal = last_nodes[last_subtree_root].parent;
-    static int count=0;
     bool fix_mapping=true;
-    count++;
 
 #ifdef DEBUG
     Spr orig_spr(*spr);
@@ -1637,7 +1636,7 @@ void add_arg_thread_path(LocalTrees *trees, const StatesModel &states_model,
             // determine mapping:
             // all nodes keep their name except the broken node, which is the
             // parent of recomb
-            int *mapping2 = new int [tree->capacity];
+            int *mapping2 = alloc_node_mapping(tree->capacity);
             for (int j=0; j<tree->nnodes; j++)
                 mapping2[j] = j;
             if (spr2.recomb_node != spr2.coal_node)
@@ -1663,6 +1662,7 @@ void add_arg_thread_path(LocalTrees *trees, const StatesModel &states_model,
             ++it;
             it = trees->trees.insert(it,
                 LocalTreeSpr(new_tree, spr2, block_end - pos, mapping2));
+            trees->invalidate_index();
 
             // remember the previous tree for next iteration of loop
             tree = new_tree;
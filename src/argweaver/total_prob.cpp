@@ -1,4 +1,5 @@
 // c++ includes
+#include <algorithm>
 #include <list>
 #include <vector>
 #include <string.h>
@@ -35,28 +36,40 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
     for (int j=0; j<nseqs; j++)
         seqs[j] = sequences->seqs[trees->seqids[j]];
 
+    // start from the block containing start_coord
     int end = trees->start_coord;
+    LocalTrees::const_iterator it = trees->begin();
+    if (start_coord > trees->start_coord)
+        it = trees->find(start_coord, &end);
     int mu_idx = 0, rho_idx = 0;
-    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end(); ++it) {
+    for (; it!=trees->end(); ++it) {
         int start = end;
         end = start + it->blocklen;
         if (end <= start_coord) continue;
         if (start >= end_coord) break;
         if (start < start_coord) start = start_coord;
         if (end > end_coord) end = end_coord;
-        LocalTree *tree = it->tree;
-        ArgModel local_model;
-
-        //note: this is approximate, uses mu/rho from center of block
-        model->get_local_model((start+end)/2, local_model, &mu_idx, &rho_idx);
-        lnl += likelihood_tree(tree, &local_model, seqs, sequences->base_probs,
-                               nseqs, start, end);
+        lnl += calc_block_likelihood(model, sequences, it->tree, seqs,
+                                     start, end, &mu_idx, &rho_idx);
     }
 
     return lnl;
 }
 
 
+double calc_block_likelihood(const ArgModel *model, const Sequences *sequences,
+                             const LocalTree *tree, char **seqs,
+                             int start, int end, int *mu_idx, int *rho_idx)
+{
+    ArgModel local_model;
+
+    //note: this is approximate, uses mu/rho from center of block
+    model->get_local_model((start+end)/2, local_model, mu_idx, rho_idx);
+    return likelihood_tree(tree, &local_model, seqs, sequences->base_probs,
+                           sequences->get_num_seqs(), start, end);
+}
+
+
     // TODO: This fills in compressed sites with A's... should
     // take mask into account!
 // NOTE: trees should be uncompressed and sequences compressed
@@ -71,8 +84,6 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
         return calc_arg_likelihood(model, sequences, trees, start_coord, end_coord);
 
     double lnl = 0.0;
-    int nseqs = sequences->get_num_seqs();
-    const char default_char = 'A';
 
     if (start_coord < trees->start_coord)
         start_coord = trees->start_coord;
@@ -83,20 +94,15 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
     if (trees->nnodes < 3)
         return lnl += log(.25) * (end_coord - start_coord);
 
-    bool have_base_probs = ( sequences->base_probs.size() > 0 );
-    vector<vector<BaseProbs> > base_probs;
-    if (have_base_probs) {
-        for (int j=0; j < nseqs; j++) {
-            base_probs.push_back(vector<BaseProbs>());
-        }
-    }
-
+    // start from the block containing start_coord
     int end = trees->start_coord;
+    LocalTrees::const_iterator it = trees->begin();
+    if (start_coord > trees->start_coord)
+        it = trees->find(start_coord, &end);
     int mu_idx = 0;
     int rho_idx = 0;
     int mask_pos=0;
-    bool mask_sorted = maskmap_uncompressed->is_sorted();
-    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end(); ++it) {
+    for (; it!=trees->end(); ++it) {
         int start = end;
         end = start + it->blocklen;
         if (end <= start_coord) continue;
@@ -105,58 +111,72 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
             start = start_coord;
         if (end > end_coord)
             end = end_coord;
-        int blocklen = end - start;
-        LocalTree *tree = it->tree;
+        lnl += calc_block_likelihood(model, sequences, it->tree,
+                                     &trees->seqids[0], start, end,
+                                     sites_mapping, maskmap_uncompressed,
+                                     &mask_pos, &mu_idx, &rho_idx);
+    }
 
+    return lnl;
+}
 
-        // get sequences for trees
-        char *seqs[nseqs];
-        char *matrix = new char [blocklen*nseqs];
-        for (int j=0; j<nseqs; j++)
-            seqs[j] = &matrix[j*blocklen];
-        if (have_base_probs) {
-            for (int j=0; j < nseqs; j++) base_probs[j].clear();
-        }
 
+double calc_block_likelihood(const ArgModel *model, const Sequences *sequences,
+                             const LocalTree *tree, const int *seqids,
+                             int start, int end,
+                             const SitesMapping* sites_mapping,
+                             const TrackNullValue *maskmap_uncompressed,
+                             int *mask_pos, int *mu_idx, int *rho_idx)
+{
+    const int nseqs = sequences->get_num_seqs();
+    const char default_char = 'A';
+    const int blocklen = end - start;
+    const bool have_base_probs = ( sequences->base_probs.size() > 0 );
+    const bool mask_sorted = maskmap_uncompressed->is_sorted();
+    vector<vector<BaseProbs> > base_probs;
+    if (have_base_probs)
+        base_probs.resize(nseqs);
 
-        // find first site within this block
-        unsigned int i2 = 0;
-
-        // copy sites into new alignment
-        for (int i=start; i<end; i++) {
-            while (i2 < sites_mapping->all_sites.size() &&
-                   sites_mapping->all_sites[i2] < i)
-                i2++;
-            if (i2 < sites_mapping->all_sites.size() &&
-                i == sites_mapping->all_sites[i2]) {
-                // copy site
-                for (int j=0; j<nseqs; j++) {
-                    seqs[j][i-start] = sequences->seqs[trees->seqids[j]][i2];
-                    if (have_base_probs)
-                        base_probs[j].push_back(BaseProbs(sequences->base_probs[trees->seqids[j]][i2]));
-                }
-            } else {
-                // copy non-variant site
-                char c=default_char;
-                if (maskmap_uncompressed->find(i, &mask_pos, mask_sorted))
-                    c='N';
-                for (int j=0; j<nseqs; j++) {
-                    seqs[j][i-start] = c;
-                    if (have_base_probs)
-                        base_probs[j].push_back(BaseProbs(default_char));
-                }
+    // get sequences for trees
+    char *seqs[nseqs];
+    char *matrix = new char [blocklen*nseqs];
+    for (int j=0; j<nseqs; j++)
+        seqs[j] = &matrix[j*blocklen];
+
+    // find first site within this block
+    const vector<int> &all_sites = sites_mapping->all_sites;
+    unsigned int i2 = lower_bound(all_sites.begin(), all_sites.end(), start)
+        - all_sites.begin();
+
+    // copy sites into new alignment
+    for (int i=start; i<end; i++) {
+        if (i2 < all_sites.size() && i == all_sites[i2]) {
+            // copy site
+            for (int j=0; j<nseqs; j++) {
+                seqs[j][i-start] = sequences->seqs[seqids[j]][i2];
+                if (have_base_probs)
+                    base_probs[j].push_back(BaseProbs(sequences->base_probs[seqids[j]][i2]));
+            }
+            i2++;
+        } else {
+            // copy non-variant site
+            char c=default_char;
+            if (maskmap_uncompressed->find(i, mask_pos, mask_sorted))
+                c='N';
+            for (int j=0; j<nseqs; j++) {
+                seqs[j][i-start] = c;
+                if (have_base_probs)
+                    base_probs[j].push_back(BaseProbs(default_char));
             }
         }
-
-        ArgModel local_model;
-        model->get_local_model((start+end)/2, local_model,
-                               &mu_idx, &rho_idx);
-        lnl += likelihood_tree(tree, &local_model, seqs, base_probs,
-                               nseqs, 0, end-start);
-
-        delete [] matrix;
     }
 
+    ArgModel local_model;
+    model->get_local_model((start+end)/2, local_model, mu_idx, rho_idx);
+    double lnl = likelihood_tree(tree, &local_model, seqs, base_probs,
+                                 nseqs, 0, end-start);
+
+    delete [] matrix;
     return lnl;
 }
 
@@ -496,26 +516,23 @@ double calc_arg_prior(const ArgModel *model, const LocalTrees *trees,
     if (end_coord < 0 || end_coord > trees->end_coord)
         end_coord = trees->end_coord;
 
-    int next_self_pos = ( num_invis == 0 ?
-                          trees->end_coord + 1 : invisible_recomb_pos[0] );
     int self_idx = 0;
-    while (start_coord > next_self_pos) {
+    while (self_idx < num_invis &&
+           invisible_recomb_pos[self_idx] < start_coord)
         self_idx++;
-        if (self_idx == num_invis) {
-            next_self_pos = trees->end_coord + 1;
-            break;
-        }
-        next_self_pos = invisible_recomb_pos[self_idx];
-    }
 
     // first tree prior
         if (start_coord <= trees->start_coord)
         lnl += calc_log_tree_prior(model, trees->front().tree, lineages);
     //    printLog(LOG_MEDIUM, "tree_prior: %f\n", lnl);
 
+    // start from the block containing start_coord
     int end = trees->start_coord;
+    LocalTrees::const_iterator it = trees->begin();
+    if (start_coord > trees->start_coord)
+        it = trees->find(start_coord, &end);
     int mu_idx = 0, rho_idx = 0;
-    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();) {
+    while (it != trees->end()) {
         int start=end;
         end += it->blocklen;
         if (end <= start_coord) {++it; continue;}
@@ -524,54 +541,68 @@ double calc_arg_prior(const ArgModel *model, const LocalTrees *trees,
             start = start_coord;
         if (end > end_coord)
             end = end_coord;
-        int last_pos = start;
         LocalTree *tree = it->tree;
-        double treelen = get_treelen(tree, model->times, model->ntimes, false);
-        ArgModel local_model;
-        model->get_local_model((start+end)/2, local_model, &mu_idx, &rho_idx);
-        lineages.count(tree, model->pop_tree);
 
-        // not sure what this is for but it is only used for non-SMC' calcs
-        lineages.nrecombs[tree->nodes[tree->root].age]--;
+        // invisible recombinations within the block
+        const int first_self = self_idx;
+        while (self_idx < num_invis && invisible_recomb_pos[self_idx] < end)
+            self_idx++;
 
-        // calculate probability P(blocklen | T_{i-1})
-        double recomb_rate = max(local_model.rho * treelen, local_model.rho);
+        ++it;
+        const Spr *next_spr = (end < end_coord ? &it->spr : NULL);
+        lnl += calc_block_prior(model, tree, start, end, next_spr, lineages,
+                                num_coal, num_nocoal,
+                                invisible_recomb_pos.data() + first_self,
+                                invisible_recombs.data() + first_self,
+                                self_idx - first_self, &mu_idx, &rho_idx);
+    }
+    return lnl;
+ }
 
-        while (next_self_pos < end) {
-            lnl += log(recomb_rate) - recomb_rate * (next_self_pos - last_pos);
-            last_pos = next_self_pos;
-            lnl += calc_log_spr_prob(&local_model, tree, invisible_recombs[self_idx],
-                                     lineages, treelen, num_coal, num_nocoal, 1.0, true);
-            self_idx++;
-            if (self_idx == num_invis) {
-                next_self_pos = end_coord + 1;
-            } else {
-                next_self_pos = invisible_recomb_pos[self_idx];
-            }
-        }
 
+double calc_block_prior(const ArgModel *model, const LocalTree *tree,
+                        int start, int end, const Spr *next_spr,
+                        LineageCounts &lineages,
+                        double **num_coal, double **num_nocoal,
+                        const int *invisible_recomb_pos,
+                        const Spr *invisible_recombs, int ninvisible,
+                        int *mu_idx, int *rho_idx)
+{
+    double lnl = 0.0;
+    int last_pos = start;
+    double treelen = get_treelen(tree, model->times, model->ntimes, false);
+    ArgModel local_model;
+    model->get_local_model((start+end)/2, local_model, mu_idx, rho_idx);
+    lineages.count(tree, model->pop_tree);
 
+    // not sure what this is for but it is only used for non-SMC' calcs
+    lineages.nrecombs[tree->nodes[tree->root].age]--;
 
-        if (end < end_coord) {
-            // not last block
-            // probability of recombining after blocklen
-	    lnl += log(recomb_rate) - recomb_rate * (end - last_pos);
+    // calculate probability P(blocklen | T_{i-1})
+    double recomb_rate = max(local_model.rho * treelen, local_model.rho);
 
-            // get SPR move information
-            ++it;
-            const Spr *spr = &it->spr;
-            lnl += calc_log_spr_prob(&local_model, tree, *spr, lineages, treelen,
-                                     num_coal, num_nocoal, 1.0, true);
+    for (int i=0; i<ninvisible; i++) {
+        lnl += log(recomb_rate) - recomb_rate * (invisible_recomb_pos[i] - last_pos);
+        last_pos = invisible_recomb_pos[i];
+        lnl += calc_log_spr_prob(&local_model, tree, invisible_recombs[i],
+                                 lineages, treelen, num_coal, num_nocoal, 1.0, true);
+    }
 
-        } else {
-            // last block
-            // probability of not recombining after blocklen
-            lnl += - recomb_rate * (end - last_pos);
-            ++it;
-        }
+    if (next_spr) {
+        // not last block
+        // probability of recombining after blocklen
+        lnl += log(recomb_rate) - recomb_rate * (end - last_pos);
+
+        // get SPR move information
+        lnl += calc_log_spr_prob(&local_model, tree, *next_spr, lineages, treelen,
+                                 num_coal, num_nocoal, 1.0, true);
+    } else {
+        // last block
+        // probability of not recombining after blocklen
+        lnl += - recomb_rate * (end - last_pos);
     }
     return lnl;
- }
+}
 
 double calc_arg_prior_recomb_integrate(const ArgModel *model,
                                        const LocalTrees *trees,
@@ -599,9 +630,13 @@ double calc_arg_prior_recomb_integrate(const ArgModel *model,
         *first_tree_lnprob = lnl;
     //    printLog(LOG_MEDIUM, "tree_prior: %f\n", lnl);
 
+    // start from the block containing start_coord
     int rho_idx = 0;
     int end = trees->start_coord;
-    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end(); ) {
+    LocalTrees::const_iterator it = trees->begin();
+    if (start_coord > trees->start_coord)
+        it = trees->find(start_coord, &end);
+    while (it != trees->end()) {
         int start = end;
         end += it->blocklen;
         if (end <= start_coord) {++it; continue;}
@@ -612,153 +647,168 @@ double calc_arg_prior_recomb_integrate(const ArgModel *model,
             end = end_coord;
         int blocklen = end - start;
         LocalTree *tree = it->tree;
-        double treelen = get_treelen(tree, model->times, model->ntimes, false);
-        lineages.count(tree, model->pop_tree);
-        const int root_age = tree->nodes[tree->root].age;
-        lineages.nrecombs[root_age]--;  // SMC' calcs not affected by this
 
         // calculate probability P(blocklen | T_{i-1})
         double rho = model->get_local_rho(trees->start_coord, &rho_idx);
-        double recomb_rate = max(rho * treelen, rho);
+
+        ++it;
+        const Spr *next_spr = (end < end_coord ? &it->spr : NULL);
+        lnl += calc_block_prior_recomb_integrate(
+            model, tree, blocklen, next_spr, rho, lineages,
+            num_coal, num_nocoal);
+    }
+    assert(!isnan(lnl));
+    assert(!isinf(lnl));
+    return lnl;
+}
 
 
-        //for single site, probability of no recomb
-        double pr_no_recomb = exp(-recomb_rate);
-        double pr_recomb = 1.0 - pr_no_recomb;
-        double pr_self = 0.0;
+double calc_block_prior_recomb_integrate(
+    const ArgModel *model, LocalTree *tree, int blocklen,
+    const Spr *next_spr, double rho, LineageCounts &lineages,
+    double **num_coal, double **num_nocoal)
+{
+    double lnl = 0.0;
+    double treelen = get_treelen(tree, model->times, model->ntimes, false);
+    lineages.count(tree, model->pop_tree);
+    const int root_age = tree->nodes[tree->root].age;
+    lineages.nrecombs[root_age]--;  // SMC' calcs not affected by this
 
-        // only do this for smc_prime because under non-smc-prime, recombs to
-        // parent/sister branch that do not change topology are still in ARG
-        if (model->smc_prime)
-            pr_self = pr_recomb * exp(calc_log_self_recomb_prob(model, tree, lineages, treelen));
-        double log_pr_nochange  = log(pr_no_recomb + pr_self);
+    // calculate probability P(blocklen | T_{i-1})
+    double recomb_rate = max(rho * treelen, rho);
 
 
-        if (end >= end_coord)
-            blocklen++;
-        if (blocklen > 1) {
-            lnl += ((double)blocklen - 1.0)*log_pr_nochange;
+    //for single site, probability of no recomb
+    double pr_no_recomb = exp(-recomb_rate);
+    double pr_recomb = 1.0 - pr_no_recomb;
+    double pr_self = 0.0;
+
+    // only do this for smc_prime because under non-smc-prime, recombs to
+    // parent/sister branch that do not change topology are still in ARG
+    if (model->smc_prime)
+        pr_self = pr_recomb * exp(calc_log_self_recomb_prob(model, tree, lineages, treelen));
+    double log_pr_nochange  = log(pr_no_recomb + pr_self);
+
+
+    if (!next_spr)
+        blocklen++;
+    if (blocklen > 1) {
+        lnl += ((double)blocklen - 1.0)*log_pr_nochange;
+    }
+
+    if (next_spr) {
+        // not last block, add probability of any recomb that results in
+        // same topology as sampled SPR
+
+        // get SPR move information
+        const Spr *real_spr = next_spr;
+        int node = real_spr->recomb_node;
+        int parent = tree->nodes[node].parent;
+        int sib = tree->nodes[parent].child[0] == node ?
+            tree->nodes[parent].child[1] : tree->nodes[parent].child[0];
+        int max_age = min(tree->nodes[parent].age,
+                          real_spr->coal_time);
+        assert(tree->nodes[node].age <= max_age);
+        assert(real_spr->recomb_time >= tree->nodes[node].age &&
+               real_spr->recomb_time <= max_age);
+        if (real_spr->coal_time == tree->nodes[parent].age &&
+            (real_spr->coal_node == parent ||
+             real_spr->coal_node == sib) &&
+            model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
+                               real_spr->recomb_time, real_spr->coal_time)) {
+            lnl += log_pr_nochange;
+            return lnl;
         }
 
-        if (end < end_coord) {
-            // not last block, add probability of any recomb that results in
-            // same topology as sampled SPR
-
-            // get SPR move information
-            ++it;
-            const Spr *real_spr = &it->spr;
-            int node = real_spr->recomb_node;
-            int parent = tree->nodes[node].parent;
-            int sib = tree->nodes[parent].child[0] == node ?
-                tree->nodes[parent].child[1] : tree->nodes[parent].child[0];
-            int max_age = min(tree->nodes[parent].age,
-                              real_spr->coal_time);
-            assert(tree->nodes[node].age <= max_age);
-            assert(real_spr->recomb_time >= tree->nodes[node].age &&
-                   real_spr->recomb_time <= max_age);
-            if (real_spr->coal_time == tree->nodes[parent].age &&
-                (real_spr->coal_node == parent ||
-                 real_spr->coal_node == sib) &&
-                model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
+        // from here we assume that the SPR changes the tree
+        double recomb_sum = 0.0;
+        int target_path = model->consistent_path(tree->nodes[node].pop_path,
+                                                 real_spr->pop_path,
+                                                 tree->nodes[node].age,
+                                                 real_spr->recomb_time,
+                                                 real_spr->coal_time);
+        double coal_rates[2*model->ntimes];
+        int minage = tree->nodes[node].age;
+        bool coalToSib = false;
+        bool coalToParent = false;
+        if (real_spr->coal_node == sib) {
+            if (model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
                                    real_spr->recomb_time, real_spr->coal_time)) {
-                lnl += log_pr_nochange;
-                continue;
+                coalToSib = true;
+                if (tree->nodes[sib].age < minage)
+                    minage = tree->nodes[sib].age;
             }
-
-            // from here we assume that the SPR changes the tree
-            double recomb_sum = 0.0;
-            int target_path = model->consistent_path(tree->nodes[node].pop_path,
-                                                     real_spr->pop_path,
-                                                     tree->nodes[node].age,
-                                                     real_spr->recomb_time,
-                                                     real_spr->coal_time);
-            double coal_rates[2*model->ntimes];
-            int minage = tree->nodes[node].age;
-            bool coalToSib = false;
-            bool coalToParent = false;
-            if (real_spr->coal_node == sib) {
-                if (model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
-                                       real_spr->recomb_time, real_spr->coal_time)) {
-                    coalToSib = true;
-                    if (tree->nodes[sib].age < minage)
-                        minage = tree->nodes[sib].age;
-                }
-            } else if (real_spr->coal_node == parent) {
-                int path = model->consistent_path(tree->nodes[node].pop_path,
-                                                  tree->nodes[parent].pop_path,
-                                                  tree->nodes[node].age,
-                                                  tree->nodes[parent].age,
-                                                  real_spr->coal_time);
-                if (model->paths_equal(path, real_spr->pop_path,
-                                       real_spr->recomb_time, real_spr->coal_time)) {
-                    coalToParent = true;
-                    if (tree->nodes[sib].age < minage)
-                        minage = tree->nodes[sib].age;
-                }
+        } else if (real_spr->coal_node == parent) {
+            int path = model->consistent_path(tree->nodes[node].pop_path,
+                                              tree->nodes[parent].pop_path,
+                                              tree->nodes[node].age,
+                                              tree->nodes[parent].age,
+                                              real_spr->coal_time);
+            if (model->paths_equal(path, real_spr->pop_path,
+                                   real_spr->recomb_time, real_spr->coal_time)) {
+                coalToParent = true;
+                if (tree->nodes[sib].age < minage)
+                    minage = tree->nodes[sib].age;
             }
+        }
 
-            calc_coal_rates_spr(model, tree,
-                                Spr(node, minage, real_spr->coal_node,
-                                    real_spr->coal_time, target_path),
-                                lineages, coal_rates);
-            int this_max_age = min(max_age,
-                                   model->max_matching_path(tree->nodes[node].pop_path,
-                                                            target_path, tree->nodes[node].age));
-            for (int age=tree->nodes[node].age; age <= this_max_age; age++) {
-                Spr spr(node, age, real_spr->coal_node, real_spr->coal_time,
-                        target_path);
+        calc_coal_rates_spr(model, tree,
+                            Spr(node, minage, real_spr->coal_node,
+                                real_spr->coal_time, target_path),
+                            lineages, coal_rates);
+        int this_max_age = min(max_age,
+                               model->max_matching_path(tree->nodes[node].pop_path,
+                                                        target_path, tree->nodes[node].age));
+        for (int age=tree->nodes[node].age; age <= this_max_age; age++) {
+            Spr spr(node, age, real_spr->coal_node, real_spr->coal_time,
+                    target_path);
+            double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
+                                               treelen, num_coal, num_nocoal,
+                                               age == real_spr->recomb_time
+                                               ? 1.0 : 0.0, true, coal_rates));
+            recomb_sum += val;
+        }
+        if (coalToSib) {
+            if (! model->paths_equal(target_path, tree->nodes[sib].pop_path,
+                             tree->nodes[sib].age, real_spr->coal_time)) {
+                calc_coal_rates_spr(model, tree,
+                                    Spr(sib, tree->nodes[sib].age,
+                                        node, real_spr->coal_time,
+                                        tree->nodes[sib].pop_path),
+                                    lineages, coal_rates);
+            }
+            for (int age=tree->nodes[sib].age; age <= max_age; age++) {
+                Spr spr(sib, age, node, real_spr->coal_time,
+                        tree->nodes[sib].pop_path);
                 double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
                                                    treelen, num_coal, num_nocoal,
-                                                   age == real_spr->recomb_time
-                                                   ? 1.0 : 0.0, true, coal_rates));
+                                                   0, true, coal_rates));
                 recomb_sum += val;
             }
-            if (coalToSib) {
-                if (! model->paths_equal(target_path, tree->nodes[sib].pop_path,
-                                 tree->nodes[sib].age, real_spr->coal_time)) {
-                    calc_coal_rates_spr(model, tree,
-                                        Spr(sib, tree->nodes[sib].age,
-                                            node, real_spr->coal_time,
-                                            tree->nodes[sib].pop_path),
-                                        lineages, coal_rates);
-                }
-                for (int age=tree->nodes[sib].age; age <= max_age; age++) {
-                    Spr spr(sib, age, node, real_spr->coal_time,
-                            tree->nodes[sib].pop_path);
-                    double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
-                                                       treelen, num_coal, num_nocoal,
-                                                       0, true, coal_rates));
-                    recomb_sum += val;
-                }
-            } else if (coalToParent) {
-                int path = model->consistent_path(tree->nodes[sib].pop_path,
-                                                  tree->nodes[parent].pop_path,
-                                                  tree->nodes[sib].age,
-                                                  tree->nodes[parent].age,
-                                                  real_spr->coal_time);
-                if (! model->paths_equal(path, tree->nodes[sib].pop_path,
-                                 tree->nodes[sib].age, real_spr->coal_time)) {
-                    calc_coal_rates_spr(model, tree,
-                                        Spr(sib, tree->nodes[sib].age,
-                                            parent, real_spr->coal_time, path),
-                                        lineages, coal_rates);
-                }
-                for (int age=tree->nodes[sib].age; age <= max_age; age++) {
-                    Spr spr(sib, age, parent, real_spr->coal_time, path);
-                    recomb_sum += exp(calc_log_spr_prob(model, tree, spr, lineages,
-                                                        treelen, num_coal, num_nocoal,
-                                                        0, true, coal_rates));
-                }
+        } else if (coalToParent) {
+            int path = model->consistent_path(tree->nodes[sib].pop_path,
+                                              tree->nodes[parent].pop_path,
+                                              tree->nodes[sib].age,
+                                              tree->nodes[parent].age,
+                                              real_spr->coal_time);
+            if (! model->paths_equal(path, tree->nodes[sib].pop_path,
+                             tree->nodes[sib].age, real_spr->coal_time)) {
+                calc_coal_rates_spr(model, tree,
+                                    Spr(sib, tree->nodes[sib].age,
+                                        parent, real_spr->coal_time, path),
+                                    lineages, coal_rates);
+            }
+            for (int age=tree->nodes[sib].age; age <= max_age; age++) {
+                Spr spr(sib, age, parent, real_spr->coal_time, path);
+                recomb_sum += exp(calc_log_spr_prob(model, tree, spr, lineages,
+                                                    treelen, num_coal, num_nocoal,
+                                                    0, true, coal_rates));
             }
-            lnl += log(pr_recomb * recomb_sum);
-	    if (isinf(lnl))
-		assert(0);
-        } else {
-            ++it;
         }
+        lnl += log(pr_recomb * recomb_sum);
+        if (isinf(lnl))
+            assert(0);
     }
-    assert(!isnan(lnl));
-    assert(!isinf(lnl));
     return lnl;
 }
 
@@ -48,6 +48,41 @@ double calc_arg_prior(const ArgModel *model, const LocalTrees *trees,
 double calc_arg_joint_prob(const ArgModel *model, const Sequences *sequences,
                            const LocalTrees *trees);
 
+double calc_log_tree_prior(const ArgModel *model, const LocalTree *tree,
+                           LineageCounts &lineages);
+
+
+// Terms of the totals above for one block [start, end) of the ARG.  The
+// totals are the sums of these terms over blocks.  next_spr is the SPR to
+// the right of the block, or NULL for the last block.
+
+double calc_block_likelihood(const ArgModel *model, const Sequences *sequences,
+                             const LocalTree *tree, char **seqs,
+                             int start, int end,
+                             int *mu_idx=NULL, int *rho_idx=NULL);
+
+// NOTE: start and end uncompressed and sequences compressed
+double calc_block_likelihood(const ArgModel *model, const Sequences *sequences,
+                             const LocalTree *tree, const int *seqids,
+                             int start, int end,
+                             const SitesMapping* sites_mapping,
+                             const TrackNullValue *maskmap_uncompressed,
+                             int *mask_pos, int *mu_idx=NULL,
+                             int *rho_idx=NULL);
+
+double calc_block_prior(const ArgModel *model, const LocalTree *tree,
+                        int start, int end, const Spr *next_spr,
+                        LineageCounts &lineages,
+                        double **num_coal=NULL, double **num_nocoal=NULL,
+                        const int *invisible_recomb_pos=NULL,
+                        const Spr *invisible_recombs=NULL, int ninvisible=0,
+                        int *mu_idx=NULL, int *rho_idx=NULL);
+
+double calc_block_prior_recomb_integrate(
+    const ArgModel *model, LocalTree *tree, int blocklen,
+    const Spr *next_spr, double rho, LineageCounts &lineages,
+    double **num_coal=NULL, double **num_nocoal=NULL);
+
 
 
 } // namespace argweaver
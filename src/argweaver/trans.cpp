@@ -9,12 +9,19 @@
 
 namespace argweaver {
 
-void TransMatrix::initialize(const ArgModel *model, int nstates)
+void TransMatrix::initialize(const ArgModel *model, int nstates, bool expand)
 {
     ntimes = model->ntimes;
     npaths = model->num_pop_paths();
     smc_prime = model->smc_prime;
     pop_tree = model->pop_tree;
+    expanded = expand && !smc_prime;
+    expB = expNegG1 = NULL;
+    if (expanded) {
+        const int expand_len = npaths * ntimes * ntimes;
+        expB = new double [expand_len];
+        expNegG1 = new double [expand_len];
+    }
     int data_len=0;
     if (smc_prime) {
         data_len = npaths * ntimes + 2 * ntimes;
@@ -85,6 +92,32 @@ void TransMatrix::initialize(const ArgModel *model, int nstates)
     assert(idx == data_len);
 }
 
+
+size_t TransMatrix::memory_size() const
+{
+    size_t size = sizeof(*this) + npaths * sizeof(double*) +
+        C1_prime->matSize * sizeof(double) +
+        Q1_prime->matSize * sizeof(double);
+    if (!smc_prime) {
+        size += (ntimes*2 + npaths*ntimes*4 + npaths*npaths*ntimes*3) *
+            sizeof(double);
+        size += npaths * (5 + 3 * npaths) * sizeof(double*);
+        if (expanded)
+            size += 2 * npaths * ntimes * ntimes * sizeof(double);
+    } else {
+        const MultiArray *arrays[] = {
+            B0_prime, B1_prime, B2_prime, C0_prime, Q0_prime,
+            E0_prime, E1_prime, E2_prime, F0_prime, F1_prime, F2_prime,
+            G0_prime, G1_prime, G2_prime, L0_prime, L1_prime, L2_prime,
+            K0_prime, K1_prime, K2_prime, RK0_prime, RK2_prime};
+        for (unsigned int i=0; i<sizeof(arrays) / sizeof(arrays[0]); i++)
+            size += arrays[i]->matSize * sizeof(double);
+        size += (npaths * ntimes + 2 * ntimes + nstates) * sizeof(double);
+    }
+    return size;
+}
+
+
 void calc_coal_rates_partial_tree(const ArgModel *model, const LocalTree *tree,
                                   const LineageCounts *lineages,
                                   MultiArray *coal_rates,
@@ -219,9 +252,6 @@ double TransMatrix::selfRecombDiffTimeProb(int min_k, int max_k,
                                            int max_d, int path_d,
                                            int a, int path_a) const {
     if (min_k > max_k) return -INFINITY;
-    static int count=0;
-    static int total_count=0;
-    total_count++;
     assert(max_k < max_d);
     double kstar = get_k_term(max_d, path_d, a, path_a);   // not log space
     double bstar = logsub(get_b_term(max_k, path_d, a, path_a),
@@ -231,8 +261,6 @@ double TransMatrix::selfRecombDiffTimeProb(int min_k, int max_k,
     double val1 = log(kstar) + bstar;
     double val2 = rkstar;
     if (fabs(val1 - val2)/fabs(val1) < 1.0e-8) {
-        count++;
-        //        printf("val1=%e val2=%e diff=%e count=%i total=%i\n", val1, val2, fabs(val1-val2)/fabs(val1), count, total_count);
         return INFINITY;
     }
     return logsub(log(kstar)+bstar, rkstar);
@@ -259,7 +287,8 @@ inline double TransMatrix::self_recomb_prob(int a, int path_a,
     //    use state_time : 1 = branch_start, 2=branch_start+1, ...,
     //        1 + branch_end -branch_start = branch_end,
     //        2 + branch_end - branch_start for > branch_end
-    static MultiArray branchProbs(5, npaths, ntimes, ntimes, npaths, ntimes);
+    // (one table per thread, since matrices may be built concurrently)
+    static thread_local MultiArray branchProbs(5, npaths, ntimes, ntimes, npaths, ntimes);
     if (path_a == -1 && path_d == -1)
         branchProbs.set_all(-1.0);
     int age_idx = ( a > max_d ? max_d - min_d + 2 :
@@ -901,6 +930,30 @@ void TransMatrix::calc_transition_probs(const LocalTree *tree,
             E[path][b] = 1.0 / ncoal;
         }
     }
+
+    // tabulate the exponentiated terms of get_time() for the paths of
+    // the states.  get_time() only looks up k < b.
+    if (expanded) {
+        bool have_state_path[num_paths];
+        fill(have_state_path, have_state_path + num_paths, num_paths == 1);
+        for (unsigned int i=0; i < states.size(); i++)
+            have_state_path[states[i].pop_path] = true;
+
+        for (int path=0; path < num_paths; path++) {
+            if (! have_state_path[path]) continue;
+            const double *lnE2_row = lnE2[path][path];
+            const double *lnB_row = lnB[path][path];
+            const double *lnNegG1_row = lnNegG1[path][path];
+            for (int b=0; b < ntimes-1; b++) {
+                double *expB_row = &expB[(path * ntimes + b) * ntimes];
+                double *expNegG1_row = &expNegG1[(path * ntimes + b) * ntimes];
+                for (int k=0; k < b; k++) {
+                    expB_row[k] = exp(lnE2_row[b] + lnB_row[k]);
+                    expNegG1_row[k] = exp(lnE2_row[b] + lnNegG1_row[k]);
+                }
+            }
+        }
+    }
     if (false) {
         assert_transmat(tree, model, states, lineages, minage0);
     }
@@ -1641,8 +1694,6 @@ void calc_transition_probs_switch(
     const int last_subtree_root = internal ? last_nodes[last_root].child[0] : -1;
     const int minage1 = internal ? last_nodes[last_subtree_root].age : 0;
     const int minage2 = internal ?  nodes[subtree_root].age : 0;
-    static int count=0;
-    count++;
 
     //    printf("calc_transition_probs_switch internal=%i\n", internal);
     for (int i=0; i < max(1,nstates1); i++)
@@ -2088,6 +2139,126 @@ void calc_transition_probs_switch(
 }
 
 
+//=============================================================================
+// transition matrix keys
+
+
+// append the bytes of an array to a key
+template <class T>
+static inline void append_key(string &key, const T *data, int n)
+{
+    key.append((const char*) data, n * sizeof(T));
+}
+
+template <class T>
+static inline void append_key(string &key, const T value)
+{
+    append_key(key, &value, 1);
+}
+
+
+void get_transmat_key(const LocalTree *tree, const ArgModel *model,
+                      const States &states, const LineageCounts *lineages,
+                      bool internal, int minage, string &key)
+{
+    const int ntimes = model->ntimes;
+    const int npaths = model->num_pop_paths();
+    const LocalNode *nodes = tree->nodes;
+    const int subtree_root = internal ? nodes[tree->root].child[0] : -1;
+    const int maintree_root = internal ? nodes[tree->root].child[1] : -1;
+
+    key.clear();
+    append_key(key, model->smc_prime);
+    append_key(key, model->rho);
+    append_key(key, (int) states.size());
+    append_key(key, internal);
+    append_key(key, minage);
+
+    // root age and tree length
+    if (internal) {
+        append_key(key, nodes[subtree_root].age);
+        append_key(key, nodes[maintree_root].age);
+        append_key(key, get_treelen_internal(tree, model->times, ntimes));
+    } else {
+        append_key(key, nodes[tree->root].age);
+        append_key(key, get_treelen(tree, model->times, ntimes, false));
+    }
+
+    append_key(key, lineages->nbranches, ntimes);
+    append_key(key, lineages->nrecombs, ntimes);
+    for (int i=0; i<lineages->npops; i++) {
+        append_key(key, lineages->nbranches_pop[i], 2 * ntimes);
+        append_key(key, lineages->ncoals_pop[i], ntimes);
+    }
+
+    // population paths of the states and of the tree
+    if (npaths > 1) {
+        char have_path[2 * npaths];
+        fill(have_path, have_path + 2 * npaths, 0);
+        for (unsigned int i=0; i<states.size(); i++)
+            have_path[states[i].pop_path] = 1;
+        for (int i=0; i<tree->nnodes; i++)
+            if (i != subtree_root)
+                have_path[npaths + nodes[i].pop_path] = 1;
+        append_key(key, have_path, 2 * npaths);
+    }
+
+    // SMC' self recombination probabilities depend on the branches of the
+    // tree and on every state
+    if (model->smc_prime) {
+        append_key(key, tree->root);
+        for (int i=0; i<tree->nnodes; i++) {
+            const int parent = nodes[i].parent;
+            append_key(key, nodes[i].age);
+            append_key(key, parent == -1 ? -1 : nodes[parent].age);
+            append_key(key, nodes[i].pop_path);
+        }
+        for (unsigned int i=0; i<states.size(); i++) {
+            append_key(key, states[i].node);
+            append_key(key, states[i].time);
+            append_key(key, states[i].pop_path);
+        }
+    }
+}
+
+
+void get_transmat_switch_key(const LocalTree *tree, const LocalTree *last_tree,
+                             const Spr &spr, const int *mapping,
+                             const ArgModel *model,
+                             const StatesModel &states_model, string &key)
+{
+    // the states of both blocks follow from the trees and the states model
+    key.clear();
+    append_key(key, model->rho);
+    append_key(key, states_model.internal);
+    append_key(key, states_model.minage);
+    append_key(key, states_model.start_pop);
+    append_key(key, spr.recomb_node);
+    append_key(key, spr.recomb_time);
+    append_key(key, spr.coal_node);
+    append_key(key, spr.coal_time);
+    append_key(key, spr.pop_path);
+
+    append_key(key, tree->root);
+    append_key(key, tree->nnodes);
+    for (int i=0; i<tree->nnodes; i++) {
+        const LocalNode &node = tree->nodes[i];
+        const int data[] = {node.parent, node.child[0], node.child[1],
+                            node.age, node.pop_path};
+        append_key(key, data, 5);
+    }
+    append_key(key, last_tree->root);
+    append_key(key, last_tree->nnodes);
+    for (int i=0; i<last_tree->nnodes; i++) {
+        const LocalNode &node = last_tree->nodes[i];
+        const int data[] = {node.parent, node.child[0], node.child[1],
+                            node.age, node.pop_path};
+        append_key(key, data, 5);
+    }
+    append_key(key, mapping, last_tree->nnodes);
+}
+
+
 //=============================================================================
 // prior for state space
 
@@ -22,12 +22,12 @@ class PopulationTree;
 class TransMatrix
 {
 public:
-    TransMatrix(const ArgModel *model, int nstates) :
+    TransMatrix(const ArgModel *model, int nstates, bool expand=true) :
         nstates(nstates),
         internal(false),
         smc_prime(false)
     {
-        initialize(model, nstates);
+        initialize(model, nstates, expand);
     }
 
     ~TransMatrix()
@@ -73,11 +73,15 @@ public:
         }
         delete [] path_prob;
         delete [] data_alloc;
+        delete [] expB;
+        delete [] expNegG1;
     }
 
     // allocate space for transition matrix
     // and initialize paths_equal matrix
-    void initialize(const ArgModel *model, int nstates);
+    // If 'expand' is true (SMC only), the exponentiated terms used by
+    // get_time() are also tabulated by calc_transition_probs().
+    void initialize(const ArgModel *model, int nstates, bool expand=true);
 
     // Probability of transition from state i to state j.
     inline double get(
@@ -105,6 +109,24 @@ public:
                         minage, node1 == node2, i);
     }
 
+    // exp(lnE2[path1][path2][b] + lnB[path1][path2][k]), for k < b
+    inline double exp_b(int path1, int path2, int b, int k) const
+    {
+        assert(k < b);
+        if (expanded && path1 == path2)
+            return expB[(path1 * ntimes + b) * ntimes + k];
+        return exp(lnE2[path1][path2][b] + lnB[path1][path2][k]);
+    }
+
+    // exp(lnE2[path1][path2][b] + lnNegG1[path1][path2][k]), for k < b
+    inline double exp_neg_g1(int path1, int path2, int b, int k) const
+    {
+        assert(k < b);
+        if (expanded && path1 == path2)
+            return expNegG1[(path1 * ntimes + b) * ntimes + k];
+        return exp(lnE2[path1][path2][b] + lnNegG1[path1][path2][k]);
+    }
+
     // Returns the probability of transition from state1 with time 'a'
     // to state2 with time 'b'.  The probability also depends on whether
     // the node changes between states ('same_node') or whether there is
@@ -127,26 +149,20 @@ public:
         double term1 = D[a] * E[path_b][b] * path_prob[path_b][b];
         double minage_term = 0.0;
         if (minage > 0) {
-            minage_term = exp(lnE2[path_b][path_b][b] +
-                              lnB[path_b][path_b][minage-1]);
+            minage_term = exp_b(path_b, path_b, b, minage-1);
         }
         if (p < a && p < b) {
-            prob = term1 * (exp(lnE2[path_b][path_b][b] +
-                                lnB[path_b][path_b][p])
+            prob = term1 * (exp_b(path_b, path_b, b, p)
                             - minage_term);
         } else if (a <= p && a < b) {
-            prob = term1 * (exp(lnE2[path_b][path_b][b] +
-                                lnB[path_b][path_b][a]) -
-                            exp(lnE2[path_b][path_b][b] +
-                                lnNegG1[path_b][path_b][a])
+            prob = term1 * (exp_b(path_b, path_b, b, a) -
+                            exp_neg_g1(path_b, path_b, b, a)
                             - minage_term);
         } else if (a == b) {
-            prob = term1 * ((b > 0 ? exp(lnE2[path_b][path_b][b] +
-                                         lnB[path_b][path_b][b-1]) : 0.0) +
+            prob = term1 * ((b > 0 ? exp_b(path_b, path_b, b, b-1) : 0.0) +
                             G3[path_b][b] - minage_term);
         } else { // b < a
-            prob = term1 * ((b > 0 ? exp(lnE2[path_b][path_b][b] +
-                                         lnB[path_b][path_b][b-1]) : 0.0)
+            prob = term1 * ((b > 0 ? exp_b(path_b, path_b, b, b-1) : 0.0)
                             + G2[path_b][b] - minage_term);
         }
         if (isinf(E[path_b][b]))
@@ -186,22 +202,17 @@ public:
         term1 = D[a] * E[path_c][b] * path_prob[path_c][b];
         minage_term = 0.0;
         if (c > 0)
-            minage_term = exp(lnE2[path_c][path_b][b]
-                              + lnB[path_c][path_b][c-1]);
+            minage_term = exp_b(path_c, path_b, b, c-1);
 
         if (a < b) {
-            prob += term1 * (exp(lnE2[path_c][path_b][b] +
-                                 lnB[path_c][path_b][a]) -
-                             exp(lnE2[path_c][path_b][b] +
-                                 lnNegG1[path_c][path_b][a])
+            prob += term1 * (exp_b(path_c, path_b, b, a) -
+                             exp_neg_g1(path_c, path_b, b, a)
                              - minage_term);
         } else if (a == b) {
-            prob += term1 * ((b > 0 ? exp(lnE2[path_c][path_b][b] +
-                                          lnB[path_c][path_b][b-1]) : 0.0) +
+            prob += term1 * ((b > 0 ? exp_b(path_c, path_b, b, b-1) : 0.0) +
                              G3[path_c][b] - minage_term);
         } else { // b < a
-            prob += term1 * ((b > 0 ? exp(lnE2[path_c][path_b][b] +
-                                          lnB[path_c][path_b][b-1]) : 0.0)
+            prob += term1 * ((b > 0 ? exp_b(path_c, path_b, b, b-1) : 0.0)
                              + G2[path_c][b] - minage_term);
         }
         if (isnan(prob))
@@ -326,6 +337,9 @@ public:
     {
         return log(get(tree, states, i, j));
     }
+
+    // approximate number of bytes allocated by this matrix
+    size_t memory_size() const;
     void assert_transmat(const LocalTree *tree,
                          const ArgModel *model,
                          const States &states,
@@ -399,6 +413,14 @@ public:
     double **G2;
     double **G3;
 
+    // SMC only: if 'expanded', exp(lnE2 + lnB) and exp(lnE2 + lnNegG1)
+    // tabulated as [path][b][k] for k < b and path1 == path2 == path.
+    // Pairs of different paths only occur in the same-node term of
+    // get_time() for population trees, and are not tabulated.
+    bool expanded;
+    double *expB;
+    double *expNegG1;
+
  private:
     double get_l_term(int d, int path_d, int a, int path_a) const;
     double get_k_term(int d, int path_d, int a, int path_a) const;
@@ -489,6 +511,14 @@ public:
             recombrow[i] = recoalrow[i] = 0.0;
     }
 
+    // approximate number of bytes allocated by this matrix
+    size_t memory_size() const
+    {
+        return sizeof(*this) + max(nstates1, 1) * (4 * sizeof(int) +
+                                                   sizeof(double)) +
+            2 * max(nstates2, 1) * npaths * sizeof(double);
+    }
+
     inline void set(int i, int j, double val) {
         if (recombsrc[i] >= 0) {
             recombrow[recombsrc[i] * nstates2 + j] = val;
@@ -564,6 +594,19 @@ void calc_transition_probs_switch_internal2(
     const ArgModel *model, const LineageCounts *lineages,
     TransMatrixSwitch *transmat_switch);
 
+// Keys identifying everything a transition matrix is computed from, apart
+// from the model parameters that are fixed during a threading (times,
+// population sizes and population tree).  Blocks with equal keys have
+// identical matrices.
+void get_transmat_key(const LocalTree *tree, const ArgModel *model,
+                      const States &states, const LineageCounts *lineages,
+                      bool internal, int minage, string &key);
+void get_transmat_switch_key(const LocalTree *tree, const LocalTree *last_tree,
+                             const Spr &spr, const int *mapping,
+                             const ArgModel *model,
+                             const StatesModel &states_model, string &key);
+
+
 
 double calc_state_priors(const ArgModel *model,
     int time, int pop_path,
@@ -0,0 +1,174 @@
+// c/c++ includes
+#include <math.h>
+#include <algorithm>
+
+// arghmm includes
+#include "common.h"
+#include "logging.h"
+#include "window_schedule.h"
+
+
+namespace argweaver {
+
+
+// factors by which the tile cost changes after a sweep outside the band
+static const double TILE_SHRINK = 0.8;
+static const double TILE_GROW = 1.25;
+
+// weight of the last sweep in the running mean of the acceptance
+static const double ACCEPT_WEIGHT = 0.5;
+
+// iterations per window never exceed this multiple of the initial ones
+static const int MAX_NITERS_FACTOR = 10;
+
+
+WindowSchedule::WindowSchedule(int window, int niters, double accept_low,
+                               double accept_high) :
+    window(window),
+    base_niters(niters),
+    accept_low(accept_low),
+    accept_high(accept_high),
+    base_tile_cost(-1.0),
+    tile_cost(-1.0),
+    niters(niters),
+    frozen(false),
+    accept(-1.0),
+    last_windows(0),
+    last_niters(0),
+    last_length(0.0),
+    last_trees(0.0),
+    last_accept(0.0),
+    last_time_min(0.0),
+    last_time_max(0.0)
+{}
+
+
+// cut trees into tiles of tile_cost, where a block costs one tree plus its
+// length in units of the mean block length
+void WindowSchedule::make_tiles(const LocalTrees *trees)
+{
+    const double mean_blocklen =
+        trees->length() / double(trees->get_num_trees());
+
+    // a window of the initial schedule is two tiles
+    if (base_tile_cost < 0) {
+        base_tile_cost = max(window / mean_blocklen, 1.0);
+        tile_cost = base_tile_cost;
+    }
+
+    tiles.clear();
+    tiles.push_back(trees->start_coord);
+    double cost = 0.0;
+    int pos = trees->start_coord;
+    for (LocalTrees::const_iterator it=trees->begin();
+         it != trees->end(); ++it)
+    {
+        const int end = pos + it->blocklen;
+
+        // a new tree starts here
+        if (cost + 1.0 > tile_cost && pos > tiles.back()) {
+            tiles.push_back(pos);
+            cost = 0.0;
+        }
+        cost += 1.0;
+
+        // cut within the block when its length fills a tile
+        int start = pos;
+        while (cost + (end - start) / mean_blocklen >= tile_cost) {
+            int cut = start + max(int(ceil((tile_cost - cost) *
+                                           mean_blocklen)), 1);
+            if (cut >= end)
+                break;
+            tiles.push_back(cut);
+            cost = 0.0;
+            start = cut;
+        }
+        cost += (end - start) / mean_blocklen;
+        pos = end;
+    }
+
+    // merge a short last tile into the one before it
+    if (tiles.size() > 1 && cost < tile_cost / 2)
+        tiles.pop_back();
+    tiles.push_back(trees->end_coord);
+}
+
+
+void WindowSchedule::get_cuts(const LocalTrees *trees, vector<int> &cuts)
+{
+    if (!frozen || tiles.empty())
+        make_tiles(trees);
+    assert(tiles.front() == trees->start_coord &&
+           tiles.back() == trees->end_coord);
+
+    // shift the cuts by the same random fraction of their tiles
+    const double shift = frand();
+    const int ntiles = tiles.size() - 1;
+    cuts.clear();
+    cuts.push_back(tiles[0]);
+    for (int k=1; k<ntiles; k++) {
+        int cut = tiles[k] + int(shift * (tiles[k+1] - tiles[k]));
+        if (cut > cuts.back() && cut < tiles.back())
+            cuts.push_back(cut);
+    }
+    cuts.push_back(tiles.back());
+}
+
+
+void WindowSchedule::update(const vector<WindowRecord> &records)
+{
+    // summarize the sweep
+    last_windows = 0;
+    last_length = 0.0;
+    last_trees = 0.0;
+    last_accept = 0.0;
+    last_time_min = INFINITY;
+    last_time_max = 0.0;
+    for (unsigned int i=0; i<records.size(); i++) {
+        const WindowRecord &rec = records[i];
+        if (rec.niters == 0)
+            continue;
+        last_windows++;
+        last_niters = rec.niters;
+        last_length += rec.end - rec.start;
+        last_trees += rec.ntrees;
+        last_accept += rec.accept;
+        last_time_min = min(last_time_min, rec.time);
+        last_time_max = max(last_time_max, rec.time);
+    }
+    if (last_windows == 0) {
+        last_time_min = 0.0;
+        return;
+    }
+    last_length /= last_windows;
+    last_trees /= last_windows;
+    last_accept /= last_windows;
+
+    if (frozen)
+        return;
+
+    // resize tiles to bring the acceptance into the band
+    accept = (accept < 0 ? last_accept : ACCEPT_WEIGHT * last_accept +
+              (1.0 - ACCEPT_WEIGHT) * accept);
+    if (accept < accept_low)
+        tile_cost = max(tile_cost * TILE_SHRINK, 1.0);
+    else if (accept > accept_high && tiles.size() > 2)
+        tile_cost *= TILE_GROW;
+
+    // keep the cost of a window that of a window of the initial schedule
+    niters = int(round(base_niters * base_tile_cost / tile_cost));
+    niters = max(min(niters, MAX_NITERS_FACTOR * base_niters), 1);
+}
+
+
+void WindowSchedule::log(int level) const
+{
+    printLog(level, "window schedule: %d windows of %.0f positions and"
+             " %.1f trees, %d iterations each, accept=%f,"
+             " window time=%.3f-%.3f s%s\n",
+             last_windows, last_length, last_trees, last_niters, last_accept,
+             last_time_min, last_time_max, frozen ? " (frozen)" : "");
+}
+
+
+} // namespace argweaver
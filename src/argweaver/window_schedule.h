@@ -0,0 +1,112 @@
+//=============================================================================
+// Adaptive windows for resampling an ARG a region at a time
+//
+// resample_arg_regions() normally slides a window of a fixed length, drawn
+// around --resample-window, and resamples every window for the same number
+// of iterations.  The cost of a window grows with the number of local trees
+// in it, so windows in regions of high recombination cost much more than
+// others, and large windows are accepted less often.
+//
+// A WindowSchedule cuts the ARG into tiles of equal cost instead, where a
+// block of the ARG costs one tree plus its length relative to the mean
+// block length, and a window is two neighboring tiles.  After each sweep
+// the tiles are made smaller when a running mean of the acceptance of the
+// windows falls below a target band and larger when it rises above it,
+// and the iterations per window are scaled so that every window costs as
+// much as a window of the initial schedule.  Cost is counted in trees and
+// not in seconds, so that a run stays reproducible; the wall time of the
+// windows is recorded and logged to show how uniform the cost is.
+//
+// While adapting, the tiles are recomputed from the current ARG at every
+// sweep.  freeze() ends the adaptation: the tiles of the next sweep are
+// kept for the rest of the run and only shifted by a random fraction of a
+// tile, so the windows no longer depend on the state of the chain.
+
+#ifndef ARGWEAVER_WINDOW_SCHEDULE_H
+#define ARGWEAVER_WINDOW_SCHEDULE_H
+
+#include <vector>
+
+#include "local_tree.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+// the outcome of resampling one window
+class WindowRecord
+{
+public:
+    WindowRecord(int start=0, int end=0, int ntrees=0, int niters=0,
+                 double accept=0.0, double time=0.0) :
+        start(start), end(end), ntrees(ntrees), niters(niters),
+        accept(accept), time(time)
+    {}
+
+    int start;
+    int end;
+    int ntrees;    // local trees in the window before resampling
+    int niters;
+    double accept; // acceptance rate
+    double time;   // wall time in seconds
+};
+
+
+class WindowSchedule
+{
+public:
+    // window and niters are the initial window length and iterations per
+    // window; the tiles adapt to keep the mean acceptance of a sweep
+    // within [accept_low, accept_high]
+    WindowSchedule(int window, int niters, double accept_low=0.2,
+                   double accept_high=0.5);
+
+    // get the tiles of the next sweep over trees: tile k is
+    // [cuts[k], cuts[k+1]) and the cuts span the whole ARG
+    void get_cuts(const LocalTrees *trees, vector<int> &cuts);
+
+    // iterations for each window of the next sweep
+    int get_niters() const { return niters; }
+
+    // record the windows of a sweep and adapt the schedule to them
+    void update(const vector<WindowRecord> &records);
+
+    // stop adapting; the next tiles are kept for the rest of the run
+    void freeze() { frozen = true; }
+    bool is_frozen() const { return frozen; }
+
+    // log the schedule and the windows of the last sweep
+    void log(int level) const;
+
+protected:
+    void make_tiles(const LocalTrees *trees);
+
+    const int window;
+    const int base_niters;
+    const double accept_low;
+    const double accept_high;
+
+    double base_tile_cost;  // cost of a tile of the initial schedule
+    double tile_cost;       // cost of a tile
+    int niters;
+    bool frozen;
+    double accept;          // running mean of the acceptance of sweeps
+
+    vector<int> tiles;      // cuts of the current tiles
+
+    // summary of the last sweep
+    int last_windows;
+    int last_niters;
+    double last_length;
+    double last_trees;
+    double last_accept;
+    double last_time_min;
+    double last_time_max;
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_WINDOW_SCHEDULE_H
@@ -0,0 +1,113 @@
+// c/c++ includes
+#include <string.h>
+
+// arghmm includes
+#include "compress.h"
+#include "writer.h"
+
+
+namespace argweaver {
+
+
+bool write_output_file(const string &filename, const WriteFunc &func)
+{
+    const int len = filename.size();
+    const bool gzip = (len > 3 && filename.compare(len - 3, 3, ".gz") == 0);
+    FILE *stream = (gzip ? write_compress(filename.c_str()) :
+                    fopen(filename.c_str(), "w"));
+    if (!stream) {
+        printError("cannot write '%s'", filename.c_str());
+        return false;
+    }
+
+    bool ok = func(stream);
+    ok = ((gzip ? close_compress(stream) : fclose(stream)) == 0) && ok;
+    if (!ok)
+        printError("error writing '%s'", filename.c_str());
+    return ok;
+}
+
+
+BackgroundWriter::BackgroundWriter(int max_pending) :
+    max_pending(max_pending),
+    busy(false),
+    stopping(false),
+    ok(true),
+    nfiles(0),
+    wait_time(0.0)
+{}
+
+
+BackgroundWriter::~BackgroundWriter()
+{
+    {
+        unique_lock<mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    if (worker.joinable())
+        worker.join();
+}
+
+
+void BackgroundWriter::write(const string &filename, const WriteFunc &func)
+{
+    if (max_pending == 0) {
+        const bool written = write_output_file(filename, func);
+        unique_lock<mutex> guard(lock);
+        nfiles++;
+        ok = ok && written;
+        return;
+    }
+
+    unique_lock<mutex> guard(lock);
+    nfiles++;
+    if (!worker.joinable())
+        worker = thread(&BackgroundWriter::run, this);
+
+    if ((int) jobs.size() >= max_pending) {
+        Timer timer;
+        changed.wait(guard, [&]() {
+            return (int) jobs.size() < max_pending; });
+        wait_time += timer.time();
+    }
+    Job job = {filename, func, g_thread_logger};
+    jobs.push_back(job);
+    changed.notify_all();
+}
+
+
+bool BackgroundWriter::flush()
+{
+    unique_lock<mutex> guard(lock);
+    changed.wait(guard, [&]() { return jobs.empty() && !busy; });
+    return ok;
+}
+
+
+void BackgroundWriter::run()
+{
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        changed.wait(guard, [&]() { return stopping || !jobs.empty(); });
+        if (jobs.empty())
+            break;
+
+        Job job = jobs.front();
+        jobs.pop_front();
+        busy = true;
+        changed.notify_all();
+        guard.unlock();
+
+        g_thread_logger = job.logger;
+        const bool written = write_output_file(job.filename, job.func);
+
+        guard.lock();
+        busy = false;
+        ok = ok && written;
+        changed.notify_all();
+    }
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,86 @@
+//=============================================================================
+// Writing output files on a background thread
+//
+// arg-sample writes a sample of the ARG every few iterations, and formatting
+// and compressing a sample can take as long as an iteration.  The sampling
+// thread instead takes a snapshot of what a file needs and queues a
+// function that writes it, and a background thread formats and compresses
+// the files in the order they were queued.  At most 'max_pending' files
+// wait in the queue; when it is full, write() waits for the writer, so
+// memory stays bounded when sampling outpaces the disk.
+
+#ifndef ARGWEAVER_WRITER_H
+#define ARGWEAVER_WRITER_H
+
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "logging.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+// writes the contents of a file to an open stream
+// returns false on failure
+typedef function<bool(FILE *stream)> WriteFunc;
+
+
+// write a file with func, BGZF compressing it in this process if the
+// filename ends in .gz
+bool write_output_file(const string &filename, const WriteFunc &func);
+
+
+class BackgroundWriter
+{
+public:
+    // with max_pending 0, files are written by the calling thread
+    explicit BackgroundWriter(int max_pending=4);
+    ~BackgroundWriter();
+
+    // write a file with func; func runs on the writer thread and must only
+    // use data that stays valid until the file is written
+    void write(const string &filename, const WriteFunc &func);
+
+    // wait until all queued files are written
+    // returns false if a file could not be written
+    bool flush();
+
+    int get_num_files() const { return nfiles; }
+    // total seconds write() waited for a full queue
+    double get_wait_time() const { return wait_time; }
+
+protected:
+    struct Job
+    {
+        string filename;
+        WriteFunc func;
+        Logger *logger;  // logger of the queuing thread
+    };
+
+    void run();
+
+    const int max_pending;
+    deque<Job> jobs;
+    bool busy;      // the writer thread is writing a file
+    bool stopping;
+    bool ok;
+    int nfiles;
+    double wait_time;
+
+    thread worker;  // started with the first queued file
+    mutex lock;
+    condition_variable changed;
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_WRITER_H
@@ -0,0 +1,91 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/arg_stats.h"
+#include "argweaver/common.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/sequences.h"
+
+
+namespace argweaver {
+
+
+static void expect_same_stats(const ArgStats &expected,
+                              const ArgStats &stats)
+{
+    EXPECT_NEAR(expected.prior, stats.prior, 1e-6);
+    EXPECT_NEAR(expected.prior2, stats.prior2, 1e-6);
+    EXPECT_NEAR(expected.likelihood, stats.likelihood, 1e-6);
+    EXPECT_NEAR(expected.arglen, stats.arglen, 1e-6);
+    EXPECT_EQ(expected.nrecombs, stats.nrecombs);
+    EXPECT_EQ(expected.noncompats, stats.noncompats);
+}
+
+
+// Statistics from a cache that has seen earlier ARGs should equal the
+// statistics computed from scratch, after the trees are resampled and
+// after the population sizes change.
+TEST(ArgStatsTest, test_cache_matches_fresh)
+{
+    // Setup model.
+    int ntimes = 10;
+    double maxtime = 200e3;
+    double rho = 1.5e-8;
+    double mu = 2.5e-8;
+    double popsize = 1e4;
+    ArgModel model(ntimes, maxtime, popsize, rho, mu);
+
+    // Random sequences with a few variable sites.
+    seed_random(1);
+    const int nseqs = 6;
+    const int seqlen = 20000;
+    const char *bases = "ACGT";
+    string ancestral(seqlen, 'A');
+    for (int i=0; i<seqlen; i++)
+        ancestral[i] = bases[irand(4)];
+    vector<string> data(nseqs, ancestral);
+    for (int i=0; i<seqlen; i+=50)
+        for (int j=0; j<nseqs; j++)
+            if (frand() < .3)
+                data[j][i] = bases[irand(4)];
+
+    Sequences sequences;
+    for (int j=0; j<nseqs; j++)
+        sequences.append("n" + std::to_string(j), &data[j][0],
+                         vector<BaseProbs>());
+    sequences.set_age();
+
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees, true);
+
+    vector<int> invisible_recomb_pos;
+    vector<Spr> invisible_recombs;
+    ArgStatsCache cache;
+    ArgStats stats, expected;
+    cache.calc(&model, &sequences, &trees, NULL, NULL, 1, true,
+               invisible_recomb_pos, invisible_recombs, &stats);
+    ArgStatsCache().calc(&model, &sequences, &trees, NULL, NULL, 1, true,
+                         invisible_recomb_pos, invisible_recombs, &expected);
+    expect_same_stats(expected, stats);
+
+    // Change the trees.
+    for (int i=0; i<3; i++)
+        resample_arg_all(&model, &sequences, &trees, .1);
+    cache.calc(&model, &sequences, &trees, NULL, NULL, 1, true,
+               invisible_recomb_pos, invisible_recombs, &stats);
+    ArgStatsCache().calc(&model, &sequences, &trees, NULL, NULL, 1, true,
+                         invisible_recomb_pos, invisible_recombs, &expected);
+    expect_same_stats(expected, stats);
+
+    // Change the population sizes, which the prior depends on.
+    model.set_popsizes(2e4);
+    cache.calc(&model, &sequences, &trees, NULL, NULL, 1, true,
+               invisible_recomb_pos, invisible_recombs, &stats);
+    ArgStatsCache().calc(&model, &sequences, &trees, NULL, NULL, 1, true,
+                         invisible_recomb_pos, invisible_recombs, &expected);
+    expect_same_stats(expected, stats);
+}
+
+
+}  // namespace argweaver
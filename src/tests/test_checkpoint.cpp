@@ -0,0 +1,137 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "argweaver/checkpoint.h"
+#include "argweaver/common.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/sequences.h"
+
+
+namespace argweaver {
+
+
+// overwrite len bytes of a file at offset
+static void patch_file(const char *filename, long offset, const void *data,
+                       size_t len)
+{
+    FILE *file = fopen(filename, "r+b");
+    ASSERT_TRUE(file != NULL);
+    fseek(file, offset, SEEK_SET);
+    fwrite(data, 1, len, file);
+    fclose(file);
+}
+
+
+// A checkpoint read back through mmap restores the header, the model and
+// the trees that were written, and files with a wrong magic or version
+// are rejected.
+TEST(CheckpointTest, test_round_trip)
+{
+    // Setup model.
+    int ntimes = 10;
+    double maxtime = 200e3;
+    double rho = 1.5e-8;
+    double mu = 2.5e-8;
+    double popsize = 1e4;
+    ArgModel model(ntimes, maxtime, popsize, rho, mu);
+    model.mc3.heat = .5;
+
+    // Random sequences with a few variable sites.
+    seed_random(1);
+    const int nseqs = 4;
+    const int seqlen = 5000;
+    const char *bases = "ACGT";
+    string ancestral(seqlen, 'A');
+    for (int i=0; i<seqlen; i++)
+        ancestral[i] = bases[irand(4)];
+    vector<string> data(nseqs, ancestral);
+    for (int i=0; i<seqlen; i+=50)
+        for (int j=0; j<nseqs; j++)
+            if (frand() < .3)
+                data[j][i] = bases[irand(4)];
+
+    Sequences sequences;
+    for (int j=0; j<nseqs; j++)
+        sequences.append("n" + std::to_string(j), &data[j][0],
+                         vector<BaseProbs>());
+    sequences.set_age();
+
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees, true);
+    trees.chrom = "chr";
+
+    const string filename = testing::TempDir() + "test_checkpoint.ckpt";
+    RandomStream random(3, 4);
+    random.next();
+    ASSERT_TRUE(write_checkpoint(filename.c_str(), 12, 345, &random, &model,
+                                 &sequences, &trees));
+
+    // Read it back.
+    {
+        CheckpointReader reader;
+        ASSERT_TRUE(reader.open(filename.c_str()));
+        const CheckpointHeader &header = reader.get_header();
+        EXPECT_EQ(12, header.iter);
+        EXPECT_EQ(345, header.stats_offset);
+        EXPECT_EQ(.5, header.heat);
+        RandomStream restored = header.random;
+        for (int i=0; i<10; i++)
+            EXPECT_EQ(random.next(), restored.next());
+
+        ArgModel model2(ntimes, maxtime, 2 * popsize, rho, mu);
+        ASSERT_TRUE(reader.read_model(&model2));
+        EXPECT_EQ(.5, model2.mc3.heat);
+        for (int i=0; i<2*ntimes-1; i++)
+            EXPECT_EQ(model.popsizes[0][i], model2.popsizes[0][i]);
+
+        LocalTrees trees2;
+        ASSERT_TRUE(reader.read_trees(&trees2));
+        EXPECT_EQ(trees.chrom, trees2.chrom);
+        EXPECT_EQ(trees.start_coord, trees2.start_coord);
+        EXPECT_EQ(trees.end_coord, trees2.end_coord);
+        EXPECT_EQ(trees.seqids, trees2.seqids);
+        ASSERT_EQ(trees.get_num_trees(), trees2.get_num_trees());
+        ASSERT_TRUE(assert_trees(&trees2));
+        LocalTrees::const_iterator it2 = trees2.begin();
+        for (LocalTrees::const_iterator it=trees.begin(); it!=trees.end();
+             ++it, ++it2) {
+            EXPECT_EQ(it->blocklen, it2->blocklen);
+            EXPECT_EQ(it->spr.recomb_node, it2->spr.recomb_node);
+            EXPECT_EQ(it->spr.coal_node, it2->spr.coal_node);
+            EXPECT_EQ(it->tree->root, it2->tree->root);
+            for (int i=0; i<it->tree->nnodes; i++) {
+                EXPECT_EQ(it->tree->nodes[i].parent,
+                          it2->tree->nodes[i].parent);
+                EXPECT_EQ(it->tree->nodes[i].age, it2->tree->nodes[i].age);
+            }
+        }
+    }
+
+    // A wrong magic is rejected.
+    patch_file(filename.c_str(), 0, "X", 1);
+    {
+        CheckpointReader reader;
+        EXPECT_FALSE(reader.open(filename.c_str()));
+        EXPECT_FALSE(reader.is_open());
+    }
+    patch_file(filename.c_str(), 0, "A", 1);
+
+    // So is a wrong version.
+    int version = -1;
+    patch_file(filename.c_str(), offsetof(CheckpointHeader, version),
+               &version, sizeof(version));
+    {
+        CheckpointReader reader;
+        EXPECT_FALSE(reader.open(filename.c_str()));
+    }
+
+    unlink(filename.c_str());
+}
+
+
+}  // namespace argweaver
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/compress.h"
+
+
+namespace argweaver {
+
+
+// empty block that ends every BGZF file
+static const unsigned char BGZF_EOF[28] = {
+    0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0x1b, 0,
+    3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+
+static string read_file(FILE *stream)
+{
+    string data;
+    char buf[4096];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), stream)) > 0)
+        data.append(buf, len);
+    return data;
+}
+
+
+// BGZF files written with and without threads read back as written and
+// end with the BGZF end-of-file block.
+TEST(CompressTest, test_bgzf_round_trip)
+{
+    // several blocks of text mixed with data that does not compress
+    seed_random(1);
+    string data;
+    while (data.size() < 300000) {
+        data += "line " + std::to_string(data.size()) + "\n";
+        for (int i=0; i<100; i++)
+            data += char(irand(256));
+    }
+
+    const string filename = testing::TempDir() + "test_compress.gz";
+    const int nthreads[] = {0, 3};
+    for (int k=0; k<2; k++) {
+        FILE *out = write_bgzf(filename.c_str(), nthreads[k]);
+        ASSERT_TRUE(out != NULL);
+        // uneven writes that straddle the blocks
+        for (size_t pos=0; pos<data.size(); pos+=7777) {
+            const size_t len = min(data.size() - pos, (size_t) 7777);
+            ASSERT_EQ(len, fwrite(&data[pos], 1, len, out));
+        }
+        EXPECT_EQ(0, close_compress(out));
+
+        FILE *in = read_gzip(filename.c_str());
+        ASSERT_TRUE(in != NULL);
+        EXPECT_TRUE(read_file(in) == data);
+        EXPECT_EQ(0, close_compress(in));
+
+        FILE *raw = fopen(filename.c_str(), "rb");
+        ASSERT_TRUE(raw != NULL);
+        const string compressed = read_file(raw);
+        fclose(raw);
+        ASSERT_GT(compressed.size(), sizeof(BGZF_EOF));
+        EXPECT_EQ(string((const char*) BGZF_EOF, sizeof(BGZF_EOF)),
+                  compressed.substr(compressed.size() - sizeof(BGZF_EOF)));
+    }
+    unlink(filename.c_str());
+}
+
+
+}  // namespace argweaver
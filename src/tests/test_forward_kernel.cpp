@@ -0,0 +1,63 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/forward_kernel.h"
+
+
+namespace argweaver {
+
+
+// Every kernel supported by this CPU should agree with the scalar kernel
+// to within the tolerance documented in forward_kernel.h.
+TEST(ForwardKernelTest, kernels_match_scalar)
+{
+    const int n = 37;  // not a multiple of any vector width
+    double x[n], y[n], emit[n];
+    for (int i=0; i<n; i++) {
+        x[i] = 1.0 / (i + 1);
+        y[i] = 0.5 + 0.01 * i;
+        emit[i] = exp(-0.1 * i);
+    }
+
+    ASSERT_TRUE(set_forward_kernel(FORWARD_KERNEL_SCALAR));
+    const ForwardKernel *scalar = get_forward_kernel();
+    double dot1 = scalar->dot(x, y, n);
+    double col1[n];
+    copy(x, x + n, col1);
+    double norm1 = scalar->emit_norm(col1, emit, n);
+    scalar->normalize(col1, norm1, n);
+
+    const ForwardKernelType types[] = {
+        FORWARD_KERNEL_SSE2, FORWARD_KERNEL_AVX2, FORWARD_KERNEL_AVX512};
+    for (int t=0; t<3; t++) {
+        if (!set_forward_kernel(types[t]))
+            continue;
+        const ForwardKernel *kernel = get_forward_kernel();
+        EXPECT_NEAR(kernel->dot(x, y, n), dot1, 1e-12 * fabs(dot1));
+
+        double col2[n];
+        copy(x, x + n, col2);
+        double norm2 = kernel->emit_norm(col2, emit, n);
+        EXPECT_NEAR(norm2, norm1, 1e-12 * norm1);
+        kernel->normalize(col2, norm2, n);
+        for (int k=0; k<n; k++)
+            EXPECT_NEAR(col2[k], col1[k], 1e-12 * col1[k]);
+    }
+
+    set_forward_kernel(FORWARD_KERNEL_AUTO);
+}
+
+
+// Kernel names used by arg-sample --forward-kernel.
+TEST(ForwardKernelTest, parse_forward_kernel)
+{
+    ForwardKernelType type;
+    EXPECT_TRUE(parse_forward_kernel("avx2", &type));
+    EXPECT_EQ(type, FORWARD_KERNEL_AVX2);
+    EXPECT_TRUE(parse_forward_kernel("scalar", &type));
+    EXPECT_EQ(type, FORWARD_KERNEL_SCALAR);
+    EXPECT_FALSE(parse_forward_kernel("avx3", &type));
+}
+
+
+}  // namespace argweaver
@@ -6,6 +6,57 @@
 namespace argweaver {
 
 
+// Two trees over five leaves that differ by more than one SPR.
+static const char *STITCH_NEWICK1 = "((((0,1)5[&&NHX:age=10],2)6[&&NHX:age=20],3)7[&&NHX:age=30],4)8[&&NHX:age=40]";
+static const char *STITCH_NEWICK2 = "((0,4)5[&&NHX:age=20],((1,3)6[&&NHX:age=10],2)7[&&NHX:age=30])8[&&NHX:age=40]";
+
+
+// Parse a tree with the times {0, 10, 20, 30, 40}, or return NULL.
+static LocalTree *parse_test_tree(const char *newick)
+{
+    int ntimes = 5;
+    double times[] = {0, 10, 20, 30, 40};
+
+    LocalTree *tree = new LocalTree();
+    if (!parse_local_tree(newick, tree, times, ntimes)) {
+        delete tree;
+        return NULL;
+    }
+    return tree;
+}
+
+
+// Stitch an ARG of STITCH_NEWICK1 over [0, 10) to an ARG of
+// STITCH_NEWICK2 over [10, 20) into empty trees.  If given, target is set
+// to the tree of the second ARG.
+static bool stitch_test_trees(LocalTrees *trees, LocalTree *target=NULL)
+{
+    LocalTree *tree1 = parse_test_tree(STITCH_NEWICK1);
+    LocalTree *tree2 = parse_test_tree(STITCH_NEWICK2);
+    if (!tree1 || !tree2) {
+        delete tree1;
+        delete tree2;
+        return false;
+    }
+    if (target)
+        target->copy(*tree2);
+
+    Spr null_spr;
+    null_spr.set_null();
+    LocalTrees trees2(10, 20, tree2->nnodes);
+    trees->start_coord = 0;
+    trees->end_coord = 10;
+    trees->nnodes = tree1->nnodes;
+    trees->trees.push_back(LocalTreeSpr(tree1, null_spr, 10));
+    trees->set_default_seqids();
+    trees2.trees.push_back(LocalTreeSpr(tree2, null_spr, 10));
+    trees2.set_default_seqids();
+
+    stitch_local_trees(trees, &trees2);
+    return true;
+}
+
+
 // Parse a local tree from newick.
 TEST(LocalTreeTest, parse_local_tree)
 {
@@ -80,4 +131,167 @@ TEST(LocalTreeTest, parse_local_tree_extra_meta_data)
 }
 
 
+// Stitch two ARGs whose trees differ at the join.
+TEST(LocalTreeTest, stitch_local_trees)
+{
+    LocalTrees trees;
+    LocalTree target;
+    ASSERT_TRUE(stitch_test_trees(&trees, &target));
+
+    // Assert the ARG is valid and ends in the tree of trees2.
+    EXPECT_TRUE(assert_trees(&trees));
+    EXPECT_EQ(trees.start_coord, 0);
+    EXPECT_EQ(trees.end_coord, 20);
+    EXPECT_GT(trees.get_num_trees(), 2);
+    EXPECT_EQ(trees.front().blocklen, 10);
+
+    int mapping[target.nnodes];
+    map_congruent_trees(trees.back().tree, &trees.seqids[0],
+                        &target, &trees.seqids[0], mapping);
+    for (int i=0; i<target.nnodes; i++)
+        EXPECT_NE(mapping[i], -1);
+}
+
+
+// Arrays of a slab arena are reused once freed, and large arrays get
+// regions of their own.
+TEST(LocalTreeTest, slab_arena)
+{
+    SlabArena arena(sizeof(int));
+
+    // arrays of one size class fill a slab in address order
+    int *a = (int*) arena.alloc(79);
+    int *b = (int*) arena.alloc(80);
+    EXPECT_EQ(b, a + 80);
+    for (int i=0; i<80; i++)
+        b[i] = i;
+
+    // a freed array is handed out again
+    arena.free(a);
+    int *c = (int*) arena.alloc(77);
+    EXPECT_EQ(c, a);
+    EXPECT_EQ(b[79], 79);
+
+    // a large array is returned to the system when freed
+    const size_t bytes = arena.get_bytes();
+    int *d = (int*) arena.alloc(SlabArena::SLAB_BYTES);
+    d[SlabArena::SLAB_BYTES - 1] = 1;
+    EXPECT_GT(arena.get_bytes(), bytes);
+    arena.free(d);
+    EXPECT_EQ(arena.get_bytes(), bytes);
+
+    arena.free(b);
+    arena.free(c);
+}
+
+
+// The position index finds the block of every position, and stays current
+// when the trees are partitioned and appended.
+TEST(LocalTreeTest, find_local_trees)
+{
+    LocalTrees trees;
+    ASSERT_TRUE(stitch_test_trees(&trees));
+
+    // the blocks of every position by walking the trees
+    vector<LocalTreeSpr*> blocks;
+    vector<int> starts;
+    int end = trees.start_coord;
+    for (LocalTrees::iterator it=trees.begin(); it!=trees.end(); ++it) {
+        for (int i=0; i<it->blocklen; i++) {
+            blocks.push_back(&*it);
+            starts.push_back(end);
+        }
+        end += it->blocklen;
+    }
+
+    for (int pos=0; pos<20; pos++) {
+        int start;
+        LocalTrees::iterator it = trees.find(pos, &start);
+        ASSERT_TRUE(it != trees.end());
+        EXPECT_EQ(&*it, blocks[pos]);
+        EXPECT_EQ(start, starts[pos]);
+    }
+    EXPECT_TRUE(trees.has_index());
+    EXPECT_TRUE(trees.find(-1) == trees.end());
+    EXPECT_TRUE(trees.find(20) == trees.end());
+
+    // cut out a window and put it back
+    LocalTrees *window = partition_local_trees(&trees, 11);
+    LocalTrees *rest = partition_local_trees(window, 15);
+    EXPECT_TRUE(trees.has_index());
+    EXPECT_TRUE(window->has_index());
+    EXPECT_TRUE(rest->has_index());
+    for (int pos=11; pos<20; pos++) {
+        // the blocks cut at 11 and 15 start there
+        LocalTrees *part = (pos < 15 ? window : rest);
+        int start;
+        LocalTrees::iterator it = part->find(pos, &start);
+        ASSERT_TRUE(it != part->end());
+        EXPECT_EQ(start, max(starts[pos], part->start_coord));
+        EXPECT_EQ(it->tree->root, blocks[pos]->tree->root);
+    }
+
+    append_local_trees(&trees, window, false);
+    append_local_trees(&trees, rest, false);
+    EXPECT_TRUE(trees.has_index());
+    for (int pos=0; pos<20; pos++) {
+        int start, end;
+        LocalTrees::iterator it = trees.get_block(pos, start, end);
+        EXPECT_LE(start, pos);
+        EXPECT_LT(pos, end);
+        EXPECT_EQ(it->tree->root, blocks[pos]->tree->root);
+    }
+    EXPECT_TRUE(assert_trees(&trees));
+
+    delete window;
+    delete rest;
+}
+
+
+// Removing a null SPR from the middle of indexed trees clears the index.
+TEST(LocalTreeTest, find_after_remove_null_spr)
+{
+    LocalTree *tree = parse_test_tree(STITCH_NEWICK1);
+    ASSERT_TRUE(tree != NULL);
+
+    // three blocks of one tree, [0, 10), [10, 15) and [15, 20)
+    Spr null_spr;
+    null_spr.set_null();
+    const int lengths[] = {10, 5, 5};
+    LocalTrees trees(0, 20, tree->nnodes);
+    for (int i=0; i<3; i++) {
+        int *mapping = NULL;
+        if (i > 0) {
+            mapping = alloc_node_mapping(tree->nnodes);
+            for (int j=0; j<tree->nnodes; j++)
+                mapping[j] = j;
+        }
+        trees.trees.push_back(LocalTreeSpr(new LocalTree(*tree), null_spr,
+                                           lengths[i], mapping));
+    }
+    trees.set_default_seqids();
+    delete tree;
+
+    int start;
+    EXPECT_TRUE(trees.find(12, &start) != trees.end());
+    EXPECT_EQ(10, start);
+    EXPECT_TRUE(trees.has_index());
+
+    // the second block merges into the third, which now starts at 10
+    LocalTrees::iterator second = trees.begin();
+    ++second;
+    LocalTrees::iterator third = second;
+    ++third;
+    ASSERT_TRUE(remove_null_spr(&trees, second, NULL));
+    EXPECT_FALSE(trees.has_index());
+    for (int pos=10; pos<20; pos++) {
+        LocalTrees::iterator it = trees.find(pos, &start);
+        ASSERT_TRUE(it != trees.end());
+        EXPECT_TRUE(it == third);
+        EXPECT_EQ(10, start);
+    }
+    EXPECT_TRUE(assert_trees(&trees));
+}
+
+
 }  // namespace
@@ -0,0 +1,57 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+
+
+namespace argweaver {
+
+
+// Known-answer vectors of Philox4x32-10 from the Random123 distribution.
+TEST(RandomTest, philox_known_answers)
+{
+    RandomStream zero(0, 0);
+    zero.next();
+    EXPECT_EQ(0x6627e8d5u, zero.block[0]);
+    EXPECT_EQ(0xe169c58du, zero.block[1]);
+    EXPECT_EQ(0xbc57ac4cu, zero.block[2]);
+    EXPECT_EQ(0x9b00dbd8u, zero.block[3]);
+
+    RandomStream ones(~0ULL, ~0ULL);
+    ones.counter[0] = ones.counter[1] = 0xffffffff;
+    ones.next();
+    EXPECT_EQ(0x408f276du, ones.block[0]);
+    EXPECT_EQ(0x41c83b0eu, ones.block[1]);
+    EXPECT_EQ(0xa20bc7c6u, ones.block[2]);
+    EXPECT_EQ(0x6d5451fdu, ones.block[3]);
+}
+
+
+// A stream restored from a copy of its state continues identically, and
+// installed streams do not disturb the default stream of the thread.
+TEST(RandomTest, stream_state)
+{
+    seed_random(7);
+    frand();
+    rand_norm();
+    RandomStream saved = get_random();
+
+    RandomStream other(7, 1);
+    {
+        ScopedRandomStream scoped(&other);
+        frand();
+    }
+
+    const double x = frand(), y = rand_norm();
+    get_random() = saved;
+    EXPECT_EQ(x, frand());
+    EXPECT_EQ(y, rand_norm());
+
+    RandomStream a(7, 0), b(7, 1);
+    int same = 0;
+    for (int i=0; i<100; i++)
+        same += (a.next() == b.next());
+    EXPECT_LT(same, 2);
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,95 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/sequences.h"
+#include "argweaver/window_schedule.h"
+
+
+namespace argweaver {
+
+
+static void expect_same_trees(const LocalTrees &expected,
+                              const LocalTrees &trees)
+{
+    ASSERT_EQ(expected.get_num_trees(), trees.get_num_trees());
+    LocalTrees::const_iterator it2 = trees.begin();
+    for (LocalTrees::const_iterator it=expected.begin();
+         it!=expected.end(); ++it, ++it2) {
+        EXPECT_EQ(it->blocklen, it2->blocklen);
+        EXPECT_EQ(it->spr.recomb_node, it2->spr.recomb_node);
+        EXPECT_EQ(it->spr.recomb_time, it2->spr.recomb_time);
+        EXPECT_EQ(it->spr.coal_node, it2->spr.coal_node);
+        EXPECT_EQ(it->spr.coal_time, it2->spr.coal_time);
+        ASSERT_EQ(it->tree->nnodes, it2->tree->nnodes);
+        for (int i=0; i<it->tree->nnodes; i++) {
+            EXPECT_EQ(it->tree->nodes[i].parent, it2->tree->nodes[i].parent);
+            EXPECT_EQ(it->tree->nodes[i].age, it2->tree->nodes[i].age);
+        }
+    }
+}
+
+
+// Resampling an ARG in windows gives the same ARG on one thread as on
+// several, with fixed windows and with a window schedule.
+TEST(SampleArgTest, test_resample_regions_threads)
+{
+    // Setup model.
+    int ntimes = 10;
+    double maxtime = 200e3;
+    double rho = 1.5e-8;
+    double mu = 2.5e-8;
+    double popsize = 1e4;
+    ArgModel model(ntimes, maxtime, popsize, rho, mu);
+
+    // Random sequences with a few variable sites.
+    seed_random(1);
+    const int nseqs = 6;
+    const int seqlen = 40000;
+    const char *bases = "ACGT";
+    string ancestral(seqlen, 'A');
+    for (int i=0; i<seqlen; i++)
+        ancestral[i] = bases[irand(4)];
+    vector<string> data(nseqs, ancestral);
+    for (int i=0; i<seqlen; i+=50)
+        for (int j=0; j<nseqs; j++)
+            if (frand() < .3)
+                data[j][i] = bases[irand(4)];
+
+    Sequences sequences;
+    for (int j=0; j<nseqs; j++)
+        sequences.append("n" + std::to_string(j), &data[j][0],
+                         vector<BaseProbs>());
+    sequences.set_age();
+
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees, true);
+
+    const int window = 5000;
+    const int nthreads[] = {0, 4};
+    LocalTrees results[2];
+    LocalTrees scheduled[2];
+    for (int k=0; k<2; k++) {
+        results[k].copy(trees);
+        seed_random(2);
+        for (int i=0; i<3; i++)
+            resample_arg_regions(&model, &sequences, &results[k], window, 2,
+                                 1.0, nthreads[k]);
+        ASSERT_TRUE(assert_trees(&results[k]));
+
+        scheduled[k].copy(trees);
+        WindowSchedule schedule(window, 2);
+        seed_random(3);
+        for (int i=0; i<3; i++)
+            resample_arg_regions(&model, &sequences, &scheduled[k], window,
+                                 2, 1.0, nthreads[k], &schedule);
+        ASSERT_TRUE(assert_trees(&scheduled[k]));
+    }
+    expect_same_trees(results[0], results[1]);
+    expect_same_trees(scheduled[0], scheduled[1]);
+}
+
+
+}  // namespace argweaver
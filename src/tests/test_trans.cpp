@@ -0,0 +1,50 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/states.h"
+#include "argweaver/trans.h"
+
+
+namespace argweaver {
+
+
+// The expanded transition matrix should give exactly the same
+// probabilities as computing the exponentials on the fly.
+TEST(TransTest, test_trans_expanded)
+{
+    // Setup model.
+    int ntimes = 5;
+    double maxtime = 40;
+    double rho = 1e-9;
+    double mu = 2.5e-9;
+    double popsize = 1e4;
+    ArgModel model(ntimes, maxtime, popsize, rho, mu);
+    model.smc_prime = false;
+
+    // Read tree.
+    const char *newick =
+        "((0,1)5[&&NHX:age=10],((2,3)6[&&NHX:age=20],4)7[&&NHX:age=20])8[&&NHX:age=30]";
+    LocalTree tree;
+    parse_local_tree(newick, &tree, model.times, ntimes);
+
+    LineageCounts lineages(ntimes, model.num_pops());
+    lineages.count(&tree, model.pop_tree);
+    States states;
+    get_coal_states(&tree, ntimes, states);
+    int nstates = states.size();
+
+    TransMatrix matrix(&model, nstates, false);
+    TransMatrix expanded(&model, nstates, true);
+    matrix.calc_transition_probs(&tree, &model, states, &lineages);
+    expanded.calc_transition_probs(&tree, &model, states, &lineages);
+
+    for (int i=0; i<nstates; i++)
+        for (int j=0; j<nstates; j++)
+            EXPECT_EQ(matrix.get(&tree, states, i, j),
+                      expanded.get(&tree, states, i, j));
+}
+
+
+}  // namespace argweaver
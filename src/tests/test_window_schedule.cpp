@@ -0,0 +1,140 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/window_schedule.h"
+
+
+namespace argweaver {
+
+
+// Make an ARG over [0, 1000) of 50 blocks of length 2 followed by 10
+// blocks of length 90.  Only the block lengths matter to a schedule.
+static void make_schedule_trees(LocalTrees *trees)
+{
+    int ntimes = 5;
+    double times[] = {0, 10, 20, 30, 40};
+    LocalTree tree;
+    ASSERT_TRUE(parse_local_tree("((0,1)3[&&NHX:age=10],2)4[&&NHX:age=20]",
+                                 &tree, times, ntimes));
+
+    Spr null_spr;
+    null_spr.set_null();
+    trees->start_coord = 0;
+    trees->end_coord = 1000;
+    trees->nnodes = tree.nnodes;
+    for (int i=0; i<60; i++)
+        trees->trees.push_back(LocalTreeSpr(new LocalTree(tree), null_spr,
+                                            i < 50 ? 2 : 90));
+    trees->set_default_seqids();
+}
+
+
+// records of one sweep over cuts with the same acceptance in every window
+static void make_records(const vector<int> &cuts, int niters, double accept,
+                         vector<WindowRecord> &records)
+{
+    records.clear();
+    for (unsigned int k=0; k+1<cuts.size(); k++)
+        records.push_back(WindowRecord(cuts[k], cuts[k+1], 1, niters, accept,
+                                       0.0));
+}
+
+
+// Tiles are short where the trees are short and long where they are long,
+// and always span the ARG.
+TEST(WindowScheduleTest, test_split)
+{
+    LocalTrees trees;
+    make_schedule_trees(&trees);
+    seed_random(1);
+
+    // a window of the initial schedule is two tiles of 12 blocks' cost
+    WindowSchedule schedule(200, 10);
+    vector<int> cuts;
+    schedule.get_cuts(&trees, cuts);
+    ASSERT_GT(cuts.size(), 3u);
+    EXPECT_EQ(0, cuts.front());
+    EXPECT_EQ(1000, cuts.back());
+    for (unsigned int k=1; k<cuts.size(); k++)
+        EXPECT_LT(cuts[k-1], cuts[k]);
+
+    // the dense region at the start is cut into shorter tiles
+    int ndense = 0;
+    int nsparse = 0;
+    for (unsigned int k=1; k<cuts.size() - 1; k++) {
+        if (cuts[k] < 100)
+            ndense++;
+        else
+            nsparse++;
+    }
+    EXPECT_GE(ndense, 4);
+    EXPECT_LE(nsparse, 6);
+    EXPECT_GT(ndense * 900, nsparse * 100);
+    EXPECT_EQ(10, schedule.get_niters());
+}
+
+
+// Low acceptance splits the tiles and raises the iterations per window,
+// high acceptance merges them again, and a frozen schedule keeps its tiles.
+TEST(WindowScheduleTest, test_split_merge)
+{
+    LocalTrees trees;
+    make_schedule_trees(&trees);
+    seed_random(1);
+
+    WindowSchedule schedule(200, 10, 0.2, 0.5);
+    vector<int> cuts;
+    vector<WindowRecord> records;
+    schedule.get_cuts(&trees, cuts);
+    const int ntiles = cuts.size() - 1;
+
+    // split
+    for (int i=0; i<3; i++) {
+        make_records(cuts, schedule.get_niters(), 0.05, records);
+        schedule.update(records);
+        schedule.get_cuts(&trees, cuts);
+    }
+    const int nsplit = cuts.size() - 1;
+    EXPECT_GT(nsplit, ntiles);
+    EXPECT_GT(schedule.get_niters(), 10);
+
+    // merge
+    for (int i=0; i<6; i++) {
+        make_records(cuts, schedule.get_niters(), 0.9, records);
+        schedule.update(records);
+        schedule.get_cuts(&trees, cuts);
+    }
+    EXPECT_LT((int) cuts.size() - 1, nsplit);
+    EXPECT_LT(schedule.get_niters(), 10);
+
+    // once the running mean of the acceptance is within the band, the
+    // schedule stays as it is
+    for (int i=0; i<3; i++) {
+        make_records(cuts, schedule.get_niters(), 0.3, records);
+        schedule.update(records);
+        schedule.get_cuts(&trees, cuts);
+    }
+    const int niters = schedule.get_niters();
+    const int nmerged = cuts.size() - 1;
+    make_records(cuts, niters, 0.3, records);
+    for (int i=0; i<5; i++) {
+        schedule.update(records);
+        schedule.get_cuts(&trees, cuts);
+    }
+    EXPECT_EQ(nmerged, (int) cuts.size() - 1);
+    EXPECT_EQ(niters, schedule.get_niters());
+
+    // frozen
+    schedule.freeze();
+    schedule.get_cuts(&trees, cuts);
+    const int nfrozen = cuts.size() - 1;
+    make_records(cuts, niters, 0.0, records);
+    schedule.update(records);
+    schedule.get_cuts(&trees, cuts);
+    EXPECT_EQ(nfrozen, (int) cuts.size() - 1);
+    EXPECT_EQ(niters, schedule.get_niters());
+}
+
+
+}  // namespace argweaver
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "argweaver/compress.h"
+#include "argweaver/writer.h"
+
+
+namespace argweaver {
+
+
+// read a file through read_compress(), which also reads plain files
+static string read_test_file(const string &filename)
+{
+    string data;
+    FILE *stream = read_compress(filename.c_str());
+    if (!stream)
+        return data;
+    char buf[4096];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), stream)) > 0)
+        data.append(buf, len);
+    close_compress(stream);
+    return data;
+}
+
+
+// Files queued on a background writer are written in the order they were
+// queued, and all of them are written by the time the writer is destroyed,
+// including files still queued then.
+TEST(WriterTest, test_background_writer_order)
+{
+    const int max_pendings[] = {0, 2};
+    const int nfiles = 20;
+
+    for (int k=0; k<2; k++) {
+        vector<string> filenames;
+        for (int i=0; i<nfiles; i++)
+            filenames.push_back(testing::TempDir() + "test_writer." +
+                                std::to_string(i) + (i % 2 ? ".gz" : ""));
+
+        vector<int> order;
+        {
+            BackgroundWriter writer(max_pendings[k]);
+            for (int i=0; i<nfiles; i++) {
+                writer.write(filenames[i], [i, &order](FILE *stream) {
+                    // slow writes keep the queue full
+                    this_thread::sleep_for(chrono::milliseconds(2));
+                    order.push_back(i);
+                    for (int j=0; j<=i * 1000; j++)
+                        fprintf(stream, "%d\n", j);
+                    return true;
+                });
+            }
+            EXPECT_EQ(nfiles, writer.get_num_files());
+        }
+
+        ASSERT_EQ(nfiles, (int) order.size());
+        for (int i=0; i<nfiles; i++) {
+            EXPECT_EQ(i, order[i]);
+
+            string expected;
+            for (int j=0; j<=i * 1000; j++)
+                expected += std::to_string(j) + "\n";
+            EXPECT_EQ(expected, read_test_file(filenames[i]));
+            unlink(filenames[i].c_str());
+        }
+    }
+}
+
+
+// flush() waits for every queued file and reports failed writes.
+TEST(WriterTest, test_background_writer_flush)
+{
+    const string filename = testing::TempDir() + "test_writer.flush";
+    BackgroundWriter writer(2);
+    writer.write(filename, [](FILE *stream) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+        return fputs("done\n", stream) >= 0;
+    });
+    EXPECT_TRUE(writer.flush());
+    EXPECT_EQ("done\n", read_test_file(filename));
+
+    writer.write(filename, [](FILE * /*stream*/) { return false; });
+    EXPECT_FALSE(writer.flush());
+    unlink(filename.c_str());
+}
+
+
+}  // namespace argweaver